@@ -0,0 +1,249 @@
+// Pool of aligned I/O buffers.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sys/mman.h>
+#include "BufferPool.hpp"
+#include "MiscUtils.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+BufferPool bufferPool;
+
+
+/// Huge page size (transparent huge pages).
+static constexpr size_t hugePageSize = 2 * 1024 * 1024;
+
+
+Buffer& Buffer::operator=(Buffer&& other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        pool = other.pool;
+        ptr = other.ptr;
+        len = other.len;
+        other.ptr = nullptr;
+        other.len = 0;
+    }
+    return *this;
+}
+
+
+void Buffer::release() noexcept
+{
+    if (ptr)
+    {
+        pool->put(ptr, len);
+        ptr = nullptr;
+        len = 0;
+    }
+}
+
+
+BufferPool::~BufferPool()
+{
+    for (char* ptr: freeBuffers)
+    {
+        deallocate(ptr, bufferSize);
+    }
+}
+
+
+void BufferPool::configure(size_t bufferSize_, uint64_t budget_, bool hugePages_)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (char* ptr: freeBuffers)
+    {
+        deallocate(ptr, bufferSize);
+        allocatedBytes -= bufferSize;
+    }
+    freeBuffers.clear();
+    hugePages = hugePages_;
+    size_t granularity = hugePages ? hugePageSize : alignment;
+    bufferSize = std::max<size_t>((bufferSize_ + granularity - 1) / granularity * granularity, granularity);
+    budget = budget_;
+}
+
+
+Buffer BufferPool::get(size_t size)
+{
+    return std::move(get(size, 1)[0]);
+}
+
+
+std::vector<Buffer> BufferPool::get(size_t size, size_t count)
+{
+    std::vector<Buffer> r(count);
+    if ((size == 0) || (count == 0))
+    {
+        return r;
+    }
+
+    // All buffers up to bufferSize have the same size. Larger buffers are allocated on demand.
+    size = (size <= bufferSize) ? bufferSize : (size + alignment - 1) / alignment * alignment;
+    uint64_t need = uint64_t(size) * count;
+    std::vector<char*> ptrs;
+    ptrs.reserve(count);
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&] { return (usedBytes == 0) || (usedBytes + need <= budget); });
+        usedBytes += need;
+        try
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                if ((size == bufferSize) && !freeBuffers.empty())
+                {
+                    ptrs.push_back(freeBuffers.back());
+                    freeBuffers.pop_back();
+                    continue;
+                }
+
+                // Free unused buffers to stay within the budget.
+                while ((allocatedBytes + size > budget) && !freeBuffers.empty())
+                {
+                    deallocate(freeBuffers.back(), bufferSize);
+                    freeBuffers.pop_back();
+                    allocatedBytes -= bufferSize;
+                }
+                ptrs.push_back(allocate(size));
+                allocatedBytes += size;
+                peakBytes = std::max(peakBytes, allocatedBytes);
+            }
+        }
+        catch (...)
+        {
+            usedBytes -= need;
+            for (char* ptr: ptrs)
+            {
+                deallocate(ptr, size);
+                allocatedBytes -= size;
+            }
+            cond.notify_all();
+            throw;
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        r[i] = Buffer(this, ptrs[i], size);
+    }
+    return r;
+}
+
+
+uint64_t BufferPool::getPeakBytes()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return peakBytes;
+}
+
+
+void BufferPool::put(char* ptr, size_t size) noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        usedBytes -= size;
+        bool keep = false;
+        if (size == bufferSize)
+        {
+            try
+            {
+                freeBuffers.push_back(ptr);
+                keep = true;
+            }
+            catch (...)
+            {
+            }
+        }
+        if (!keep)
+        {
+            deallocate(ptr, size);
+            allocatedBytes -= size;
+        }
+    }
+    cond.notify_all();
+}
+
+
+char* BufferPool::allocate(size_t size)
+{
+    void* ptr = nullptr;
+    if (::posix_memalign(&ptr, hugePages ? hugePageSize : alignment, size) != 0)
+    {
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (hugePages)
+    {
+        ::madvise(ptr, size, MADV_HUGEPAGE);
+    }
+#endif
+    return static_cast<char*>(ptr);
+}
+
+
+void BufferPool::deallocate(char* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+
+UNIT_TEST(BufferPool)
+{
+    BufferPool pool;
+    pool.configure(1, 2 * BufferPool::alignment, false);
+    ASSERT_EQ(pool.getBufferSize(), BufferPool::alignment);
+    Buffer a = pool.get(1);
+    ASSERT_EQ(a.size(), BufferPool::alignment);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(a.data()) % BufferPool::alignment, 0u);
+    const char* p = a.data();
+    (void)p;
+    a.release();
+    ASSERT_EQ(a.data(), nullptr);
+
+    // Released buffers are reused.
+    std::vector<Buffer> b = pool.get(BufferPool::alignment, 2);
+    ASSERT_EQ(b[0].data() == p || b[1].data() == p, true);
+    ASSERT_EQ(pool.get(0).size(), 0u);
+
+    // The budget is exhausted: Wait for a release.
+    std::atomic<bool> done{false};
+    std::thread t([&]
+    {
+        Buffer c = pool.get(1);
+        done = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ASSERT_EQ(bool(done), false);
+    b.clear();
+    t.join();
+    ASSERT_EQ(bool(done), true);
+
+    // Requests larger than the budget are served when nothing else is in use.
+    Buffer d = pool.get(3 * BufferPool::alignment);
+    ASSERT_EQ(d.size(), 3 * BufferPool::alignment);
+    d.release();
+    ASSERT_EQ(pool.getPeakBytes(), 3 * BufferPool::alignment);
+}
+
+
+} // namespace ut1
@@ -0,0 +1,120 @@
+// Pool of aligned I/O buffers.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+namespace ut1
+{
+
+class BufferPool;
+
+/// I/O buffer borrowed from a BufferPool.
+/// The memory is aligned to BufferPool::alignment (suitable for O_DIRECT) and is returned to the pool on destruction.
+class Buffer
+{
+public:
+    Buffer() = default;
+    ~Buffer() { release(); }
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+    Buffer(Buffer&& other) noexcept : pool(other.pool), ptr(other.ptr), len(other.len) { other.ptr = nullptr; other.len = 0; }
+    Buffer& operator=(Buffer&& other) noexcept;
+
+    char* data() noexcept { return ptr; }
+    const char* data() const noexcept { return ptr; }
+    size_t size() const noexcept { return len; }
+    char& operator[](size_t i) noexcept { return ptr[i]; }
+    const char& operator[](size_t i) const noexcept { return ptr[i]; }
+
+    /// Return buffer to the pool.
+    void release() noexcept;
+
+private:
+    friend class BufferPool;
+    Buffer(BufferPool* pool_, char* ptr_, size_t size_) : pool(pool_), ptr(ptr_), len(size_) {}
+
+    BufferPool* pool{};
+    char* ptr{};
+    size_t len{};
+};
+
+/// Thread safe pool of fixed size aligned I/O buffers with a memory budget.
+///
+/// All buffers have the same size (bufferSize) and are kept for reuse once released, so streaming many files does not
+/// allocate memory per file. Larger requests get a dedicated allocation which is freed on release.
+/// The memory of all buffers (in use and free) never exceeds the budget: get() blocks until enough buffers are released.
+/// A single request which exceeds the budget on its own is served once no other buffer is in use.
+/// To avoid deadlocks a thread must request all buffers it needs at the same time in one get() call.
+class BufferPool
+{
+public:
+    /// Alignment of all buffers (and of their size).
+    static constexpr size_t alignment = 4096;
+
+    /// Default buffer size.
+    static constexpr size_t defaultBufferSize = 1024 * 1024;
+
+    /// Default memory budget.
+    static constexpr uint64_t defaultBudget = 64 * 1024 * 1024;
+
+    BufferPool() = default;
+    ~BufferPool();
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    /// Set the buffer size, the memory budget and whether buffers should be backed by (transparent) huge pages.
+    /// This must be called before any buffer is borrowed.
+    void configure(size_t bufferSize_, uint64_t budget_, bool hugePages_);
+
+    /// Get the buffer size.
+    size_t getBufferSize() const noexcept { return bufferSize; }
+
+    /// Get buffer of at least size bytes. The content is undefined.
+    Buffer get(size_t size);
+
+    /// Get count buffers of at least size bytes each at the same time.
+    std::vector<Buffer> get(size_t size, size_t count);
+
+    /// Get the peak amount of memory allocated for buffers.
+    uint64_t getPeakBytes();
+
+private:
+    friend class Buffer;
+
+    /// Return buffer to the pool.
+    void put(char* ptr, size_t size) noexcept;
+
+    /// Allocate/free memory.
+    char* allocate(size_t size);
+    void deallocate(char* ptr, size_t size) noexcept;
+
+    size_t bufferSize{defaultBufferSize};
+    uint64_t budget{defaultBudget};
+    bool hugePages{};
+
+    std::mutex mutex;
+    std::condition_variable cond;
+
+    /// Free buffers of size bufferSize.
+    std::vector<char*> freeBuffers;
+
+    /// Memory of all allocated buffers and of the buffers in use.
+    uint64_t allocatedBytes{};
+    uint64_t usedBytes{};
+    uint64_t peakBytes{};
+};
+
+/// Process wide buffer pool used by the file I/O, copy and delta transfer functions.
+extern BufferPool bufferPool;
+
+} // namespace ut1
@@ -0,0 +1,372 @@
+// Delta transfer (rsync algorithm) for local files.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <unordered_map>
+#include <filesystem>
+#include "DeltaTransfer.hpp"
+#include "FileIo.hpp"
+#include "DirFd.hpp"
+#include "BufferPool.hpp"
+#include "MiscUtils.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+namespace
+{
+
+/// Weak rolling checksum as used by rsync (two 16 bit sums).
+class RollingChecksum
+{
+public:
+    void init(const uint8_t* data, size_t len_)
+    {
+        a = 0;
+        b = 0;
+        len = uint32_t(len_);
+        for (size_t i = 0; i < len_; i++)
+        {
+            a += data[i];
+            b += uint32_t(len_ - i) * data[i];
+        }
+    }
+
+    /// Move window by one byte: Remove byte out at the front and append byte in at the back.
+    void roll(uint8_t out, uint8_t in)
+    {
+        a += uint32_t(in) - uint32_t(out);
+        b += a - len * uint32_t(out);
+    }
+
+    uint32_t digest() const { return (a & 0xffff) | (b << 16); }
+
+private:
+    uint32_t a{};
+    uint32_t b{};
+    uint32_t len{};
+};
+
+
+/// Strong block hash (64 bit FNV-1a).
+uint64_t strongHash(const uint8_t* data, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+/// Block of the destination file.
+struct Block
+{
+    uint64_t strong;
+    uint64_t offset;
+};
+
+
+/// Choose block size: Roughly sqrt(fileSize) rounded up to a power of two, limited to [1k, 128k].
+size_t chooseBlockSize(uint64_t fileSize)
+{
+    size_t blockSize = 1024;
+    while ((blockSize < 128 * 1024) && (uint64_t(blockSize) * blockSize < fileSize))
+    {
+        blockSize *= 2;
+    }
+    return blockSize;
+}
+
+} // namespace
+
+
+DeltaResult deltaUpdateFile(const std::string& srcFilename, const std::string& dstFilename, bool inplace, size_t blockSize)
+{
+    DeltaResult r;
+    File src(srcFilename, O_RDONLY);
+    File dst(dstFilename, inplace ? O_RDWR : O_RDONLY);
+    uint64_t dstSize = dst.getSize();
+    if (blockSize == 0)
+    {
+        blockSize = chooseBlockSize(dstSize);
+    }
+
+    // Block buffer and sliding buffer over the source file.
+    size_t bufSize = std::max(blockSize * 4, bufferPool.getBufferSize());
+    std::vector<Buffer> bufs = bufferPool.get(bufSize, 2);
+    uint8_t* blockBuf = reinterpret_cast<uint8_t*>(bufs[0].data());
+    uint8_t* buf = reinterpret_cast<uint8_t*>(bufs[1].data());
+
+    // Compute block signatures of the destination file.
+    // Not needed in place: Only the block at the same offset can be reused there, so it is compared directly.
+    std::unordered_multimap<uint32_t, Block> blocks;
+    if (!inplace)
+    {
+        blocks.reserve(dstSize / blockSize);
+    }
+    for (uint64_t offset = 0; (!inplace) && (offset + blockSize <= dstSize); offset += blockSize)
+    {
+        if (dst.pread(blockBuf, blockSize, offset) != blockSize)
+        {
+            break;
+        }
+        RollingChecksum sum;
+        sum.init(blockBuf, blockSize);
+        blocks.emplace(sum.digest(), Block{strongHash(blockBuf, blockSize), offset});
+        dst.dropCache(offset, blockSize);
+    }
+
+    // Open output file.
+    File tmp;
+    std::string tmpFilename;
+    if (!inplace)
+    {
+        std::filesystem::path dstPath(dstFilename);
+        tmpFilename = (dstPath.parent_path() / ("." + dstPath.filename().string() + ".treesync-tmp")).string();
+        tmp.open(tmpFilename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    }
+
+    try
+    {
+        // The sliding buffer always contains all pending literal data, i.e. [litStart, bufOffset + bufLen).
+        uint64_t bufOffset = 0; // File offset of buf[0].
+        size_t bufLen = 0;
+        bool eof = false;
+        uint64_t pos = 0; // Start of the current window.
+        uint64_t litStart = 0; // Start of pending literal data.
+        uint64_t tmpDropped = 0; // Data of tmp before this offset was dropped from the page cache.
+
+        auto flushLiteral = [&](uint64_t end)
+        {
+            if (end > litStart)
+            {
+                const uint8_t* p = &buf[litStart - bufOffset];
+                if (inplace)
+                {
+                    dst.pwrite(p, end - litStart, litStart);
+                }
+                else
+                {
+                    tmp.write(p, end - litStart);
+                }
+                r.literalBytes += end - litStart;
+            }
+            litStart = end;
+        };
+
+        // Make sure [pos, pos + blockSize) is in the buffer (unless at EOF).
+        auto fill = [&]()
+        {
+            if (eof || (pos + blockSize <= bufOffset + bufLen))
+            {
+                return;
+            }
+            flushLiteral(pos);
+            src.dropCache(bufOffset, pos - bufOffset);
+            if (!inplace)
+            {
+                uint64_t tmpSize = r.literalBytes + r.matchedBytes;
+                tmp.dropCache(tmpDropped, tmpSize - tmpDropped, true);
+                tmpDropped = tmpSize;
+            }
+            size_t keep = bufOffset + bufLen - pos;
+            std::memmove(buf, &buf[pos - bufOffset], keep);
+            bufOffset = pos;
+            bufLen = keep;
+            size_t n = src.read(&buf[bufLen], bufSize - bufLen);
+            eof = n < bufSize - bufLen;
+            bufLen += n;
+        };
+
+        RollingChecksum sum;
+        bool sumValid = false;
+        for (;;)
+        {
+            fill();
+            if (bufOffset + bufLen - pos < blockSize)
+            {
+                break;
+            }
+            const uint8_t* p = &buf[pos - bufOffset];
+            if (inplace)
+            {
+                // Step block by block: Reuse the block at pos iff it is unchanged.
+                bool matched = (pos + blockSize <= dstSize) && (dst.pread(blockBuf, blockSize, pos) == blockSize) && (std::memcmp(blockBuf, p, blockSize) == 0);
+                if (matched)
+                {
+                    flushLiteral(pos);
+                    r.matchedBytes += blockSize;
+                }
+                pos += blockSize;
+                if (matched)
+                {
+                    litStart = pos;
+                }
+                continue;
+            }
+            if (!sumValid)
+            {
+                sum.init(p, blockSize);
+                sumValid = true;
+            }
+
+            // Look for a matching block.
+            bool matched = false;
+            auto range = blocks.equal_range(sum.digest());
+            if (range.first != range.second)
+            {
+                uint64_t strong = strongHash(p, blockSize);
+                for (auto it = range.first; it != range.second; ++it)
+                {
+                    if (it->second.strong != strong)
+                    {
+                        continue;
+                    }
+                    if ((dst.pread(blockBuf, blockSize, it->second.offset) != blockSize) || (std::memcmp(blockBuf, p, blockSize) != 0))
+                    {
+                        continue;
+                    }
+                    flushLiteral(pos);
+                    tmp.write(blockBuf, blockSize);
+                    r.matchedBytes += blockSize;
+                    pos += blockSize;
+                    litStart = pos;
+                    sumValid = false;
+                    matched = true;
+                    break;
+                }
+            }
+
+            if (!matched)
+            {
+                // Roll window by one byte.
+                uint8_t out = p[0];
+                pos++;
+                fill();
+                if (bufOffset + bufLen - pos < blockSize)
+                {
+                    break;
+                }
+                sum.roll(out, buf[pos + blockSize - 1 - bufOffset]);
+            }
+        }
+
+        // Remaining literal data.
+        uint64_t srcSize = bufOffset + bufLen;
+        flushLiteral(srcSize);
+        src.dropCache(0, 0);
+        dst.dropCache(0, 0, inplace);
+
+        if (inplace)
+        {
+            dst.truncate(srcSize);
+        }
+        else
+        {
+            struct stat st;
+            if (::fstat(src.getFd(), &st) == 0)
+            {
+                ::fchmod(tmp.getFd(), st.st_mode & 07777);
+            }
+            tmp.dropCache(0, 0, true);
+            tmp.close();
+            renameAt(tmpFilename, dstFilename);
+        }
+    }
+    catch (...)
+    {
+        if (!inplace)
+        {
+            try
+            {
+                unlinkAt(tmpFilename, false);
+            }
+            catch (const std::exception&)
+            {
+                // Keep the original error.
+            }
+        }
+        throw;
+    }
+
+    return r;
+}
+
+
+UNIT_TEST(deltaUpdateFile)
+{
+    std::string srcFilename = "DeltaTransferTmpSrc";
+    std::string dstFilename = "DeltaTransferTmpDst";
+
+    // Pseudo random old content.
+    std::string old(64 * 1024, '\0');
+    uint32_t seed = 1;
+    for (char& c: old)
+    {
+        seed = seed * 1103515245 + 12345;
+        c = char(seed >> 16);
+    }
+
+    // New content: Insertion near the start and modification near the end.
+    std::string updated = old.substr(0, 1000) + "inserted" + old.substr(1000);
+    updated[60000] ^= 1;
+    writeFile(srcFilename, updated);
+    writeFile(dstFilename, old);
+    DeltaResult r = deltaUpdateFile(srcFilename, dstFilename, false, 1024);
+    ASSERT_EQ(readFile(dstFilename), updated);
+    ASSERT_EQ(r.literalBytes, 2 * 1024u + 8u);
+    ASSERT_EQ(r.matchedBytes, updated.size() - r.literalBytes);
+
+    // In place: Only blocks at the same offset can be reused.
+    updated = old;
+    updated[60000] ^= 1;
+    writeFile(srcFilename, updated);
+    writeFile(dstFilename, old);
+    r = deltaUpdateFile(srcFilename, dstFilename, true, 1024);
+    ASSERT_EQ(readFile(dstFilename), updated);
+    ASSERT_EQ(r.literalBytes, 1024u);
+    ASSERT_EQ(r.matchedBytes, 63 * 1024u);
+
+    // In place: Shifted blocks are not searched for.
+    updated = old.substr(0, 1000) + "inserted" + old.substr(1000);
+    writeFile(srcFilename, updated);
+    writeFile(dstFilename, old);
+    r = deltaUpdateFile(srcFilename, dstFilename, true, 1024);
+    ASSERT_EQ(readFile(dstFilename), updated);
+    ASSERT_EQ(r.literalBytes, updated.size());
+    ASSERT_EQ(r.matchedBytes, 0u);
+
+    // Empty/short files.
+    writeFile(srcFilename, "abc");
+    writeFile(dstFilename, "");
+    deltaUpdateFile(srcFilename, dstFilename, false);
+    ASSERT_EQ(readFile(dstFilename), "abc");
+    writeFile(srcFilename, "");
+    deltaUpdateFile(srcFilename, dstFilename, true);
+    ASSERT_EQ(readFile(dstFilename), "");
+
+    std::remove(srcFilename.c_str());
+    std::remove(dstFilename.c_str());
+}
+
+
+} // namespace ut1
@@ -0,0 +1,40 @@
+// Delta transfer (rsync algorithm) for local files.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+namespace ut1
+{
+
+/// Result of deltaUpdateFile().
+struct DeltaResult
+{
+    /// Number of bytes taken from the source file.
+    uint64_t literalBytes{};
+
+    /// Number of bytes taken from matching blocks of the old destination file.
+    uint64_t matchedBytes{};
+};
+
+/// Update dstFilename to the content of srcFilename, reusing blocks which are already present in dstFilename.
+///
+/// The destination file is split into blocks of blockSize bytes and a weak rolling checksum
+/// and a strong hash are computed for each block. The source file is then scanned with the rolling
+/// checksum to find these blocks at arbitrary offsets. Candidate blocks are verified byte by byte before
+/// they are reused, so checksum collisions can never corrupt the destination.
+///
+/// - inplace == false: The new content is assembled in a temp file next to dstFilename which then replaces dstFilename.
+/// - inplace == true: dstFilename is modified in place. Only blocks matching at the same offset can be reused,
+///   so the source file is compared block by block against the destination file without rolling checksums.
+///
+/// blockSize == 0 selects a block size based on the size of dstFilename.
+DeltaResult deltaUpdateFile(const std::string& srcFilename, const std::string& dstFilename, bool inplace, size_t blockSize = 0);
+
+} // namespace ut1
@@ -0,0 +1,157 @@
+// Storage device detection.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <sys/stat.h>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#endif
+#include "DeviceInfo.hpp"
+#include "MiscUtils.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+std::string getDeviceTypeStr(DeviceType type)
+{
+    switch (type)
+    {
+    case DT_UNKNOWN: return "unknown";
+    case DT_ROTATIONAL: return "rotational";
+    case DT_SSD: return "ssd";
+    case DT_NVME: return "nvme";
+    case DT_NETWORK: return "network";
+    }
+    return "unknown-device-type";
+}
+
+
+unsigned DeviceInfo::getQueueDepth() const
+{
+    unsigned depth = 4;
+    switch (type)
+    {
+    case DT_ROTATIONAL: depth = 1; break;
+    case DT_NVME:
+    case DT_NETWORK: depth = 32; break;
+    case DT_SSD:
+    case DT_UNKNOWN: depth = 4; break;
+    }
+    if (nrRequests > 0)
+    {
+        depth = std::min(depth, nrRequests);
+    }
+    return depth;
+}
+
+
+#ifdef __linux__
+/// Read the first word of a sysfs attribute. Return an empty string on errors.
+static std::string readSysAttribute(const std::filesystem::path& path)
+{
+    std::ifstream is(path);
+    std::string value;
+    is >> value;
+    return value;
+}
+#endif
+
+
+DeviceInfo getDeviceInfo(const std::string& path)
+{
+    DeviceInfo r;
+    std::error_code ec;
+    std::filesystem::path p = std::filesystem::absolute(path.empty() ? "." : path, ec);
+    struct stat st;
+    while (::stat(p.c_str(), &st) != 0)
+    {
+        if (ec || (p == p.root_path()))
+        {
+            return r;
+        }
+        p = p.parent_path();
+    }
+    r.dev = st.st_dev;
+
+#ifdef __linux__
+    // Network filesystems.
+    struct statfs fs;
+    if (::statfs(p.c_str(), &fs) == 0)
+    {
+        switch (static_cast<unsigned long>(fs.f_type))
+        {
+        case 0x6969: r.name = "nfs"; break;
+        case 0x517b: r.name = "smb"; break;
+        case 0xff534d42: r.name = "cifs"; break;
+        case 0xfe534d42: r.name = "smb2"; break;
+        case 0x47504653: r.name = "gpfs"; break;
+        case 0x0bd00bd0: r.name = "lustre"; break;
+        default: break;
+        }
+        if (!r.name.empty())
+        {
+            r.type = DT_NETWORK;
+            return r;
+        }
+    }
+
+    // Block device: /sys/dev/block/MAJOR:MINOR, with the queue in the parent dir for partitions.
+    std::filesystem::path sysPath = std::filesystem::canonical("/sys/dev/block/" + std::to_string(major(st.st_dev)) + ":" + std::to_string(minor(st.st_dev)), ec);
+    if (ec)
+    {
+        return r;
+    }
+    if (!std::filesystem::exists(sysPath / "queue", ec))
+    {
+        sysPath = sysPath.parent_path();
+    }
+    std::string rotational = readSysAttribute(sysPath / "queue" / "rotational");
+    if (rotational.empty())
+    {
+        return r;
+    }
+    r.name = sysPath.filename().string();
+    r.type = (rotational == "1") ? DT_ROTATIONAL : (hasPrefix(r.name, "nvme") ? DT_NVME : DT_SSD);
+    std::string nrRequests = readSysAttribute(sysPath / "queue" / "nr_requests");
+    if (!nrRequests.empty() && (nrRequests.find_first_not_of("0123456789") == std::string::npos))
+    {
+        r.nrRequests = unsigned(std::stoul(nrRequests));
+    }
+#endif
+    return r;
+}
+
+
+UNIT_TEST(getDeviceInfo)
+{
+    DeviceInfo info = getDeviceInfo(".");
+    ASSERT_EQ(info.getQueueDepth() >= 1, true);
+    ASSERT_EQ(getDeviceInfo("./DeviceInfoTmpDoesNotExist/a/b").dev, info.dev);
+
+    DeviceInfo hdd;
+    hdd.type = DT_ROTATIONAL;
+    ASSERT_EQ(hdd.getQueueDepth(), 1u);
+    DeviceInfo nvme;
+    nvme.type = DT_NVME;
+    ASSERT_EQ(nvme.getQueueDepth(), 32u);
+    nvme.nrRequests = 8;
+    ASSERT_EQ(nvme.getQueueDepth(), 8u);
+}
+
+
+} // namespace ut1
@@ -0,0 +1,47 @@
+// Storage device detection.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <string>
+#include <sys/types.h>
+
+namespace ut1
+{
+
+/// Kind of storage device.
+enum DeviceType { DT_UNKNOWN, DT_ROTATIONAL, DT_SSD, DT_NVME, DT_NETWORK };
+
+/// Get device type name.
+std::string getDeviceTypeStr(DeviceType type);
+
+/// Storage device backing a file or dir.
+struct DeviceInfo
+{
+    /// Device of the filesystem (st_dev).
+    dev_t dev{};
+
+    DeviceType type{DT_UNKNOWN};
+
+    /// Block device name (e.g. "sda", "nvme0n1") or filesystem type for network filesystems.
+    std::string name;
+
+    /// Maximum number of requests of the block device queue (0 if unknown).
+    unsigned nrRequests{};
+
+    /// Get the suggested number of concurrent I/O operations:
+    /// Rotational disks 1, SSDs 4, NVMe and network filesystems 32, unknown 4. This is limited by nrRequests.
+    unsigned getQueueDepth() const;
+};
+
+/// Get the device backing path.
+/// If path does not exist the closest existing parent dir is used.
+/// The device type is determined by the filesystem type (network filesystems) and by the block device queue
+/// attributes in /sys/dev/block (partitions use the queue of their disk). Everything else is DT_UNKNOWN.
+DeviceInfo getDeviceInfo(const std::string& path);
+
+} // namespace ut1
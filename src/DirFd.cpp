@@ -0,0 +1,675 @@
+// Filesystem operations relative to cached directory file descriptors.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+#include <algorithm>
+#include "DirFd.hpp"
+#include "MiscUtils.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+DirFdCache dirFdCache;
+
+
+namespace
+{
+
+/// Flags for opening dirs: O_PATH (where available) just pins the dir and needs no read permission.
+#ifdef O_PATH
+constexpr int dirFlags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+#else
+constexpr int dirFlags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+#endif
+
+
+/// Get the cache key of path: path without trailing separators ("/" for the root dir).
+std::string_view getKey(std::string_view path)
+{
+    while ((path.length() > 1) && (path.back() == '/'))
+    {
+        path.remove_suffix(1);
+    }
+    return path;
+}
+
+
+/// Get the key of the parent dir of key ("" for the current working directory).
+std::string_view getParentKey(std::string_view key)
+{
+    size_t pos = key.rfind('/');
+    if (pos == std::string_view::npos)
+    {
+        return std::string_view();
+    }
+    return getKey(key.substr(0, std::max<size_t>(pos, 1)));
+}
+
+
+/// Get the last component of key.
+std::string getName(std::string_view key)
+{
+    size_t pos = key.rfind('/');
+    return std::string((pos == std::string_view::npos) ? key : key.substr(pos + 1));
+}
+
+
+[[noreturn]] void throwError(const std::string& function, const std::string& path)
+{
+    throw std::runtime_error(function + "(" + path + "): " + std::strerror(errno));
+}
+
+
+/// Call function(dirFd, name) for the last component of path relative to the cached descriptor of its parent dir.
+/// A cached parent which turns out to be removed is reopened once.
+/// Return the result of function or -1 (with errno set) if the parent cannot be opened.
+template<typename Function>
+int callAt(const std::filesystem::path& path, const Function& function)
+{
+    std::string_view key = getKey(path.native());
+    if (key == "/")
+    {
+        return function(AT_FDCWD, "/");
+    }
+    std::string_view parent = getParentKey(key);
+    std::string name = getName(key);
+    for (int retry = 0; ; retry++)
+    {
+        DirFdCache::Ptr dir = dirFdCache.tryGet(parent);
+        if (!dir)
+        {
+            return -1;
+        }
+        int r = function(dir->get(), name.c_str());
+        if ((r < 0) && (errno == ENOENT) && (retry == 0) && dir->isRemoved())
+        {
+            dirFdCache.invalidate(parent);
+            continue;
+        }
+        return r;
+    }
+}
+
+} // namespace
+
+
+DirFd::~DirFd()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+}
+
+
+bool DirFd::isRemoved() const
+{
+    int error = errno;
+    struct stat st;
+    bool removed = (fd >= 0) && (::fstat(fd, &st) == 0) && (st.st_nlink == 0);
+    errno = error;
+    return removed;
+}
+
+
+DirFdCache::DirFdCache(size_t maxFds_)
+: maxFds(maxFds_ ? maxFds_ : getDefaultMaxFds())
+, cwd(std::make_shared<DirFd>(AT_FDCWD))
+{
+}
+
+
+size_t DirFdCache::getDefaultMaxFds()
+{
+    struct rlimit limit;
+    if ((::getrlimit(RLIMIT_NOFILE, &limit) != 0) || (limit.rlim_cur == RLIM_INFINITY))
+    {
+        return 1024;
+    }
+    return std::clamp<size_t>(size_t(limit.rlim_cur / 4), 8, 1024);
+}
+
+
+DirFdCache::Ptr DirFdCache::get(std::string_view dir)
+{
+    Ptr dirFd = tryGet(dir);
+    if (!dirFd)
+    {
+        throwError("openat", std::string(dir));
+    }
+    return dirFd;
+}
+
+
+DirFdCache::Ptr DirFdCache::tryGet(std::string_view dir)
+{
+    std::string_view key = getKey(dir);
+    for (;;)
+    {
+        // Find the nearest cached ancestor. The dirs below it are then opened one component at a time.
+        std::vector<std::string_view> missing;
+        Ptr base = cwd;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (std::string_view k = key; !k.empty(); k = getParentKey(k))
+            {
+                auto it = entries.find(k);
+                if (it != entries.end())
+                {
+                    lru.splice(lru.begin(), lru, it->second);
+                    base = it->second->second;
+                    break;
+                }
+                missing.push_back(k);
+                if (k == "/")
+                {
+                    break;
+                }
+            }
+        }
+
+        Ptr dirFd = base;
+        bool stale = false;
+        for (auto it = missing.rbegin(); it != missing.rend(); ++it)
+        {
+            int fd = (*it == "/") ? ::open("/", dirFlags) : ::openat(dirFd->get(), getName(*it).c_str(), dirFlags);
+            if (fd < 0)
+            {
+                if ((errno == ENOENT) && (dirFd == base) && base->isRemoved())
+                {
+                    // The cached ancestor was removed (and possibly recreated): Forget it and start over.
+                    std::lock_guard<std::mutex> lock(mutex);
+                    erase(getParentKey(missing.back()));
+                    stale = true;
+                    break;
+                }
+                return nullptr;
+            }
+            dirFd = std::make_shared<DirFd>(fd);
+            std::lock_guard<std::mutex> lock(mutex);
+            numOpened++;
+            insert(std::string(*it), dirFd);
+        }
+        if (!stale)
+        {
+            return dirFd;
+        }
+    }
+}
+
+
+void DirFdCache::invalidate(std::string_view path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    erase(getKey(path));
+}
+
+
+void DirFdCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    lru.clear();
+}
+
+
+size_t DirFdCache::size()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return lru.size();
+}
+
+
+uint64_t DirFdCache::getNumOpened()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return numOpened;
+}
+
+
+void DirFdCache::insert(const std::string& key, const Ptr& dirFd)
+{
+    auto it = entries.find(key);
+    if (it != entries.end())
+    {
+        it->second->second = dirFd;
+        lru.splice(lru.begin(), lru, it->second);
+        return;
+    }
+    lru.emplace_front(key, dirFd);
+    entries[key] = lru.begin();
+    while (lru.size() > maxFds)
+    {
+        entries.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+
+void DirFdCache::erase(std::string_view key)
+{
+    if (key.empty())
+    {
+        // Everything relative to the current working directory.
+        for (auto it = entries.begin(); it != entries.end();)
+        {
+            if (it->first[0] == '/')
+            {
+                ++it;
+                continue;
+            }
+            lru.erase(it->second);
+            it = entries.erase(it);
+        }
+        return;
+    }
+
+    auto it = entries.find(key);
+    if (it != entries.end())
+    {
+        lru.erase(it->second);
+        entries.erase(it);
+    }
+    std::string prefix(key);
+    if (key != "/")
+    {
+        prefix += '/';
+    }
+    for (it = entries.lower_bound(prefix); (it != entries.end()) && hasPrefix(it->first, prefix);)
+    {
+        lru.erase(it->second);
+        it = entries.erase(it);
+    }
+}
+
+
+bool statAt(const std::filesystem::path& path, struct stat& statData, bool followSymlinks)
+{
+    int r = callAt(path, [&](int dirFd, const char* name) { return ::fstatat(dirFd, name, &statData, followSymlinks ? 0 : AT_SYMLINK_NOFOLLOW); });
+    if (r < 0)
+    {
+        if ((errno == ENOENT) || (errno == ENOTDIR))
+        {
+            return false;
+        }
+        throwError("fstatat", path);
+    }
+    return true;
+}
+
+
+StatInfo getStatAt(const std::filesystem::path& path, bool followSymlinks)
+{
+    StatInfo stat;
+    if (!statAt(path, stat.statData, followSymlinks))
+    {
+        throwError("fstatat", path);
+    }
+    return stat;
+}
+
+
+int openAt(const std::filesystem::path& path, int flags, mode_t mode)
+{
+    return callAt(path, [&](int dirFd, const char* name) { return ::openat(dirFd, name, flags | O_CLOEXEC, mode); });
+}
+
+
+std::string readlinkAt(const std::filesystem::path& path)
+{
+    std::string target(256, '\0');
+    for (;;)
+    {
+        ssize_t n = -1;
+        if (callAt(path, [&](int dirFd, const char* name) { n = ::readlinkat(dirFd, name, &target[0], target.size()); return int(std::min<ssize_t>(n, 0)); }) < 0)
+        {
+            throwError("readlinkat", path);
+        }
+        if (size_t(n) < target.size())
+        {
+            target.resize(size_t(n));
+            return target;
+        }
+        target.resize(target.size() * 2);
+    }
+}
+
+
+bool mkdirAt(const std::filesystem::path& path, mode_t mode)
+{
+    if (callAt(path, [&](int dirFd, const char* name) { return ::mkdirat(dirFd, name, mode); }) < 0)
+    {
+        if (errno == EEXIST)
+        {
+            return false;
+        }
+        throwError("mkdirat", path);
+    }
+    return true;
+}
+
+
+void unlinkAt(const std::filesystem::path& path, bool dir)
+{
+    if (callAt(path, [&](int dirFd, const char* name) { return ::unlinkat(dirFd, name, dir ? AT_REMOVEDIR : 0); }) < 0)
+    {
+        throwError("unlinkat", path);
+    }
+    dirFdCache.invalidate(path.native());
+}
+
+
+void setMTimeAt(const std::filesystem::path& path, const struct timespec& mtime, bool followSymlinks)
+{
+    struct timespec t[2];
+    t[0].tv_sec = 0;
+    t[0].tv_nsec = UTIME_OMIT;
+    t[1] = mtime;
+    if (callAt(path, [&](int dirFd, const char* name) { return ::utimensat(dirFd, name, t, followSymlinks ? 0 : AT_SYMLINK_NOFOLLOW); }) < 0)
+    {
+        throwError("utimensat", path);
+    }
+}
+
+
+void symlinkAt(const std::string& target, const std::filesystem::path& path)
+{
+    if (callAt(path, [&](int dirFd, const char* name) { return ::symlinkat(target.c_str(), dirFd, name); }) < 0)
+    {
+        throwError("symlinkat", path);
+    }
+}
+
+
+void renameAt(const std::filesystem::path& from, const std::filesystem::path& to)
+{
+    DirFdCache::Ptr toDir = dirFdCache.get(getParentKey(getKey(to.native())));
+    std::string toName = getName(getKey(to.native()));
+    if (callAt(from, [&](int dirFd, const char* name) { return ::renameat(dirFd, name, toDir->get(), toName.c_str()); }) < 0)
+    {
+        throwError("renameat", from);
+    }
+    dirFdCache.invalidate(from.native());
+    dirFdCache.invalidate(to.native());
+}
+
+
+std::string readFileAt(const std::filesystem::path& path)
+{
+    int fd = openAt(path, O_RDONLY);
+    if (fd < 0)
+    {
+        throwError("openat", path);
+    }
+    std::string data;
+    char buf[65536];
+    for (;;)
+    {
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            int error = errno;
+            ::close(fd);
+            errno = error;
+            throwError("read", path);
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        data.append(buf, size_t(n));
+    }
+    ::close(fd);
+    return data;
+}
+
+
+FileType getFileTypeAt(const std::filesystem::path& path, bool followSymlinks)
+{
+    struct stat st;
+    if (!statAt(path, st, /*followSymlinks=*/false))
+    {
+        return FT_NON_EXISTING;
+    }
+    if (S_ISLNK(st.st_mode) && followSymlinks && !statAt(path, st, /*followSymlinks=*/true))
+    {
+        // Broken symlink.
+        return FT_SYMLINK;
+    }
+    return getFileTypeFromMode(st.st_mode);
+}
+
+
+DirEntry::DirEntry(const std::filesystem::path& path_)
+: entryPath(path_)
+, type(getFileTypeAt(path_, /*followSymlinks=*/false))
+{
+}
+
+
+FileType DirEntry::getType(bool followSymlinks) const
+{
+    if ((type == FT_SYMLINK) && followSymlinks)
+    {
+        return getFileTypeAt(entryPath, /*followSymlinks=*/true);
+    }
+    return type;
+}
+
+
+uint64_t DirEntry::getSize() const
+{
+    return uint64_t(getStatAt(entryPath).statData.st_size);
+}
+
+
+DirReader::DirReader(const std::filesystem::path& dir_)
+: dir(dir_)
+{
+    int fd = openAt(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        throwError("openat", dir);
+    }
+    handle = ::fdopendir(fd);
+    if (!handle)
+    {
+        ::close(fd);
+        throwError("fdopendir", dir);
+    }
+}
+
+
+DirReader::~DirReader()
+{
+    if (handle)
+    {
+        ::closedir(handle);
+    }
+}
+
+
+bool DirReader::next(DirEntry& entry)
+{
+    for (;;)
+    {
+        errno = 0;
+        struct dirent* d = ::readdir(handle);
+        if (!d)
+        {
+            if (errno != 0)
+            {
+                throwError("readdir", dir);
+            }
+            return false;
+        }
+        if ((std::strcmp(d->d_name, ".") == 0) || (std::strcmp(d->d_name, "..") == 0))
+        {
+            continue;
+        }
+        FileType type = FT_NON_EXISTING;
+        switch (d->d_type)
+        {
+        case DT_REG: type = FT_REGULAR; break;
+        case DT_DIR: type = FT_DIR; break;
+        case DT_LNK: type = FT_SYMLINK; break;
+        case DT_FIFO: type = FT_FIFO; break;
+        case DT_BLK: type = FT_BLOCK; break;
+        case DT_CHR: type = FT_CHAR; break;
+        case DT_SOCK: type = FT_SOCKET; break;
+        default:
+        {
+            // Filesystem without d_type: Just resolve the name relative to the dir.
+            struct stat st;
+            if (::fstatat(::dirfd(handle), d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+                if (errno == ENOENT)
+                {
+                    // Removed in the meantime.
+                    continue;
+                }
+                throwError("fstatat", dir / d->d_name);
+            }
+            type = getFileTypeFromMode(st.st_mode);
+            break;
+        }
+        }
+        entry = DirEntry(dir / d->d_name, type);
+        return true;
+    }
+}
+
+
+UNIT_TEST(DirFdCache)
+{
+    std::filesystem::create_directories("DirFdTmp/a/b/c");
+    DirFdCache cache(2);
+    ASSERT_EQ(cache.get("DirFdTmp/a/b/")->get() >= 0, true);
+    ASSERT_EQ(cache.getNumOpened(), 3u);
+    ASSERT_EQ(cache.size(), 2u);
+
+    // Just the last component is opened relative to the cached parent.
+    DirFdCache::Ptr c = cache.get("DirFdTmp/a/b/c");
+    ASSERT_EQ(cache.getNumOpened(), 4u);
+    cache.get("DirFdTmp/a/b/c");
+    ASSERT_EQ(cache.getNumOpened(), 4u);
+
+    // Evicted descriptors stay valid while in use.
+    cache.get("DirFdTmp");
+    cache.get("DirFdTmp/a");
+    struct stat st;
+    ASSERT_EQ(::fstat(c->get(), &st), 0);
+    ASSERT_EQ(S_ISDIR(st.st_mode), true);
+
+    // Removed dirs are reopened.
+    c = nullptr;
+    cache.get("DirFdTmp/a/b");
+    std::filesystem::remove_all("DirFdTmp/a");
+    std::filesystem::create_directories("DirFdTmp/a/b/c");
+    uint64_t opened = cache.getNumOpened();
+    ASSERT_EQ(cache.get("DirFdTmp/a/b/c")->get() >= 0, true);
+    ASSERT_EQ(cache.getNumOpened(), opened + 4);
+    ASSERT_EQ(cache.tryGet("DirFdTmp/x") == nullptr, true);
+    (void)opened;
+
+    cache.invalidate("DirFdTmp");
+    ASSERT_EQ(cache.size(), 0u);
+    std::filesystem::remove_all("DirFdTmp");
+    (void)st;
+}
+
+
+UNIT_TEST(DirFd_operations)
+{
+    std::filesystem::create_directories("DirFdTmp/a");
+    ASSERT_EQ(mkdirAt("DirFdTmp/a/d"), true);
+    ASSERT_EQ(mkdirAt("DirFdTmp/a/d"), false);
+    int fd = openAt("DirFdTmp/a/d/f", O_WRONLY | O_CREAT | O_TRUNC);
+    ASSERT_EQ(fd >= 0, true);
+    ::close(fd);
+    std::filesystem::create_symlink("d/f", "DirFdTmp/a/l");
+    ASSERT_EQ(readlinkAt("DirFdTmp/a/l"), "d/f");
+    struct stat st;
+    ASSERT_EQ(statAt("DirFdTmp/a/l", st, false) && S_ISLNK(st.st_mode), true);
+    ASSERT_EQ(statAt("DirFdTmp/a/l", st, true) && S_ISREG(st.st_mode), true);
+    ASSERT_EQ(statAt("DirFdTmp/a/x", st), false);
+    ASSERT_EQ(statAt("DirFdTmp/a/x/y", st), false);
+    ASSERT_EQ(statAt("/", st) && S_ISDIR(st.st_mode), true);
+
+    struct timespec mtime = {1000000000, 123456789};
+    setMTimeAt("DirFdTmp/a/d/f", mtime);
+    ASSERT_EQ(getStatAt("DirFdTmp/a/l").getMTimeSpec().tv_nsec, 123456789);
+
+    // Remove and recreate a dir behind the back of the cache.
+    std::filesystem::remove_all("DirFdTmp/a/d");
+    std::filesystem::create_directories("DirFdTmp/a/d");
+    writeFile("DirFdTmp/a/d/g", "x");
+    ASSERT_EQ(statAt("DirFdTmp/a/d/g", st), true);
+
+    // Paths longer than PATH_MAX work since the kernel only resolves single components.
+    std::filesystem::path deep = "DirFdTmp/a/d";
+    std::string name(100, 'n');
+    for (int i = 0; i < 50; i++)
+    {
+        deep /= name;
+        mkdirAt(deep);
+    }
+    fd = openAt(deep / "f", O_WRONLY | O_CREAT | O_TRUNC);
+    ASSERT_EQ(fd >= 0, true);
+    ::close(fd);
+    ASSERT_EQ(statAt(deep / "f", st) && S_ISREG(st.st_mode), true);
+    symlinkAt("f", deep / "l");
+    renameAt(deep / "f", deep / "g");
+    renameAt(deep / "g", deep / "f");
+    ASSERT_EQ(readFileAt(deep / "l"), "");
+    ASSERT_EQ(getFileTypeAt(deep / "l", false), FT_SYMLINK);
+    ASSERT_EQ(getFileTypeAt(deep / "l", true), FT_REGULAR);
+    ASSERT_EQ(DirEntry(deep / "l").getSize(), 0u);
+    std::vector<std::string> names;
+    DirReader reader(deep);
+    for (DirEntry entry; reader.next(entry);)
+    {
+        names.push_back(entry.path().filename().string() + ":" + getFileTypeStr(entry, false));
+    }
+    std::sort(names.begin(), names.end());
+    ASSERT_EQ(joinStrings(names, ","), "f:file,l:symlink");
+    unlinkAt(deep / "l", false);
+    unlinkAt(deep / "f", false);
+    for (int i = 0; i < 50; i++)
+    {
+        unlinkAt(deep, true);
+        deep = deep.parent_path();
+    }
+
+    unlinkAt("DirFdTmp/a/d/g", false);
+    unlinkAt("DirFdTmp/a/d", true);
+    ASSERT_EQ(statAt("DirFdTmp/a/d", st), false);
+    std::filesystem::remove_all("DirFdTmp");
+    (void)st;
+}
+
+
+} // namespace ut1
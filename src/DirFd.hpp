@@ -0,0 +1,203 @@
+// Filesystem operations relative to cached directory file descriptors.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <map>
+#include <filesystem>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+#include "MiscUtils.hpp"
+
+namespace ut1
+{
+
+/// Open directory file descriptor (closed by the destructor).
+class DirFd
+{
+public:
+    explicit DirFd(int fd_) : fd(fd_) {}
+    ~DirFd();
+    DirFd(const DirFd&) = delete;
+    DirFd& operator=(const DirFd&) = delete;
+
+    /// Get file descriptor (AT_FDCWD for the current working directory).
+    int get() const noexcept { return fd; }
+
+    /// Return true iff the directory was removed after it was opened.
+    bool isRemoved() const;
+
+private:
+    int fd;
+};
+
+/// Cache of directory file descriptors with LRU eviction.
+///
+/// A directory which is not in the cache is opened relative to its nearest cached ancestor, one path component at a time, so the
+/// kernel never walks a full path twice. Operations on the entries of a directory (see statAt() etc.) then just resolve one name.
+/// The cache holds at most maxFds descriptors. Descriptors handed out stay open until the last user releases them, even when evicted.
+///
+/// Directories removed behind the back of the cache are detected (removed directories have no links) and reopened.
+/// Directories must not be renamed while they are cached, since their descriptors follow them to the new location.
+/// All functions are thread safe.
+class DirFdCache
+{
+public:
+    using Ptr = std::shared_ptr<const DirFd>;
+
+    /// Constructor. maxFds == 0 selects getDefaultMaxFds().
+    explicit DirFdCache(size_t maxFds_ = 0);
+
+    /// Get the default size of the cache: A quarter of the RLIMIT_NOFILE soft limit (between 8 and 1024),
+    /// leaving the other descriptors to the files opened at the same time.
+    static size_t getDefaultMaxFds();
+
+    /// Get a descriptor of dir (following symlinks). The empty path is the current working directory.
+    /// Throw std::runtime_error if dir cannot be opened.
+    Ptr get(std::string_view dir);
+
+    /// Like get(), but return nullptr (with errno set) if dir cannot be opened.
+    Ptr tryGet(std::string_view dir);
+
+    /// Remove path and all cached dirs below it from the cache (after removing or replacing path).
+    void invalidate(std::string_view path);
+
+    /// Close all cached descriptors.
+    void clear();
+
+    /// Get the number of cached descriptors.
+    size_t size();
+
+    /// Get the maximum number of cached descriptors.
+    size_t getMaxFds() const { return maxFds; }
+
+    /// Get the number of directories opened so far (cache misses).
+    uint64_t getNumOpened();
+
+private:
+    using Lru = std::list<std::pair<std::string, Ptr>>;
+
+    /// Insert or replace an entry and evict the least recently used entries.
+    /// The mutex must be locked.
+    void insert(const std::string& key, const Ptr& dirFd);
+
+    /// Remove key and all keys below it.
+    /// The mutex must be locked.
+    void erase(std::string_view key);
+
+    size_t maxFds;
+    Ptr cwd;
+    std::mutex mutex;
+    Lru lru;
+    std::map<std::string, Lru::iterator, std::less<>> entries;
+    uint64_t numOpened{};
+};
+
+extern DirFdCache dirFdCache;
+
+/// The following functions resolve the parent dir of path through dirFdCache and operate on the last component of path relative to it (*at() syscalls).
+/// Except for openAt() they throw std::runtime_error on errors.
+
+/// Get stat() (followSymlinks) or lstat() information.
+/// Return false if path does not exist.
+bool statAt(const std::filesystem::path& path, struct stat& statData, bool followSymlinks = true);
+
+/// Get stat() or lstat() information (like getStat(), but path must exist).
+StatInfo getStatAt(const std::filesystem::path& path, bool followSymlinks = true);
+
+/// Open file (see open(2)). Return the file descriptor or -1 (with errno set) on errors.
+int openAt(const std::filesystem::path& path, int flags, mode_t mode = 0644);
+
+/// Read symbolic link.
+std::string readlinkAt(const std::filesystem::path& path);
+
+/// Create directory. Return false if path already exists.
+bool mkdirAt(const std::filesystem::path& path, mode_t mode = 0777);
+
+/// Remove file, symlink or empty dir.
+void unlinkAt(const std::filesystem::path& path, bool dir);
+
+/// Set the modification time (without changing the access time).
+void setMTimeAt(const std::filesystem::path& path, const struct timespec& mtime, bool followSymlinks = true);
+
+/// Create symbolic link path pointing to target.
+void symlinkAt(const std::string& target, const std::filesystem::path& path);
+
+/// Rename from to to (replacing to).
+void renameAt(const std::filesystem::path& from, const std::filesystem::path& to);
+
+/// Read the whole file (following symlinks).
+std::string readFileAt(const std::filesystem::path& path);
+
+/// Get the file type of path (see getFileType()) through statAt().
+FileType getFileTypeAt(const std::filesystem::path& path, bool followSymlinks = true);
+
+/// Entry of a dir: Path and file type (not following symlinks).
+///
+/// Unlike std::filesystem::directory_entry, nothing resolves the full path: The type of entries read by DirReader comes from the
+/// listing (d_type) and everything else goes through statAt(), so paths longer than PATH_MAX work.
+class DirEntry
+{
+public:
+    DirEntry() = default;
+
+    /// Constructor. Get the type of path with statAt() (FT_NON_EXISTING if path does not exist).
+    explicit DirEntry(const std::filesystem::path& path_);
+
+    /// Constructor for an entry of known type (not following symlinks).
+    DirEntry(const std::filesystem::path& path_, FileType type_) : entryPath(path_), type(type_) {}
+
+    const std::filesystem::path& path() const noexcept { return entryPath; }
+    operator const std::filesystem::path&() const noexcept { return entryPath; }
+
+    /// Get the file type. Broken symlinks are reported as FT_SYMLINK, even when following symlinks.
+    FileType getType(bool followSymlinks = true) const;
+
+    /// Get the size in bytes (following symlinks).
+    uint64_t getSize() const;
+
+    bool operator<(const DirEntry& other) const { return entryPath < other.entryPath; }
+
+private:
+    std::filesystem::path entryPath;
+    FileType type{FT_NON_EXISTING};
+};
+
+/// Get the file type of entry (see DirEntry::getType()).
+inline FileType getFileType(const DirEntry& entry, bool followSymlinks = true) { return entry.getType(followSymlinks); }
+
+/// Get the file type string of entry.
+inline std::string getFileTypeStr(const DirEntry& entry, bool followSymlinks = true) { return getFileTypeStr(entry.getType(followSymlinks)); }
+
+/// Reader of the entries of a dir (except "." and "..") in directory order.
+/// The dir is opened relative to the cached descriptor of its parent (fdopendir(openat())), so its path may be longer than PATH_MAX.
+class DirReader
+{
+public:
+    /// Constructor. Open dir (following symlinks). Throw std::runtime_error on errors.
+    explicit DirReader(const std::filesystem::path& dir_);
+    ~DirReader();
+    DirReader(const DirReader&) = delete;
+    DirReader& operator=(const DirReader&) = delete;
+
+    /// Get the next entry. Return false after the last entry. Throw std::runtime_error on errors.
+    bool next(DirEntry& entry);
+
+private:
+    std::filesystem::path dir;
+    DIR* handle{};
+};
+
+} // namespace ut1
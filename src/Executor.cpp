@@ -0,0 +1,499 @@
+// Parallel executor for filesystem operations.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include "Executor.hpp"
+#include "MiscUtils.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+unsigned QueueTuner::update(double throughput, double latency)
+{
+    if (lastThroughput > 0)
+    {
+        if (throughput < lastThroughput * 0.95)
+        {
+            // Worse: Go back.
+            direction = -direction;
+        }
+        else if ((throughput <= lastThroughput * 1.05) && (latency > lastLatency * 1.5))
+        {
+            // No gain, just more latency: Decrease.
+            direction = -1;
+        }
+    }
+    lastThroughput = throughput;
+    lastLatency = latency;
+
+    unsigned step = std::max(depth / 4, 1u);
+    if (direction > 0)
+    {
+        depth = std::min(depth + step, maxDepth);
+    }
+    else
+    {
+        depth = (depth > step) ? (depth - step) : 1;
+    }
+    if ((depth == maxDepth) || (depth == 1))
+    {
+        // Bounce off the limits.
+        direction = (depth == 1) ? 1 : -1;
+    }
+    return depth;
+}
+
+
+Executor::Executor(unsigned numThreads, uint64_t maxInflightBytes_, size_t maxInflightOps_, std::ostream& os_)
+: os(os_)
+, maxInflightBytes(maxInflightBytes_)
+, maxInflightOps(std::max<size_t>(maxInflightOps_, 1))
+, maxQueuedOps(std::max<size_t>(64, maxInflightOps * 8))
+{
+    if (numThreads > 1)
+    {
+        for (unsigned i = 0; i < numThreads; i++)
+        {
+            threads.emplace_back([this] { worker(); });
+        }
+    }
+}
+
+
+Executor::~Executor()
+{
+    if (isParallel())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        workCond.notify_all();
+        for (std::thread& thread: threads)
+        {
+            thread.join();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        flush();
+    }
+}
+
+
+size_t Executor::addQueue(unsigned depth, bool adaptive)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned maxDepth = std::max(unsigned(threads.size()), 1u);
+    queues.emplace_back(std::clamp(depth, 1u, maxDepth), maxDepth, adaptive);
+    return queues.size() - 1;
+}
+
+
+unsigned Executor::getQueueDepth(size_t queue)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return queues.at(queue).depth;
+}
+
+
+void Executor::submit(const std::string& path, uint64_t numBytes, const Function& function, uint32_t queueMask, uint64_t scheduleKey)
+{
+    if (!isParallel())
+    {
+        function(os);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCond.wait(lock, [&] { return (ops.size() < maxQueuedOps) || failure; });
+    if (failure)
+    {
+        std::rethrow_exception(failure);
+    }
+    ops.push_back(std::make_unique<Op>());
+    ops.back()->path = path;
+    ops.back()->numBytes = numBytes;
+    ops.back()->queueMask = queueMask;
+    ops.back()->scheduleKey = scheduleKey;
+    ops.back()->function = function;
+    workCond.notify_one();
+}
+
+
+void Executor::output(const Function& function)
+{
+    if (!isParallel())
+    {
+        function(os);
+        return;
+    }
+
+    std::ostringstream s;
+    function(s);
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCond.wait(lock, [&] { return (ops.size() < maxQueuedOps) || failure; });
+    if (failure)
+    {
+        std::rethrow_exception(failure);
+    }
+    ops.push_back(std::make_unique<Op>());
+    ops.back()->state = DONE;
+    ops.back()->output = s.str();
+    flush();
+}
+
+
+void Executor::wait()
+{
+    if (!isParallel())
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCond.wait(lock, [&] { return ops.empty(); });
+    if (failure)
+    {
+        std::rethrow_exception(failure);
+    }
+}
+
+
+void Executor::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+        Op* op = findRunnable();
+        if (op)
+        {
+            op->state = RUNNING;
+            op->start = Clock::now();
+            inflightBytes += op->numBytes;
+            inflightOps++;
+            for (size_t i = 0; i < queues.size(); i++)
+            {
+                if (op->queueMask & getQueueMask(i))
+                {
+                    queues[i].inflightOps++;
+                }
+            }
+            if (!failure)
+            {
+                lock.unlock();
+                std::ostringstream s;
+                try
+                {
+                    op->function(s);
+                }
+                catch (...)
+                {
+                    op->error = std::current_exception();
+                }
+                op->output = s.str();
+                op->function = nullptr;
+                lock.lock();
+            }
+            op->state = DONE;
+            inflightBytes -= op->numBytes;
+            inflightOps--;
+            finishQueues(*op);
+            flush();
+            doneCond.notify_all();
+            workCond.notify_all();
+            continue;
+        }
+
+        if (stopping && std::none_of(ops.begin(), ops.end(), [](const std::unique_ptr<Op>& op_) { return op_->state == PENDING; }))
+        {
+            break;
+        }
+        workCond.wait(lock);
+    }
+}
+
+
+Executor::Op* Executor::findRunnable()
+{
+    if (inflightOps >= maxInflightOps)
+    {
+        return nullptr;
+    }
+
+    Op* best = nullptr;
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        Op& op = *ops[i];
+        if ((op.state != PENDING) || (best && (op.scheduleKey >= best->scheduleKey)))
+        {
+            continue;
+        }
+
+        // Wait for all earlier unfinished operations on the same subtree.
+        bool blocked = false;
+        for (size_t j = 0; j < i; j++)
+        {
+            if ((ops[j]->state != DONE) && conflicts(ops[j]->path, op.path))
+            {
+                blocked = true;
+                break;
+            }
+        }
+        if (blocked)
+        {
+            continue;
+        }
+
+        // Full I/O queues only block operations using them.
+        for (size_t j = 0; j < queues.size(); j++)
+        {
+            if ((op.queueMask & getQueueMask(j)) && (queues[j].inflightOps >= queues[j].depth))
+            {
+                blocked = true;
+                break;
+            }
+        }
+        if (blocked)
+        {
+            continue;
+        }
+        best = &op;
+        if (op.scheduleKey == 0)
+        {
+            // Nothing can go before it.
+            break;
+        }
+    }
+
+    // Do not overtake an operation which waits for in-flight bytes.
+    if (best && (inflightOps > 0) && (inflightBytes + best->numBytes > maxInflightBytes))
+    {
+        return nullptr;
+    }
+    return best;
+}
+
+
+void Executor::flush()
+{
+    while ((!ops.empty()) && (ops.front()->state == DONE))
+    {
+        if (!failure)
+        {
+            os << ops.front()->output;
+            failure = ops.front()->error;
+        }
+        ops.pop_front();
+    }
+}
+
+
+void Executor::finishQueues(const Op& op)
+{
+    Clock::time_point now = Clock::now();
+    for (size_t i = 0; i < queues.size(); i++)
+    {
+        if (!(op.queueMask & getQueueMask(i)))
+        {
+            continue;
+        }
+        Queue& queue = queues[i];
+        queue.inflightOps--;
+        queue.windowOps++;
+        queue.windowBytes += op.numBytes;
+        queue.windowLatency += std::chrono::duration<double>(now - op.start).count();
+
+        // Tune the depth after each window of at least 200ms and 4 operations per slot.
+        double elapsed = std::chrono::duration<double>(now - queue.windowStart).count();
+        if (queue.adaptive && (elapsed >= 0.2) && (queue.windowOps >= 4 * queue.depth))
+        {
+            // Work: Bytes plus 64k per operation (so metadata heavy workloads are tuned as well).
+            double throughput = (double(queue.windowBytes) + double(queue.windowOps) * 65536.0) / elapsed;
+            queue.depth = queue.tuner.update(throughput, queue.windowLatency / double(queue.windowOps));
+            queue.windowStart = now;
+            queue.windowOps = 0;
+            queue.windowBytes = 0;
+            queue.windowLatency = 0;
+        }
+    }
+}
+
+
+bool Executor::conflicts(const std::string& a, const std::string& b)
+{
+    if (a.length() == b.length())
+    {
+        return a == b;
+    }
+    const std::string& shorter = (a.length() < b.length()) ? a : b;
+    const std::string& longer = (a.length() < b.length()) ? b : a;
+    return hasPrefix(longer, shorter) && ((longer[shorter.length()] == '/') || hasSuffix(shorter, "/"));
+}
+
+
+UNIT_TEST(Executor_conflicts)
+{
+    ASSERT_EQ(Executor::conflicts("a/b", "a/b"), true);
+    ASSERT_EQ(Executor::conflicts("a/b", "a/bc"), false);
+    ASSERT_EQ(Executor::conflicts("a/b", "a/b/c"), true);
+    ASSERT_EQ(Executor::conflicts("a/b/c", "a/b"), true);
+    ASSERT_EQ(Executor::conflicts("a/", "a/b"), true);
+    ASSERT_EQ(Executor::conflicts("a/b", "a/c"), false);
+}
+
+
+UNIT_TEST(QueueTuner)
+{
+    QueueTuner tuner(4, 16);
+    // Throughput improves up to depth 8.
+    auto throughputAt = [](unsigned depth) { return double(std::min(depth, 8u)) - ((depth > 8) ? 0.5 * (depth - 8) : 0.0); };
+    unsigned depth = tuner.getDepth();
+    for (int i = 0; i < 40; i++)
+    {
+        depth = tuner.update(throughputAt(depth), 1.0);
+    }
+    ASSERT_EQ((depth >= 6) && (depth <= 10), true);
+    (void)depth;
+}
+
+
+UNIT_TEST(Executor_queues)
+{
+    std::stringstream s;
+    Executor e(8, 1000000, 16, s);
+    size_t q0 = e.addQueue(1, false);
+    size_t q1 = e.addQueue(3, false);
+    std::mutex mutex;
+    unsigned running[2] = {};
+    unsigned maxRunning[2] = {};
+    for (int i = 0; i < 40; i++)
+    {
+        size_t q = (i % 2) ? q1 : q0;
+        e.submit(std::to_string(i), 0, [&, q](std::ostream&)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                running[q]++;
+                maxRunning[q] = std::max(maxRunning[q], running[q]);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            std::lock_guard<std::mutex> lock(mutex);
+            running[q]--;
+        }, Executor::getQueueMask(q));
+    }
+    e.wait();
+    ASSERT_EQ(maxRunning[q0], 1u);
+    ASSERT_EQ(maxRunning[q1] <= 3, true);
+    ASSERT_EQ(e.getQueueDepth(q1), 3u);
+}
+
+
+UNIT_TEST(Executor_scheduleKey)
+{
+    // Operations waiting behind a slow operation are started in the order of their schedule key. Output stays in submission order.
+    std::stringstream s;
+    std::mutex mutex;
+    std::string started;
+    {
+        Executor e(2, 1000000, 1, s);
+        e.submit("slow", 0, [](std::ostream& os)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            os << "slow\n";
+        });
+        for (int i = 0; i < 5; i++)
+        {
+            e.submit(std::to_string(i), 0, [&, i](std::ostream& os)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                started += std::to_string(i);
+                os << i << "\n";
+            }, 0, uint64_t(10 - i));
+        }
+        e.wait();
+    }
+    ASSERT_EQ(started, "43210");
+    ASSERT_EQ(s.str(), "slow\n0\n1\n2\n3\n4\n");
+}
+
+
+UNIT_TEST(Executor)
+{
+    for (unsigned numThreads: {1u, 8u})
+    {
+        std::stringstream s;
+        std::atomic<int> dirCreated{0};
+        std::atomic<bool> orderOk{true};
+        {
+            Executor e(numThreads, 1000, 4, s);
+            e.submit("d", 10, [&](std::ostream& os)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                dirCreated = 1;
+                os << "mkdir d\n";
+            });
+            for (int i = 0; i < 20; i++)
+            {
+                e.output([&](std::ostream& os) { os << "print " << i << "\n"; });
+                e.submit("d/" + std::to_string(i), 100, [&, i](std::ostream& os)
+                {
+                    if (dirCreated != 1)
+                    {
+                        orderOk = false;
+                    }
+                    os << "copy " << i << "\n";
+                });
+            }
+            e.wait();
+        }
+        std::string ref = "mkdir d\n";
+        for (int i = 0; i < 20; i++)
+        {
+            ref += "print " + std::to_string(i) + "\ncopy " + std::to_string(i) + "\n";
+        }
+        ASSERT_EQ(s.str(), ref);
+        ASSERT_EQ(bool(orderOk), true);
+    }
+
+    // Errors.
+    std::stringstream s;
+    Executor e(4, 1000, 4, s);
+    std::string what;
+    try
+    {
+        for (int i = 0; i < 10; i++)
+        {
+            e.submit(std::to_string(i), 0, [i](std::ostream& os)
+            {
+                os << i;
+                if (i == 3)
+                {
+                    throw std::runtime_error("error");
+                }
+            });
+        }
+        e.wait();
+    }
+    catch (const std::exception& ex)
+    {
+        what = ex.what();
+    }
+    ASSERT_EQ(what, "error");
+    ASSERT_EQ(s.str(), "0123");
+}
+
+
+} // namespace ut1
@@ -0,0 +1,176 @@
+// Parallel executor for filesystem operations.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <iostream>
+#include <chrono>
+#include <cstdint>
+
+namespace ut1
+{
+
+/// Concurrency tuner for an I/O queue.
+/// Hill climbing: The depth is changed step by step in one direction as long as the throughput improves and the direction is
+/// reversed when the throughput gets worse (or when just the latency grows). This finds and tracks the depth at which the device saturates.
+class QueueTuner
+{
+public:
+    QueueTuner(unsigned depth_, unsigned maxDepth_) : depth(depth_), maxDepth(maxDepth_) {}
+
+    /// Get current depth.
+    unsigned getDepth() const { return depth; }
+
+    /// Report the throughput (work per second) and the average latency (seconds) of the last window of operations.
+    /// Return the depth for the next window.
+    unsigned update(double throughput, double latency);
+
+private:
+    unsigned depth;
+    unsigned maxDepth;
+    int direction{1};
+    double lastThroughput{};
+    double lastLatency{};
+};
+
+/// Parallel executor for filesystem operations.
+///
+/// Each operation modifies one path (and everything below it). Operations run on numThreads worker threads with these guarantees:
+/// - Operations on the same path or on paths where one is an ancestor of the other run in submission order, one after the other.
+///   (E.g. a dir is created before files are copied into it and a dst is deleted before it is replaced.)
+/// - At most maxInflightOps operations and maxInflightBytes bytes are in flight (an operation larger than maxInflightBytes runs alone).
+/// - Output is written in submission order, regardless of the order in which operations complete.
+/// - Errors are reported in submission order: The first failing operation (in submission order) stops all output and the
+///   execution of all operations which did not start yet, and its exception is rethrown by submit(), output() or wait().
+///
+/// - Operations can be assigned to I/O queues (usually one per device): At most depth operations of each queue run at the same time.
+///   Operations waiting for a full queue do not block operations of other queues. Adaptive queues tune their depth at run time (QueueTuner).
+/// - Of all operations which can be started, the one with the smallest schedule key is started first (e.g. the location on disk).
+///   Operations with equal keys are started in submission order. This does not change the order of the output.
+///
+/// With numThreads <= 1 all operations run synchronously in submit(), writing directly to os.
+class Executor
+{
+public:
+    /// Operation. All output must be written to the passed stream.
+    using Function = std::function<void(std::ostream& os)>;
+
+    Executor(unsigned numThreads, uint64_t maxInflightBytes_, size_t maxInflightOps_, std::ostream& os_ = std::cout);
+
+    /// Destructor.
+    /// This waits for all submitted operations, but does not throw.
+    ~Executor();
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    /// Add I/O queue with an initial depth. Adaptive queues change their depth between 1 and the number of threads at run time.
+    /// Return the queue index (at most 32 queues).
+    /// This must be called before operations are submitted.
+    size_t addQueue(unsigned depth, bool adaptive);
+
+    /// Get the current depth of queue.
+    unsigned getQueueDepth(size_t queue);
+
+    /// Get the mask for submit() for queue.
+    static uint32_t getQueueMask(size_t queue) { return uint32_t(1) << queue; }
+
+    /// Submit operation modifying path and processing about numBytes bytes.
+    /// The operation uses all queues in queueMask (see getQueueMask()) and is started in the order of scheduleKey.
+    /// This blocks while too many operations are queued.
+    void submit(const std::string& path, uint64_t numBytes, const Function& function, uint32_t queueMask = 0, uint64_t scheduleKey = 0);
+
+    /// Run function on the calling thread and sequence its output with the output of the submitted operations.
+    void output(const Function& function);
+
+    /// Wait until all submitted operations are done.
+    /// Rethrow the exception of the first failed operation.
+    void wait();
+
+    /// Return true iff operations run in parallel.
+    bool isParallel() const { return !threads.empty(); }
+
+    /// Return true iff path a is equal to b or one of them is an ancestor of the other.
+    static bool conflicts(const std::string& a, const std::string& b);
+
+private:
+    enum State { PENDING, RUNNING, DONE };
+
+    using Clock = std::chrono::steady_clock;
+
+    struct Queue
+    {
+        Queue(unsigned depth_, unsigned maxDepth, bool adaptive_) : depth(depth_), adaptive(adaptive_), tuner(depth_, maxDepth) {}
+        unsigned depth;
+        bool adaptive;
+        QueueTuner tuner;
+        size_t inflightOps{};
+
+        /// Operations completed in the current tuning window.
+        Clock::time_point windowStart{Clock::now()};
+        size_t windowOps{};
+        uint64_t windowBytes{};
+        double windowLatency{};
+    };
+
+    struct Op
+    {
+        std::string path;
+        uint64_t numBytes{};
+        uint32_t queueMask{};
+        uint64_t scheduleKey{};
+        Clock::time_point start;
+        Function function;
+        State state{PENDING};
+        std::string output;
+        std::exception_ptr error;
+    };
+
+    /// Worker thread.
+    void worker();
+
+    /// Find the operation with the smallest schedule key which can be started now (or nullptr).
+    /// The mutex must be locked.
+    Op* findRunnable();
+
+    /// Write output of all finished operations at the front of the queue and remove them.
+    /// The mutex must be locked.
+    void flush();
+
+    /// Account a finished operation to its I/O queues and tune their depth.
+    /// The mutex must be locked.
+    void finishQueues(const Op& op);
+
+    std::ostream& os;
+    uint64_t maxInflightBytes;
+    size_t maxInflightOps;
+    size_t maxQueuedOps;
+
+    std::mutex mutex;
+    std::condition_variable workCond;
+    std::condition_variable doneCond;
+    std::vector<std::thread> threads;
+    std::vector<Queue> queues;
+
+    /// Unflushed operations in submission order.
+    std::deque<std::unique_ptr<Op>> ops;
+    uint64_t inflightBytes{};
+    size_t inflightOps{};
+    std::exception_ptr failure;
+    bool stopping{};
+};
+
+} // namespace ut1
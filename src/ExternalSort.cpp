@@ -0,0 +1,362 @@
+// External merge sort of string records.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include "ExternalSort.hpp"
+#include "MiscUtils.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+namespace
+{
+
+/// Approximate memory used by a record in memory (strings plus allocation overhead).
+uint64_t getRecordMemory(const std::string& key, const std::string& value)
+{
+    return key.capacity() + value.capacity() + 2 * sizeof(std::string) + 32;
+}
+
+/// Size of the write buffer and of the read buffer of each run which is being merged.
+constexpr size_t runBufferSize = 64 * 1024;
+
+/// Size of the header of a record (key and value length).
+constexpr size_t recordHeaderSize = 2 * sizeof(uint32_t);
+
+} // namespace
+
+
+ExternalSorter::ExternalSorter(uint64_t memoryBudget_, const std::string& tmpDir_)
+: memoryBudget(memoryBudget_)
+, tmpDir(tmpDir_)
+{
+    // The write buffer and the read buffers of a merge come out of the budget. Records are written before merging,
+    // so both may use most of it.
+    recordBudget = (memoryBudget > 2 * runBufferSize) ? memoryBudget - runBufferSize : memoryBudget / 2;
+    maxFanIn = std::max<size_t>(memoryBudget / runBufferSize, 3) - 1;
+}
+
+
+ExternalSorter::~ExternalSorter()
+{
+    for (FILE* f: {file, spare})
+    {
+        if (f)
+        {
+            std::fclose(f);
+        }
+    }
+}
+
+
+std::string ExternalSorter::getDefaultTmpDir()
+{
+    const char* dir = std::getenv("TMPDIR");
+    return (dir && *dir) ? dir : "/tmp";
+}
+
+
+void ExternalSorter::add(const std::string& key, const std::string& value)
+{
+    records.emplace_back(key, value);
+    memory += getRecordMemory(records.back().first, records.back().second);
+    if (memory > recordBudget)
+    {
+        writeRun();
+    }
+}
+
+
+void ExternalSorter::finish()
+{
+    std::stable_sort(records.begin(), records.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    nextRecord = 0;
+    if (runs.empty())
+    {
+        // Everything fits into memory.
+        return;
+    }
+
+    writeRun();
+    readBuffers.resize(std::min(maxFanIn, runs.size()) * runBufferSize);
+
+    // Intermediate passes: Merge groups of maxFanIn consecutive runs (which keeps equal keys in order) into spare until a single
+    // merge suffices.
+    while (runs.size() > maxFanIn)
+    {
+        if (!spare)
+        {
+            spare = createTmpFile();
+        }
+        if ((::ftruncate(::fileno(spare), 0) != 0) || (std::fseek(spare, 0, SEEK_SET) != 0))
+        {
+            throw std::runtime_error(std::string("ftruncate(run): ") + std::strerror(errno));
+        }
+        std::vector<Run> merged;
+        uint64_t spareSize = 0;
+        std::string key;
+        std::string value;
+        for (size_t first = 0; first < runs.size(); first += maxFanIn)
+        {
+            startMerge(first, std::min(maxFanIn, runs.size() - first));
+            Run run{spareSize, spareSize};
+            while (pop(key, value))
+            {
+                run.end += writeRecord(spare, key, value);
+            }
+            merged.push_back(run);
+            spareSize = run.end;
+        }
+        if (std::fflush(spare) != 0)
+        {
+            throw std::runtime_error(std::string("fflush(run): ") + std::strerror(errno));
+        }
+        std::swap(file, spare);
+        fileSize = spareSize;
+        runs = std::move(merged);
+        numPasses++;
+    }
+    startMerge(0, runs.size());
+}
+
+
+bool ExternalSorter::next(std::string& key, std::string& value)
+{
+    if (runs.empty())
+    {
+        if (nextRecord >= records.size())
+        {
+            return false;
+        }
+        key = std::move(records[nextRecord].first);
+        value = std::move(records[nextRecord].second);
+        nextRecord++;
+        return true;
+    }
+    return pop(key, value);
+}
+
+
+FILE* ExternalSorter::createTmpFile() const
+{
+    std::string filename = tmpDir + "/treesync-sort-XXXXXX";
+    int fd = ::mkstemp(&filename[0]);
+    if (fd < 0)
+    {
+        throw std::runtime_error("mkstemp(" + filename + "): " + std::strerror(errno));
+    }
+    ::unlink(filename.c_str());
+    FILE* f = ::fdopen(fd, "w+");
+    if (!f)
+    {
+        ::close(fd);
+        throw std::runtime_error("fdopen(" + filename + "): " + std::strerror(errno));
+    }
+    std::setvbuf(f, nullptr, _IOFBF, runBufferSize);
+    return f;
+}
+
+
+void ExternalSorter::writeRun()
+{
+    std::stable_sort(records.begin(), records.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    if (!file)
+    {
+        file = createTmpFile();
+    }
+    Run run{fileSize, fileSize};
+    for (const auto& [key, value]: records)
+    {
+        run.end += writeRecord(file, key, value);
+    }
+    if (std::fflush(file) != 0)
+    {
+        throw std::runtime_error(std::string("fflush(run): ") + std::strerror(errno));
+    }
+    runs.push_back(run);
+    fileSize = run.end;
+    numRuns++;
+    records.clear();
+    records.shrink_to_fit();
+    memory = 0;
+}
+
+
+uint64_t ExternalSorter::writeRecord(FILE* f, const std::string& key, const std::string& value)
+{
+    uint32_t len[2] = {uint32_t(key.size()), uint32_t(value.size())};
+    if ((std::fwrite(len, sizeof(len), 1, f) != 1) ||
+        (std::fwrite(key.data(), 1, key.size(), f) != key.size()) ||
+        (std::fwrite(value.data(), 1, value.size(), f) != value.size()))
+    {
+        throw std::runtime_error(std::string("fwrite(run): ") + std::strerror(errno));
+    }
+    return recordHeaderSize + key.size() + value.size();
+}
+
+
+void ExternalSorter::startMerge(size_t first, size_t count)
+{
+    readers.assign(count, Reader());
+    heap.clear();
+    for (size_t i = 0; i < count; i++)
+    {
+        Reader& reader = readers[i];
+        reader.offset = runs[first + i].begin;
+        reader.end = runs[first + i].end;
+        reader.buf = &readBuffers[i * runBufferSize];
+        if (readRecord(reader))
+        {
+            heap.push_back(i);
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), [this](size_t a, size_t b) { return after(a, b); });
+}
+
+
+bool ExternalSorter::pop(std::string& key, std::string& value)
+{
+    if (heap.empty())
+    {
+        return false;
+    }
+    auto order = [this](size_t a, size_t b) { return after(a, b); };
+    std::pop_heap(heap.begin(), heap.end(), order);
+    Reader& reader = readers[heap.back()];
+    key = std::move(reader.key);
+    value = std::move(reader.value);
+    if (readRecord(reader))
+    {
+        std::push_heap(heap.begin(), heap.end(), order);
+    }
+    else
+    {
+        heap.pop_back();
+    }
+    return true;
+}
+
+
+bool ExternalSorter::read(Reader& reader, void* data, size_t n)
+{
+    char* p = static_cast<char*>(data);
+    for (size_t done = 0; done < n;)
+    {
+        if (reader.bufPos == reader.bufLen)
+        {
+            size_t size = size_t(std::min<uint64_t>(runBufferSize, reader.end - reader.offset));
+            if (size == 0)
+            {
+                if (done > 0)
+                {
+                    throw std::runtime_error("pread(run): Truncated run.");
+                }
+                return false;
+            }
+            ssize_t r = ::pread(::fileno(file), reader.buf, size, off_t(reader.offset));
+            if (r <= 0)
+            {
+                throw std::runtime_error(std::string("pread(run): ") + ((r < 0) ? std::strerror(errno) : "Truncated run."));
+            }
+            reader.offset += uint64_t(r);
+            reader.bufPos = 0;
+            reader.bufLen = size_t(r);
+        }
+        size_t chunk = std::min(n - done, reader.bufLen - reader.bufPos);
+        std::memcpy(p + done, reader.buf + reader.bufPos, chunk);
+        reader.bufPos += chunk;
+        done += chunk;
+    }
+    return true;
+}
+
+
+bool ExternalSorter::readRecord(Reader& reader)
+{
+    uint32_t len[2];
+    if (!read(reader, len, sizeof(len)))
+    {
+        return false;
+    }
+    reader.key.resize(len[0]);
+    reader.value.resize(len[1]);
+    if (!read(reader, &reader.key[0], len[0]) || !read(reader, &reader.value[0], len[1]))
+    {
+        throw std::runtime_error("pread(run): Truncated run.");
+    }
+    return true;
+}
+
+
+bool ExternalSorter::after(size_t a, size_t b) const
+{
+    // Equal keys: Earlier runs first (stable).
+    int c = readers[a].key.compare(readers[b].key);
+    return (c > 0) || ((c == 0) && (a > b));
+}
+
+
+UNIT_TEST(ExternalSorter)
+{
+    // Budget 2000: Fan-in 2, so there are several intermediate passes. Budget 300k: Fan-in 3, more runs than that.
+    for (auto [budget, numRecords]: {std::pair<uint64_t, int>(1000000, 2000), std::pair<uint64_t, int>(2000, 2000), std::pair<uint64_t, int>(300000, 20001)})
+    {
+        ExternalSorter sorter(budget, ".");
+        std::vector<std::pair<std::string, std::string>> ref;
+        uint32_t seed = 1;
+        for (int i = 0; i < numRecords; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            std::string key = "name" + std::to_string((seed >> 8) % 500);
+            std::string value = std::to_string(i);
+            sorter.add(key, value);
+            ref.emplace_back(key, value);
+        }
+        sorter.finish();
+        ASSERT_EQ(sorter.getNumRuns() > 0, budget < 1000000);
+        ASSERT_EQ(sorter.getNumRuns() > sorter.getMaxFanIn(), budget < 1000000);
+        ASSERT_EQ(sorter.getNumPasses() > 0, budget < 1000000);
+        std::stable_sort(ref.begin(), ref.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        std::string key;
+        std::string value;
+        size_t n = 0;
+        bool ok = true;
+        while (sorter.next(key, value))
+        {
+            ok = ok && (n < ref.size()) && (ref[n].first == key) && (ref[n].second == value);
+            n++;
+        }
+        ASSERT_EQ(ok, true);
+        ASSERT_EQ(n, ref.size());
+        ASSERT_EQ(sorter.next(key, value), false);
+    }
+
+    // Empty input.
+    ExternalSorter empty(0, ".");
+    empty.finish();
+    std::string key;
+    std::string value;
+    ASSERT_EQ(empty.next(key, value), false);
+}
+
+
+} // namespace ut1
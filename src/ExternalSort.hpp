@@ -0,0 +1,134 @@
+// External merge sort of string records.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstdio>
+
+namespace ut1
+{
+
+/// Sorter for (key, value) string records with bounded memory.
+///
+/// Records are collected in memory until they exceed the memory budget. They are then sorted and appended as a run to a
+/// temporary file. Once all records are added, the runs are merged (k-way merge) while the records are read in key order.
+/// At most getMaxFanIn() runs are merged at once, each with a read buffer taken from the memory budget. If there are more runs,
+/// groups of runs are merged into a second temporary file first (intermediate passes), until a single merge suffices.
+/// So memory and file descriptors (two temporary files) are bounded for any number of records.
+/// Records with equal keys are returned in the order in which they were added.
+/// Small inputs never touch the disk. All functions throw std::runtime_error on errors.
+class ExternalSorter
+{
+public:
+    /// Constructor. Runs are written to unlinked temporary files in tmpDir.
+    explicit ExternalSorter(uint64_t memoryBudget_, const std::string& tmpDir_ = getDefaultTmpDir());
+    ~ExternalSorter();
+    ExternalSorter(const ExternalSorter&) = delete;
+    ExternalSorter& operator=(const ExternalSorter&) = delete;
+
+    /// Get the default dir for temporary files ($TMPDIR or /tmp).
+    static std::string getDefaultTmpDir();
+
+    /// Add record.
+    void add(const std::string& key, const std::string& value);
+
+    /// Finish adding records. Reading starts at the smallest key.
+    void finish();
+
+    /// Get the next record in key order. Return false after the last record.
+    bool next(std::string& key, std::string& value);
+
+    /// Get the number of runs written to disk (not counting the runs of intermediate merge passes).
+    size_t getNumRuns() const { return numRuns; }
+
+    /// Get the number of intermediate merge passes.
+    size_t getNumPasses() const { return numPasses; }
+
+    /// Get the maximum number of runs which are merged at once.
+    size_t getMaxFanIn() const { return maxFanIn; }
+
+private:
+    /// Run: Range of a temporary file.
+    struct Run
+    {
+        uint64_t begin{};
+        uint64_t end{};
+    };
+
+    /// Reader of a run which is being merged.
+    struct Reader
+    {
+        uint64_t offset{};
+        uint64_t end{};
+        char* buf{};
+        size_t bufPos{};
+        size_t bufLen{};
+        std::string key;
+        std::string value;
+    };
+
+    /// Create an unlinked temporary file.
+    FILE* createTmpFile() const;
+
+    /// Sort the records in memory and append them as a new run to file.
+    void writeRun();
+
+    /// Append record to f. Return the number of bytes written.
+    static uint64_t writeRecord(FILE* f, const std::string& key, const std::string& value);
+
+    /// Start merging the count runs starting at runs[first] (of file).
+    void startMerge(size_t first, size_t count);
+
+    /// Get the next record of the current merge. Return false after the last record.
+    bool pop(std::string& key, std::string& value);
+
+    /// Read n bytes of reader into data. Return false at the end of the run (n bytes are either read completely or not at all).
+    bool read(Reader& reader, void* data, size_t n);
+
+    /// Read the next record of reader into reader.key/reader.value. Return false at the end of the run.
+    bool readRecord(Reader& reader);
+
+    /// Return true iff the head of reader a goes after the head of reader b (heap order).
+    bool after(size_t a, size_t b) const;
+
+    uint64_t memoryBudget;
+    std::string tmpDir;
+    std::vector<std::pair<std::string, std::string>> records;
+    uint64_t memory{};
+    size_t nextRecord{};
+
+    /// Memory for records (the budget without the write buffer).
+    uint64_t recordBudget{};
+
+    /// Maximum number of runs merged at once (one read buffer each).
+    size_t maxFanIn{};
+
+    /// Temporary file containing the runs and its size.
+    FILE* file{};
+    uint64_t fileSize{};
+
+    /// Second temporary file for intermediate merge passes.
+    FILE* spare{};
+
+    /// Runs in file.
+    std::vector<Run> runs;
+    size_t numRuns{};
+    size_t numPasses{};
+
+    /// Readers of the current merge and their buffers.
+    std::vector<Reader> readers;
+    std::vector<char> readBuffers;
+
+    /// Min heap of the indices of the readers which are not exhausted.
+    std::vector<size_t> heap;
+};
+
+} // namespace ut1
@@ -0,0 +1,1567 @@
+// Low level file I/O.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include "FileIo.hpp"
+#include "BufferPool.hpp"
+#include "DirFd.hpp"
+#include "MiscUtils.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+IoStats ioStats;
+IoConfig ioConfig;
+
+
+File::~File()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+}
+
+
+File::File(File&& other) noexcept
+: fd(other.fd)
+, direct(other.direct)
+, filename(std::move(other.filename))
+{
+    other.fd = -1;
+    other.direct = false;
+}
+
+
+File& File::operator=(File&& other) noexcept
+{
+    if (this != &other)
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        fd = other.fd;
+        direct = other.direct;
+        filename = std::move(other.filename);
+        other.fd = -1;
+        other.direct = false;
+    }
+    return *this;
+}
+
+
+void File::open(const std::string& filename_, int flags, mode_t mode)
+{
+    close();
+    direct = false;
+    filename = filename_;
+    fd = openAt(filename, flags, mode);
+    if (fd < 0)
+    {
+        throwError("open");
+    }
+    if (ioConfig.noCachePollution)
+    {
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+}
+
+
+File File::reopen(int flags) const
+{
+    File r;
+    r.filename = filename;
+#ifdef __linux__
+    r.fd = ::open(("/proc/self/fd/" + std::to_string(fd)).c_str(), flags | O_CLOEXEC);
+#endif
+    if (r.fd < 0)
+    {
+        r.fd = openAt(filename, flags);
+        if (r.fd < 0)
+        {
+            r.throwError("open");
+        }
+    }
+    if (ioConfig.noCachePollution)
+    {
+        ::posix_fadvise(r.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    r.setDirectIo(direct);
+    return r;
+}
+
+
+void File::close()
+{
+    if (fd >= 0)
+    {
+        int r = ::close(fd);
+        fd = -1;
+        if (r < 0)
+        {
+            throwError("close");
+        }
+    }
+}
+
+
+size_t File::read(void* buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t r = ::read(fd, static_cast<char*>(buf) + done, size - done);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throwError("read");
+        }
+        if (r == 0)
+        {
+            break;
+        }
+        done += size_t(r);
+    }
+    return done;
+}
+
+
+size_t File::pread(void* buf, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        char* p = static_cast<char*>(buf) + done;
+        size_t directSize = getDirectSize(p, size - done, offset + done);
+        bool buffered = direct && (directSize == 0);
+        if (buffered)
+        {
+            setODirect(false);
+        }
+        ssize_t r = ::pread(fd, p, directSize ? directSize : size - done, off_t(offset + done));
+        int err = errno;
+        if (buffered)
+        {
+            setODirect(true);
+        }
+        if (r < 0)
+        {
+            if (err == EINTR)
+            {
+                continue;
+            }
+            if ((err == EINVAL) && (directSize > 0))
+            {
+                // Direct I/O not supported after all.
+                setDirectIo(false);
+                continue;
+            }
+            errno = err;
+            throwError("pread");
+        }
+        if (r == 0)
+        {
+            break;
+        }
+        done += size_t(r);
+    }
+    return done;
+}
+
+
+void File::write(const void* buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t r = ::write(fd, static_cast<const char*>(buf) + done, size - done);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throwError("write");
+        }
+        done += size_t(r);
+    }
+}
+
+
+void File::pwrite(const void* buf, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        const char* p = static_cast<const char*>(buf) + done;
+        size_t directSize = getDirectSize(p, size - done, offset + done);
+        bool buffered = direct && (directSize == 0);
+        if (buffered)
+        {
+            setODirect(false);
+        }
+        ssize_t r = ::pwrite(fd, p, directSize ? directSize : size - done, off_t(offset + done));
+        int err = errno;
+        if (buffered)
+        {
+            setODirect(true);
+        }
+        if (r < 0)
+        {
+            if (err == EINTR)
+            {
+                continue;
+            }
+            if ((err == EINVAL) && (directSize > 0))
+            {
+                // Direct I/O not supported after all.
+                setDirectIo(false);
+                continue;
+            }
+            errno = err;
+            throwError("pwrite");
+        }
+        done += size_t(r);
+    }
+}
+
+
+bool File::setDirectIo(bool enable)
+{
+    if (enable == direct)
+    {
+        return true;
+    }
+    if (!setODirect(enable))
+    {
+        return false;
+    }
+    direct = enable;
+    return true;
+}
+
+
+bool File::setODirect(bool enable)
+{
+#ifdef O_DIRECT
+    int flags = ::fcntl(fd, F_GETFL);
+    if (flags < 0)
+    {
+        return false;
+    }
+    return ::fcntl(fd, F_SETFL, enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT)) == 0;
+#else
+    return !enable;
+#endif
+}
+
+
+size_t File::getDirectSize(const void* buf, size_t size, uint64_t offset) const
+{
+    if ((!direct) || (reinterpret_cast<uintptr_t>(buf) % BufferPool::alignment != 0) || (offset % BufferPool::alignment != 0))
+    {
+        return 0;
+    }
+    return size - size % BufferPool::alignment;
+}
+
+
+void File::truncate(uint64_t size)
+{
+    if (::ftruncate(fd, off_t(size)) < 0)
+    {
+        throwError("ftruncate");
+    }
+}
+
+
+uint64_t File::getSize() const
+{
+    struct stat st;
+    if (::fstat(fd, &st) < 0)
+    {
+        throwError("fstat");
+    }
+    return uint64_t(st.st_size);
+}
+
+
+void File::fsync()
+{
+    if (::fsync(fd) < 0)
+    {
+        throwError("fsync");
+    }
+}
+
+
+void File::readahead(uint64_t offset, uint64_t size) const
+{
+#ifdef __linux__
+    ::readahead(fd, off_t(offset), size);
+#else
+    ::posix_fadvise(fd, off_t(offset), off_t(size), POSIX_FADV_WILLNEED);
+#endif
+}
+
+
+void File::dropCache(uint64_t offset, uint64_t size, bool written) const
+{
+    if (!ioConfig.noCachePollution)
+    {
+        return;
+    }
+#ifdef __linux__
+    if (written)
+    {
+        ::sync_file_range(fd, off_t(offset), off_t(size), SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#else
+    if (written)
+    {
+        ::fdatasync(fd);
+    }
+#endif
+    ::posix_fadvise(fd, off_t(offset), off_t(size), POSIX_FADV_DONTNEED);
+}
+
+
+bool File::isSparse() const
+{
+    struct stat st;
+    if (::fstat(fd, &st) < 0)
+    {
+        throwError("fstat");
+    }
+    return uint64_t(st.st_blocks) * 512 < uint64_t(st.st_size);
+}
+
+
+dev_t File::getDev() const
+{
+    struct stat st;
+    if (::fstat(fd, &st) < 0)
+    {
+        throwError("fstat");
+    }
+    return st.st_dev;
+}
+
+
+bool File::getExtents(std::vector<Extent>& extents, bool sync) const
+{
+    extents.clear();
+#ifdef __linux__
+    const unsigned numExtents = 256;
+    std::vector<uint64_t> buf((sizeof(struct fiemap) + numExtents * sizeof(struct fiemap_extent)) / sizeof(uint64_t) + 1);
+    struct fiemap* fm = reinterpret_cast<struct fiemap*>(buf.data());
+    uint64_t start = 0;
+    for (;;)
+    {
+        std::fill(buf.begin(), buf.end(), 0);
+        fm->fm_start = start;
+        fm->fm_length = FIEMAP_MAX_OFFSET - start;
+        fm->fm_flags = sync ? FIEMAP_FLAG_SYNC : 0;
+        fm->fm_extent_count = numExtents;
+        if (::ioctl(fd, FS_IOC_FIEMAP, fm) < 0)
+        {
+            extents.clear();
+            return false;
+        }
+        if (fm->fm_mapped_extents == 0)
+        {
+            return true;
+        }
+        for (unsigned i = 0; i < fm->fm_mapped_extents; i++)
+        {
+            const struct fiemap_extent& e = fm->fm_extents[i];
+            extents.push_back(Extent{e.fe_logical, e.fe_physical, e.fe_length, e.fe_flags});
+            start = e.fe_logical + e.fe_length;
+            if (e.fe_flags & FIEMAP_EXTENT_LAST)
+            {
+                return true;
+            }
+        }
+    }
+#else
+    return false;
+#endif
+}
+
+
+bool File::getFirstExtent(Extent& extent) const
+{
+#ifdef __linux__
+    std::vector<uint64_t> buf((sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t) + 1);
+    struct fiemap* fm = reinterpret_cast<struct fiemap*>(buf.data());
+    fm->fm_start = 0;
+    fm->fm_length = FIEMAP_MAX_OFFSET;
+    fm->fm_extent_count = 1;
+    if ((::ioctl(fd, FS_IOC_FIEMAP, fm) < 0) || (fm->fm_mapped_extents == 0))
+    {
+        return false;
+    }
+    const struct fiemap_extent& e = fm->fm_extents[0];
+    extent = Extent{e.fe_logical, e.fe_physical, e.fe_length, e.fe_flags};
+    return true;
+#else
+    (void)extent;
+    return false;
+#endif
+}
+
+
+#ifdef __linux__
+// cachestat() (Linux 6.5), not yet declared by all kernel headers.
+#ifndef __NR_cachestat
+#define __NR_cachestat 451
+#endif
+struct CachestatRange
+{
+    uint64_t off;
+    uint64_t len;
+};
+struct Cachestat
+{
+    uint64_t nr_cache;
+    uint64_t nr_dirty;
+    uint64_t nr_writeback;
+    uint64_t nr_evicted;
+    uint64_t nr_recently_evicted;
+};
+#endif
+
+
+double File::getCachedFraction(uint64_t probeSize) const
+{
+    uint64_t size = getSize();
+    if (size == 0)
+    {
+        return 1.0;
+    }
+#ifdef __linux__
+    uint64_t pageSize = uint64_t(::sysconf(_SC_PAGESIZE));
+    CachestatRange range{0, 0};
+    Cachestat cs{};
+    if (::syscall(__NR_cachestat, fd, &range, &cs, 0) == 0)
+    {
+        return std::min(double(cs.nr_cache) / double((size + pageSize - 1) / pageSize), 1.0);
+    }
+
+    // Fall back to mincore() on a small mapping (mapping does not read any data).
+    size_t len = size_t(std::min(size, std::max(probeSize, pageSize)));
+    void* addr = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+        return 0.0;
+    }
+    size_t numPages = (len + pageSize - 1) / pageSize;
+    std::vector<unsigned char> vec(numPages);
+    size_t numCached = 0;
+    if (::mincore(addr, len, vec.data()) == 0)
+    {
+        numCached = size_t(std::count_if(vec.begin(), vec.end(), [](unsigned char c) { return (c & 1) != 0; }));
+    }
+    ::munmap(addr, len);
+    return double(numCached) / double(numPages);
+#else
+    (void)probeSize;
+    return 0.0;
+#endif
+}
+
+
+uint64_t File::getRegionEnd(uint64_t offset, uint64_t limit, bool& isHole) const
+{
+    isHole = false;
+#ifdef SEEK_DATA
+    if (offset >= getSize())
+    {
+        return limit;
+    }
+    off_t data = ::lseek(fd, off_t(offset), SEEK_DATA);
+    if (data < 0)
+    {
+        // ENXIO: Trailing hole.
+        isHole = (errno == ENXIO);
+        return isHole ? std::min(getSize(), limit) : limit;
+    }
+    if (uint64_t(data) > offset)
+    {
+        isHole = true;
+        return std::min<uint64_t>(uint64_t(data), limit);
+    }
+    off_t hole = ::lseek(fd, data, SEEK_HOLE);
+    if (hole < 0)
+    {
+        return limit;
+    }
+    return std::min<uint64_t>(uint64_t(hole), limit);
+#else
+    (void)offset;
+    return limit;
+#endif
+}
+
+
+void File::throwError(const std::string& function) const
+{
+    throw std::runtime_error(function + "(" + filename + "): " + std::strerror(errno));
+}
+
+
+namespace
+{
+
+/// Thread processing the pread() requests of AsyncReaders in order.
+/// The threads are kept per calling thread and reused by all its comparisons (see getReaderThreads()), so comparing many files does
+/// not create threads per file.
+class ReaderThread
+{
+public:
+    ReaderThread() : thread([this] { run(); })
+    {
+    }
+
+    ~ReaderThread()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cond.notify_all();
+        thread.join();
+    }
+
+    ReaderThread(const ReaderThread&) = delete;
+    ReaderThread& operator=(const ReaderThread&) = delete;
+
+    /// Start reading size bytes at offset of file into buf.
+    void start(File& file, char* buf, size_t size, uint64_t offset)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.push_back(Request{&file, buf, size, offset, false, false, 0, nullptr});
+        }
+        cond.notify_all();
+    }
+
+    /// Wait for the oldest request and return the number of bytes read (see File::pread()).
+    size_t wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&] { return requests.front().done; });
+        Request request = requests.front();
+        requests.pop_front();
+        if (request.error)
+        {
+            std::rethrow_exception(request.error);
+        }
+        return request.result;
+    }
+
+    /// Wait for the running request and drop all other requests.
+    void cancel()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        requests.erase(std::remove_if(requests.begin(), requests.end(), [](const Request& request) { return !request.running; }), requests.end());
+        cond.wait(lock, [&] { return std::none_of(requests.begin(), requests.end(), [](const Request& request) { return !request.done; }); });
+        requests.clear();
+    }
+
+private:
+    struct Request
+    {
+        File* file;
+        char* buf;
+        size_t size;
+        uint64_t offset;
+        bool running{};
+        bool done{};
+        size_t result{};
+        std::exception_ptr error;
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            if (stopping)
+            {
+                break;
+            }
+            auto it = std::find_if(requests.begin(), requests.end(), [](const Request& request) { return !request.running; });
+            if (it == requests.end())
+            {
+                cond.wait(lock);
+                continue;
+            }
+            Request& request = *it;
+            request.running = true;
+            lock.unlock();
+            try
+            {
+                request.result = request.file->pread(request.buf, request.size, request.offset);
+            }
+            catch (...)
+            {
+                request.error = std::current_exception();
+            }
+            lock.lock();
+            request.done = true;
+            cond.notify_all();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Request> requests;
+    bool stopping{};
+    std::thread thread;
+};
+
+
+/// Get the two reader threads of the calling thread (created on first use).
+/// A thread only runs one compareBlocks() at a time, so the threads are never shared by two comparisons.
+ReaderThread* getReaderThreads()
+{
+    static thread_local ReaderThread threads[2];
+    return threads;
+}
+
+
+/// Reader for a sequence of pread() requests.
+/// With a reader thread the requests are processed in order on that thread, so reading overlaps with the work of the calling thread.
+/// Otherwise wait() processes the oldest request on the calling thread.
+class AsyncReader
+{
+public:
+    AsyncReader(File& file_, ReaderThread* thread_) : file(file_), thread(thread_)
+    {
+    }
+
+    /// Destructor: Wait for the running request and drop all other requests.
+    ~AsyncReader()
+    {
+        if (thread)
+        {
+            thread->cancel();
+        }
+    }
+
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+
+    /// Start reading size bytes at offset into buf.
+    void start(char* buf, size_t size, uint64_t offset)
+    {
+        if (thread)
+        {
+            thread->start(file, buf, size, offset);
+        }
+        else
+        {
+            requests.push_back(Request{buf, size, offset});
+        }
+    }
+
+    /// Wait for the oldest request and return the number of bytes read (see File::pread()).
+    size_t wait()
+    {
+        if (thread)
+        {
+            return thread->wait();
+        }
+        Request request = requests.front();
+        requests.pop_front();
+        return file.pread(request.buf, request.size, request.offset);
+    }
+
+private:
+    struct Request
+    {
+        char* buf;
+        size_t size;
+        uint64_t offset;
+    };
+
+    File& file;
+    ReaderThread* thread;
+    std::deque<Request> requests;
+};
+
+} // namespace
+
+
+bool compareBlocks(File& a, File& b, uint64_t offset, uint64_t size, size_t blockSize, size_t chunkSize, const std::function<bool(uint64_t, size_t, const char*)>& onDiff)
+{
+    chunkSize = std::min(chunkSize, bufferPool.getBufferSize());
+    chunkSize = std::max(chunkSize - chunkSize % blockSize, blockSize);
+    size_t bufSize = std::min<uint64_t>(chunkSize, size);
+    bool sparse = (size > 0) && (a.isSparse() || b.isSparse());
+    uint64_t end = offset + size;
+
+    // Get the size of the next chunk at pos (0 at the end).
+    // Skip common holes and do not read across the end of a data region/hole.
+    auto nextChunk = [&](uint64_t& pos) -> size_t
+    {
+        while (pos < end)
+        {
+            size_t n = std::min<uint64_t>(bufSize, end - pos);
+            if (!sparse)
+            {
+                return n;
+            }
+            bool holeA = false;
+            bool holeB = false;
+            uint64_t regionEnd = std::min(a.getRegionEnd(pos, end, holeA), b.getRegionEnd(pos, end, holeB));
+            if (!(holeA && holeB))
+            {
+                return std::min<uint64_t>(n, regionEnd - pos);
+            }
+            ioStats.holeBytesSkipped += regionEnd - pos;
+            pos = regionEnd;
+        }
+        return 0;
+    };
+
+    // Files spanning several chunks: Read both files concurrently on two threads and read the next chunk while comparing
+    // the current one (double buffering), so reading a chunk takes the time of the slower file instead of the sum of both.
+    bool concurrent = size >= 4 * uint64_t(bufSize);
+    std::vector<Buffer> bufs = bufferPool.get(bufSize, concurrent ? 4 : 2);
+    ReaderThread* threads = concurrent ? getReaderThreads() : nullptr;
+    AsyncReader readerA(a, threads);
+    AsyncReader readerB(b, threads ? threads + 1 : nullptr);
+    uint64_t chunkOffset[2] = {};
+    size_t chunkSize_[2] = {};
+    uint64_t pos = offset;
+    auto startChunk = [&](size_t slot)
+    {
+        chunkSize_[slot] = nextChunk(pos);
+        chunkOffset[slot] = pos;
+        if (chunkSize_[slot] > 0)
+        {
+            readerA.start(bufs[slot * 2].data(), chunkSize_[slot], pos);
+            readerB.start(bufs[slot * 2 + 1].data(), chunkSize_[slot], pos);
+            pos += chunkSize_[slot];
+        }
+    };
+
+    bool same = true;
+    size_t slot = 0;
+    startChunk(slot);
+    while (chunkSize_[slot] > 0)
+    {
+        size_t nextSlot = concurrent ? (slot ^ 1) : slot;
+        size_t na = readerA.wait();
+        size_t nb = readerB.wait();
+        if (concurrent)
+        {
+            startChunk(nextSlot);
+        }
+        const char* bufA = bufs[slot * 2].data();
+        const char* bufB = bufs[slot * 2 + 1].data();
+        uint64_t chunkPos = chunkOffset[slot];
+        size_t n = chunkSize_[slot];
+        if ((na != n) || (nb != n))
+        {
+            onDiff(chunkPos, na, bufA);
+            return false;
+        }
+        if (std::memcmp(bufA, bufB, n) != 0)
+        {
+            // Find runs of differing blocks.
+            size_t runStart = n;
+            for (size_t i = 0; i < n; i += blockSize)
+            {
+                size_t len = std::min(blockSize, n - i);
+                bool differs = std::memcmp(&bufA[i], &bufB[i], len) != 0;
+                if (differs && (runStart == n))
+                {
+                    runStart = i;
+                }
+                if ((!differs) && (runStart != n))
+                {
+                    same = false;
+                    if (!onDiff(chunkPos + runStart, i - runStart, &bufA[runStart]))
+                    {
+                        return false;
+                    }
+                    runStart = n;
+                }
+            }
+            if (runStart != n)
+            {
+                same = false;
+                if (!onDiff(chunkPos + runStart, n - runStart, &bufA[runStart]))
+                {
+                    return false;
+                }
+            }
+        }
+        a.dropCache(chunkPos, n);
+        b.dropCache(chunkPos, n);
+        if (!concurrent)
+        {
+            startChunk(nextSlot);
+        }
+        slot = nextSlot;
+    }
+    return same;
+}
+
+
+bool compareFileData(File& a, File& b, uint64_t offset, uint64_t size, size_t blockSize)
+{
+    return compareBlocks(a, b, offset, size, blockSize, blockSize, [](uint64_t, size_t, const char*) { return false; });
+}
+
+
+bool compareFileDataParallel(File& a, File& b, uint64_t offset, uint64_t size, unsigned numThreads, uint64_t rangeSize, uint64_t* firstDifference)
+{
+    uint64_t end = offset + size;
+    rangeSize = std::max<uint64_t>(rangeSize, 4096);
+    std::atomic<uint64_t> nextRange{0};
+    std::atomic<uint64_t> lowestDifference{UINT64_MAX};
+    std::mutex mutex;
+    std::exception_ptr error;
+    auto worker = [&]()
+    {
+        try
+        {
+            // File::pread() toggles O_DIRECT for unaligned transfers, so each thread needs its own open file descriptions.
+            File fileA = a.reopen(O_RDONLY);
+            File fileB = b.reopen(O_RDONLY);
+            for (;;)
+            {
+                uint64_t start = offset + nextRange++ * rangeSize;
+                if ((start >= end) || (start >= lowestDifference))
+                {
+                    break;
+                }
+                compareBlocks(fileA, fileB, start, std::min(rangeSize, end - start), 4096, defaultBlockSize, [&](uint64_t diffOffset, size_t, const char*)
+                {
+                    uint64_t lowest = lowestDifference;
+                    while ((diffOffset < lowest) && !lowestDifference.compare_exchange_weak(lowest, diffOffset))
+                    {
+                    }
+                    return false;
+                });
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+            lowestDifference = 0;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < std::max(numThreads, 1u); i++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread: threads)
+    {
+        thread.join();
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+    if (lowestDifference != UINT64_MAX)
+    {
+        if (firstDifference)
+        {
+            *firstDifference = lowestDifference;
+        }
+        return false;
+    }
+    return true;
+}
+
+
+std::vector<std::pair<uint64_t, uint64_t>> getSharedRanges(const File& a, const File& b)
+{
+    std::vector<std::pair<uint64_t, uint64_t>> r;
+#ifdef __linux__
+    struct stat stA;
+    struct stat stB;
+    if ((::fstat(a.getFd(), &stA) < 0) || (::fstat(b.getFd(), &stB) < 0) || (stA.st_dev != stB.st_dev))
+    {
+        return r;
+    }
+    if (stA.st_ino == stB.st_ino)
+    {
+        // Same file.
+        r.emplace_back(0, uint64_t(stA.st_size));
+        return r;
+    }
+
+    // Probe without flushing dirty data first: Writeback can only unshare extents, so files without shared extents stay so.
+    std::vector<Extent> extentsA;
+    std::vector<Extent> extentsB;
+    auto hasShared = [](const std::vector<Extent>& extents)
+    {
+        return std::any_of(extents.begin(), extents.end(), [](const Extent& e) { return (e.flags & FIEMAP_EXTENT_SHARED) != 0; });
+    };
+    if ((!a.getExtents(extentsA, false)) || (!hasShared(extentsA)) || (!b.getExtents(extentsB, false)) || (!hasShared(extentsB)) ||
+        (!a.getExtents(extentsA)) || (!b.getExtents(extentsB)))
+    {
+        return r;
+    }
+
+    // Extents are sorted by logical offset, so walk both lists simultaneously.
+    const uint32_t unstable = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL;
+    size_t ia = 0;
+    size_t ib = 0;
+    while ((ia < extentsA.size()) && (ib < extentsB.size()))
+    {
+        const Extent& ea = extentsA[ia];
+        const Extent& eb = extentsB[ib];
+        uint64_t start = std::max(ea.logical, eb.logical);
+        uint64_t end = std::min(ea.logical + ea.length, eb.logical + eb.length);
+        if ((start < end) && ((ea.flags & unstable) == 0) && ((eb.flags & unstable) == 0) && (ea.physical - ea.logical == eb.physical - eb.logical))
+        {
+            if ((!r.empty()) && (r.back().first + r.back().second == start))
+            {
+                r.back().second += end - start;
+            }
+            else
+            {
+                r.emplace_back(start, end - start);
+            }
+        }
+        if (ea.logical + ea.length <= eb.logical + eb.length)
+        {
+            ia++;
+        }
+        else
+        {
+            ib++;
+        }
+    }
+#else
+    (void)a;
+    (void)b;
+#endif
+    return r;
+}
+
+
+bool compareFiles(const std::string& filenameA, const std::string& filenameB)
+{
+    File a(filenameA, O_RDONLY);
+    File b(filenameB, O_RDONLY);
+    uint64_t size = a.getSize();
+    if (size != b.getSize())
+    {
+        return false;
+    }
+    if (ioConfig.directIo)
+    {
+        a.setDirectIo(true);
+        b.setDirectIo(true);
+    }
+
+    // Large files: Compare ranges in parallel.
+    bool split = (ioConfig.splitThreshold > 0) && (size >= ioConfig.splitThreshold) && (ioConfig.splitThreads > 1);
+    if (split)
+    {
+        ioStats.splitFiles++;
+    }
+    auto compareRange = [&](uint64_t offset, uint64_t rangeSize)
+    {
+        return split ? compareFileDataParallel(a, b, offset, rangeSize, ioConfig.splitThreads) : compareFileData(a, b, offset, rangeSize);
+    };
+
+    // Compare the ranges between the physically shared ranges.
+    uint64_t offset = 0;
+    for (const auto& range: getSharedRanges(a, b))
+    {
+        uint64_t end = std::min(range.first, size);
+        if ((end > offset) && !compareRange(offset, end - offset))
+        {
+            return false;
+        }
+        uint64_t sharedEnd = std::min(range.first + range.second, size);
+        if (sharedEnd > end)
+        {
+            ioStats.sharedBytesSkipped += sharedEnd - end;
+        }
+        offset = std::max(offset, sharedEnd);
+    }
+    return (offset >= size) || compareRange(offset, size - offset);
+}
+
+
+uint64_t rewriteDifferingBlocks(File& src, File& dst, size_t blockSize, size_t chunkSize)
+{
+    uint64_t numBlocks = 0;
+    compareBlocks(src, dst, 0, src.getSize(), blockSize, chunkSize, [&](uint64_t offset, size_t size, const char* data)
+    {
+        dst.pwrite(data, size, offset);
+        dst.dropCache(offset, size, true);
+        numBlocks += (size + blockSize - 1) / blockSize;
+        return true;
+    });
+    return numBlocks;
+}
+
+
+uint64_t copyFileData(File& src, File& dst, uint64_t srcOffset, uint64_t dstOffset, uint64_t size, size_t blockSize)
+{
+    size_t bufSize = std::min<uint64_t>(std::min(blockSize, bufferPool.getBufferSize()), size);
+    Buffer buf = bufferPool.get(bufSize);
+    uint64_t done = 0;
+    while (done < size)
+    {
+        size_t n = src.pread(buf.data(), std::min<uint64_t>(bufSize, size - done), srcOffset + done);
+        if (n == 0)
+        {
+            break;
+        }
+        dst.pwrite(buf.data(), n, dstOffset + done);
+        src.dropCache(srcOffset + done, n);
+        dst.dropCache(dstOffset + done, n, true);
+        done += n;
+    }
+    return done;
+}
+
+
+std::string getCopyMethodStr(CopyMethod copyMethod)
+{
+    switch (copyMethod)
+    {
+    case CM_CLONE: return "clone";
+    case CM_SPARSE: return "sparse";
+    case CM_COPY_FILE_RANGE: return "copy_file_range";
+    case CM_SENDFILE: return "sendfile";
+    case CM_DIRECT: return "direct";
+    case CM_READ_WRITE: return "read/write";
+    }
+    return "unknown-copy-method";
+}
+
+
+#ifdef __linux__
+/// Return true iff errno indicates that a copy method is not supported for a pair of files (rather than an I/O error).
+static bool isUnsupportedError(int err)
+{
+    return (err == ENOSYS) || (err == EXDEV) || (err == EINVAL) || (err == EOPNOTSUPP) || (err == ENOTTY) || (err == EBADF) || (err == ETXTBSY);
+}
+#endif
+
+
+#ifdef __linux__
+/// Get the maximum number of bytes to copy per in-kernel copy syscall.
+/// This is small for ioConfig.noCachePollution, so the copied data can be dropped from the page cache in small windows.
+static size_t getKernelCopyChunkSize()
+{
+    return ioConfig.noCachePollution ? 8 * defaultBlockSize : size_t(1) << 30;
+}
+
+
+/// Copy size bytes at offset from src to dst (same offset), using copy_file_range() if possible.
+static void copyRange(File& src, File& dst, uint64_t offset, uint64_t size)
+{
+    uint64_t done = 0;
+    while ((done < size) && !(src.isDirectIo() && dst.isDirectIo()))
+    {
+        loff_t srcOffset = loff_t(offset + done);
+        loff_t dstOffset = srcOffset;
+        ssize_t r = ::copy_file_range(src.getFd(), &srcOffset, dst.getFd(), &dstOffset, std::min<uint64_t>(size - done, getKernelCopyChunkSize()), 0);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (!isUnsupportedError(errno))
+            {
+                throw std::runtime_error("copy_file_range(" + src.getFilename() + ", " + dst.getFilename() + "): " + std::strerror(errno));
+            }
+            break;
+        }
+        if (r == 0)
+        {
+            return;
+        }
+        src.dropCache(offset + done, uint64_t(r));
+        dst.dropCache(offset + done, uint64_t(r), true);
+        done += uint64_t(r);
+    }
+    copyFileData(src, dst, offset + done, offset + done, size - done);
+}
+#endif
+
+
+CopyMethod copyFile(const std::string& srcFilename, const std::string& dstFilename)
+{
+    File src(srcFilename, O_RDONLY);
+    struct stat srcStat;
+    if (::fstat(src.getFd(), &srcStat) < 0)
+    {
+        throw std::runtime_error("fstat(" + srcFilename + "): " + std::strerror(errno));
+    }
+    File dst(dstFilename, O_WRONLY | O_CREAT | O_TRUNC, srcStat.st_mode & 0777);
+    ::fchmod(dst.getFd(), srcStat.st_mode & 07777);
+    uint64_t size = uint64_t(srcStat.st_size);
+    uint64_t done = 0;
+    bool direct = ioConfig.directIo && src.setDirectIo(true) && dst.setDirectIo(true);
+
+#ifdef __linux__
+    // Reflink.
+    struct stat dstStat;
+    if ((::fstat(dst.getFd(), &dstStat) == 0) && (dstStat.st_dev == srcStat.st_dev))
+    {
+        if (::ioctl(dst.getFd(), FICLONE, src.getFd()) == 0)
+        {
+            dst.close();
+            return CM_CLONE;
+        }
+        if (!isUnsupportedError(errno))
+        {
+            throw std::runtime_error("ioctl(FICLONE, " + srcFilename + ", " + dstFilename + "): " + std::strerror(errno));
+        }
+    }
+
+    // Sparse file: Copy data regions only.
+    if (src.isSparse())
+    {
+        for (uint64_t offset = 0; offset < size;)
+        {
+            bool isHole = false;
+            uint64_t end = src.getRegionEnd(offset, size, isHole);
+            if (isHole)
+            {
+                ioStats.holeBytesSkipped += end - offset;
+            }
+            else
+            {
+                copyRange(src, dst, offset, end - offset);
+            }
+            offset = end;
+        }
+        dst.truncate(size);
+        dst.close();
+        return CM_SPARSE;
+    }
+
+    // In-kernel copy. Both syscalls may copy less than requested, so loop. Fall back to the next method
+    // if a method is not supported, continuing at the current offset.
+    for (CopyMethod method: {CM_COPY_FILE_RANGE, CM_SENDFILE})
+    {
+        if (direct)
+        {
+            // In-kernel copies go through the page cache.
+            break;
+        }
+        while (done < size)
+        {
+            size_t n = std::min<uint64_t>(size - done, getKernelCopyChunkSize());
+            ssize_t r;
+            if (method == CM_COPY_FILE_RANGE)
+            {
+                r = ::copy_file_range(src.getFd(), nullptr, dst.getFd(), nullptr, n, 0);
+            }
+            else
+            {
+                r = ::sendfile(dst.getFd(), src.getFd(), nullptr, n);
+            }
+            if (r < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (isUnsupportedError(errno))
+                {
+                    break;
+                }
+                throw std::runtime_error(getCopyMethodStr(method) + "(" + srcFilename + ", " + dstFilename + "): " + std::strerror(errno));
+            }
+            if (r == 0)
+            {
+                // Source file shrunk.
+                size = done;
+                break;
+            }
+            src.dropCache(done, uint64_t(r));
+            dst.dropCache(done, uint64_t(r), true);
+            done += uint64_t(r);
+        }
+        if (done >= size)
+        {
+            dst.close();
+            return method;
+        }
+    }
+#endif
+
+    // Read/write loop.
+    copyFileData(src, dst, done, done, UINT64_MAX);
+    direct = src.isDirectIo() && dst.isDirectIo();
+    dst.close();
+    return direct ? CM_DIRECT : CM_READ_WRITE;
+}
+
+
+bool isPrefixOf(File& prefix, File& file, size_t blockSize)
+{
+    uint64_t size = prefix.getSize();
+    if (size > file.getSize())
+    {
+        return false;
+    }
+
+    // Check last block first.
+    uint64_t lastBlock = size - std::min<uint64_t>(size, blockSize);
+    if (!compareFileData(prefix, file, lastBlock, size - lastBlock, blockSize))
+    {
+        return false;
+    }
+    return compareFileData(prefix, file, 0, lastBlock, blockSize);
+}
+
+
+UNIT_TEST(File)
+{
+    std::string filename = "FileIoTmp";
+    {
+        File f(filename, O_WRONLY | O_CREAT | O_TRUNC);
+        f.write("abcdef", 6);
+        f.pwrite("XY", 2, 2);
+        ASSERT_EQ(f.getSize(), 6u);
+        f.truncate(5);
+        f.close();
+    }
+    File f(filename, O_RDONLY);
+    std::string buf(16, '\0');
+    ASSERT_EQ(f.read(&buf[0], buf.size()), 5u);
+    ASSERT_EQ(buf.substr(0, 5), "abXYe");
+    ASSERT_EQ(f.pread(&buf[0], 2, 3), 2u);
+    ASSERT_EQ(buf.substr(0, 2), "Ye");
+    ASSERT_EQ(f.pread(&buf[0], 2, 5), 0u);
+    f.close();
+    std::remove(filename.c_str());
+}
+
+
+UNIT_TEST(compareFileData_isPrefixOf)
+{
+    std::string filenameA = "FileIoTmpA";
+    std::string filenameB = "FileIoTmpB";
+    writeFile(filenameA, "abcdefgh");
+    writeFile(filenameB, "abcdefghij");
+    {
+        File a(filenameA, O_RDONLY);
+        File b(filenameB, O_RDWR);
+        ASSERT_EQ(compareFileData(a, b, 0, 8, 3), true);
+        ASSERT_EQ(compareFileData(a, b, 0, 9, 3), false);
+        ASSERT_EQ(isPrefixOf(a, b, 3), true);
+        ASSERT_EQ(isPrefixOf(b, a, 3), false);
+        b.pwrite("X", 1, 1);
+        ASSERT_EQ(compareFileData(a, b, 2, 6, 3), true);
+        ASSERT_EQ(compareFileData(a, b, 0, 8, 3), false);
+        ASSERT_EQ(isPrefixOf(a, b, 3), false);
+        ASSERT_EQ(copyFileData(a, b, 4, 10, 100), 4u);
+    }
+    ASSERT_EQ(readFile(filenameB), "aXcdefghijefgh");
+    ASSERT_EQ(compareFiles(filenameA, filenameB), false);
+    ASSERT_EQ(compareFiles(filenameA, filenameA), true);
+    std::remove(filenameA.c_str());
+    std::remove(filenameB.c_str());
+}
+
+
+UNIT_TEST(copyFile)
+{
+    std::string filenameA = "FileIoTmpA";
+    std::string filenameB = "FileIoTmpB";
+    std::string data(3 * 1024 * 1024 + 17, 'a');
+    data[1234567] = 'b';
+    writeFile(filenameA, data);
+    writeFile(filenameB, "old content which is longer than nothing");
+    copyFile(filenameA, filenameB);
+    ASSERT_EQ(compareFiles(filenameA, filenameB), true);
+    writeFile(filenameA, "");
+    copyFile(filenameA, filenameB);
+    ASSERT_EQ(readFile(filenameB), "");
+    std::remove(filenameA.c_str());
+    std::remove(filenameB.c_str());
+}
+
+
+UNIT_TEST(directIo)
+{
+    std::string filenameA = "FileIoTmpA";
+    std::string filenameB = "FileIoTmpB";
+    std::string data(2 * 1024 * 1024 + 4096 + 17, 'a');
+    data[1234567] = 'b';
+    data[data.size() - 1] = 'c';
+    writeFile(filenameA, data);
+
+    // Aligned and unaligned reads (the latter through the page cache).
+    File f(filenameA, O_RDONLY);
+    if (f.setDirectIo(true))
+    {
+        Buffer buf = bufferPool.get(data.size() + 4096);
+        ASSERT_EQ(f.pread(buf.data(), buf.size(), 0), data.size());
+        ASSERT_EQ(std::string(buf.data(), data.size()), data);
+        ASSERT_EQ(f.pread(buf.data() + 1, 100, 1234560), 100u);
+        ASSERT_EQ(std::string(buf.data() + 1, 100), data.substr(1234560, 100));
+        ASSERT_EQ(f.isDirectIo(), true);
+    }
+    f.close();
+
+    // Direct comparison and copy (or automatic fallback).
+    ioConfig.directIo = true;
+    CopyMethod method = copyFile(filenameA, filenameB);
+    (void)method;
+    ASSERT_EQ((method == CM_DIRECT) || (method == CM_CLONE) || (method == CM_READ_WRITE), true);
+    ASSERT_EQ(readFile(filenameB), data);
+    ASSERT_EQ(compareFiles(filenameA, filenameB), true);
+    data[data.size() - 1] = 'd';
+    writeFile(filenameB, data);
+    ASSERT_EQ(compareFiles(filenameA, filenameB), false);
+    ioConfig.directIo = false;
+    std::remove(filenameA.c_str());
+    std::remove(filenameB.c_str());
+}
+
+
+UNIT_TEST(getCachedFraction)
+{
+    std::string filename = "FileIoTmpA";
+    writeFile(filename, std::string(64 * 1024, 'a'));
+    File f(filename, O_RDONLY);
+    std::string buf(64 * 1024, '\0');
+    ASSERT_EQ(f.pread(buf.data(), buf.size(), 0), buf.size());
+    // Just written and read: Everything is in the page cache.
+    ASSERT_EQ(f.getCachedFraction(), 1.0);
+    writeFile(filename, "");
+    ASSERT_EQ(f.getCachedFraction(), 1.0);
+    std::remove(filename.c_str());
+}
+
+
+UNIT_TEST(getSharedRanges)
+{
+    std::string filenameA = "FileIoTmpA";
+    std::string filenameB = "FileIoTmpB";
+    writeFile(filenameA, std::string(64 * 1024, 'a'));
+    writeFile(filenameB, std::string(64 * 1024, 'a'));
+    File a(filenameA, O_RDONLY);
+    File a2(filenameA, O_RDONLY);
+    File b(filenameB, O_RDONLY);
+
+    // Different files which are not reflinks never share extents.
+    ASSERT_EQ(getSharedRanges(a, b).size(), 0u);
+
+    // A file shares all its extents with itself.
+    std::vector<Extent> extents;
+    if (a.getExtents(extents) && !extents.empty())
+    {
+        std::vector<Extent> unsynced;
+        ASSERT_EQ(a.getExtents(unsynced, false), true);
+        ASSERT_EQ(unsynced.size(), extents.size());
+        Extent first;
+        ASSERT_EQ(a.getFirstExtent(first), true);
+        ASSERT_EQ(first.physical, extents[0].physical);
+        uint64_t skipped = ioStats.sharedBytesSkipped;
+        (void)skipped;
+        std::vector<std::pair<uint64_t, uint64_t>> ranges = getSharedRanges(a, a2);
+        ASSERT_EQ(ranges.size(), 1u);
+        ASSERT_EQ(ranges[0].first, 0u);
+        ASSERT_EQ(ranges[0].second >= 64 * 1024u, true);
+        ASSERT_EQ(compareFiles(filenameA, filenameA), true);
+        ASSERT_EQ(ioStats.sharedBytesSkipped - skipped, 64 * 1024u);
+    }
+    ASSERT_EQ(compareFiles(filenameA, filenameB), true);
+    std::remove(filenameA.c_str());
+    std::remove(filenameB.c_str());
+}
+
+
+UNIT_TEST(sparseFiles)
+{
+    std::string filenameA = "FileIoTmpA";
+    std::string filenameB = "FileIoTmpB";
+    {
+        File a(filenameA, O_WRONLY | O_CREAT | O_TRUNC);
+        a.pwrite("data", 4, 8 * 1024 * 1024);
+        a.truncate(16 * 1024 * 1024);
+    }
+    uint64_t skipped = ioStats.holeBytesSkipped;
+    (void)skipped;
+    copyFile(filenameA, filenameB);
+    ASSERT_EQ(compareFiles(filenameA, filenameB), true);
+    {
+        File a(filenameA, O_RDONLY);
+        File b(filenameB, O_RDWR);
+        ASSERT_EQ(b.getSize(), 16u * 1024 * 1024);
+        if (a.isSparse())
+        {
+            ASSERT_EQ(b.isSparse(), true);
+            ASSERT_EQ(ioStats.holeBytesSkipped > skipped, true);
+        }
+        b.pwrite("x", 1, 12 * 1024 * 1024);
+        ASSERT_EQ(compareFileData(a, b, 0, 16 * 1024 * 1024), false);
+        b.pwrite("", 1, 12 * 1024 * 1024);
+        ASSERT_EQ(compareFileData(a, b, 0, 16 * 1024 * 1024), true);
+        b.pwrite("D", 1, 8 * 1024 * 1024);
+        ASSERT_EQ(compareFileData(a, b, 0, 16 * 1024 * 1024), false);
+    }
+    std::remove(filenameA.c_str());
+    std::remove(filenameB.c_str());
+}
+
+
+UNIT_TEST(compareBlocks_concurrent)
+{
+    std::string filenameA = "FileIoTmpA";
+    std::string filenameB = "FileIoTmpB";
+    std::string data(64 * 1024, 'a');
+    std::string other = data;
+    other[2 * 4096 + 5] = 'x';
+    other[3 * 4096] = 'x';
+    other[10 * 4096 + 4095] = 'x';
+    writeFile(filenameA, data);
+    writeFile(filenameB, other.substr(0, 63 * 1024));
+    {
+        // 16 chunks of one block: Read concurrently.
+        File a(filenameA, O_RDONLY);
+        File b(filenameB, O_RDONLY);
+        std::vector<std::pair<uint64_t, size_t>> diffs;
+        ASSERT_EQ(compareBlocks(a, b, 0, data.size(), 4096, 4096, [&](uint64_t offset, size_t size, const char*) { diffs.emplace_back(offset, size); return true; }), false);
+        ASSERT_EQ(diffs.size(), 4u);
+        ASSERT_EQ(diffs[0].first, 2 * 4096u);
+        ASSERT_EQ(diffs[1].first, 3 * 4096u);
+        ASSERT_EQ(diffs[2].first, 10 * 4096u);
+        ASSERT_EQ(diffs[3].first, 15 * 4096u);
+        ASSERT_EQ(diffs[3].second, 4096u);
+        ASSERT_EQ(compareFileData(a, b, 0, 2 * 4096, 4096), true);
+        ASSERT_EQ(compareBlocks(a, a, 0, data.size(), 4096, 4096, [](uint64_t, size_t, const char*) { return true; }), true);
+    }
+    std::remove(filenameA.c_str());
+    std::remove(filenameB.c_str());
+}
+
+
+UNIT_TEST(compareFileDataParallel)
+{
+    std::string filenameA = "FileIoTmpA";
+    std::string filenameB = "FileIoTmpB";
+    std::string data(1024 * 1024 + 100, 'a');
+    writeFile(filenameA, data);
+    writeFile(filenameB, data);
+    {
+        File a(filenameA, O_RDONLY);
+        File b(filenameB, O_RDWR);
+        uint64_t first = 0;
+        ASSERT_EQ(compareFileDataParallel(a, b, 0, data.size(), 4, 64 * 1024, &first), true);
+        b.pwrite("x", 1, 900000);
+        b.pwrite("x", 1, 300000);
+        b.pwrite("x", 1, 1024 * 1024 + 99);
+        ASSERT_EQ(compareFileDataParallel(a, b, 0, data.size(), 4, 64 * 1024, &first), false);
+        ASSERT_EQ(first, 300000u / 4096 * 4096);
+        ASSERT_EQ(compareFileDataParallel(a, b, 310000, data.size() - 310000, 3, 64 * 1024, &first), false);
+        ASSERT_EQ(first, 310000u + (900000u - 310000u) / 4096 * 4096);
+        ASSERT_EQ(compareFileDataParallel(a, b, 0, 290000, 3, 64 * 1024, &first), true);
+
+        // Direct I/O with unaligned ranges: The threads must not switch O_DIRECT of each other's descriptors.
+        if (a.setDirectIo(true) && b.setDirectIo(true))
+        {
+            for (int i = 0; i < 20; i++)
+            {
+                ASSERT_EQ(compareFileDataParallel(a, b, 310000, data.size() - 310000, 4, 4096 * 3, &first), false);
+                ASSERT_EQ(first, 310000u + (900000u - 310000u) / 4096 * 4096);
+                ASSERT_EQ(compareFileDataParallel(a, b, 100, 290000, 4, 4096 * 3, &first), true);
+            }
+#ifdef O_DIRECT
+            File r = a.reopen(O_RDONLY);
+            ASSERT_EQ(r.isDirectIo(), true);
+            r.setDirectIo(false);
+            ASSERT_EQ((::fcntl(a.getFd(), F_GETFL) & O_DIRECT) != 0, true);
+#endif
+        }
+        (void)first;
+    }
+
+    ioConfig.splitThreshold = 1;
+    ioConfig.splitThreads = 4;
+    ASSERT_EQ(compareFiles(filenameA, filenameB), false);
+    ASSERT_EQ(compareFiles(filenameA, filenameA), true);
+    ioConfig.splitThreshold = 0;
+    ioConfig.splitThreads = 1;
+    std::remove(filenameA.c_str());
+    std::remove(filenameB.c_str());
+}
+
+
+UNIT_TEST(rewriteDifferingBlocks)
+{
+    std::string filenameA = "FileIoTmpA";
+    std::string filenameB = "FileIoTmpB";
+    writeFile(filenameA, "aaaabbbbccccddddeeeeffffg");
+    writeFile(filenameB, "aaaaXbbbccccdddXeXeeffffX");
+    {
+        File a(filenameA, O_RDONLY);
+        File b(filenameB, O_RDWR);
+        // Blocks 1, 3, 4 and 6 differ. Chunks of 8 bytes split the run of blocks 3 and 4.
+        ASSERT_EQ(rewriteDifferingBlocks(a, b, 4, 8), 4u);
+        ASSERT_EQ(rewriteDifferingBlocks(a, b, 4, 8), 0u);
+    }
+    ASSERT_EQ(readFile(filenameB), "aaaabbbbccccddddeeeeffffg");
+    std::remove(filenameA.c_str());
+    std::remove(filenameB.c_str());
+}
+
+
+} // namespace ut1
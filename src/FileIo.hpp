@@ -0,0 +1,243 @@
+// Low level file I/O.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <functional>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <sys/types.h>
+
+namespace ut1
+{
+
+/// Default block size for streaming file operations.
+constexpr size_t defaultBlockSize = 1024 * 1024;
+
+/// Global I/O statistics, updated by the functions in this file.
+struct IoStats
+{
+    /// Bytes in holes of sparse files which were not read (comparison) or not written (copy).
+    std::atomic<uint64_t> holeBytesSkipped{};
+
+    /// Bytes which were not compared because both files share the same physical extents (reflinks).
+    std::atomic<uint64_t> sharedBytesSkipped{};
+
+    /// Files which were compared by several threads (see IoConfig::splitThreshold).
+    std::atomic<uint64_t> splitFiles{};
+};
+
+extern IoStats ioStats;
+
+/// Global I/O configuration, used by the functions in this file.
+struct IoConfig
+{
+    /// Avoid evicting other data from the page cache: Read files sequentially and drop the pages of
+    /// all data read or written from the page cache once it has been used (see File::dropCache()).
+    bool noCachePollution{};
+
+    /// Bypass the page cache (O_DIRECT) when comparing and copying files, if supported by the files.
+    bool directIo{};
+
+    /// compareFiles() compares files of at least splitThreshold bytes (0: never) with splitThreads threads.
+    uint64_t splitThreshold{};
+    unsigned splitThreads{1};
+};
+
+/// Size of the ranges compared by the threads of compareFileDataParallel() in compareFiles().
+constexpr uint64_t splitRangeSize = 64 * 1024 * 1024;
+
+extern IoConfig ioConfig;
+
+/// File extent (FIEMAP).
+struct Extent
+{
+    uint64_t logical{};
+    uint64_t physical{};
+    uint64_t length{};
+    uint32_t flags{};
+};
+
+/// RAII wrapper around a POSIX file descriptor.
+/// All functions throw std::runtime_error on errors.
+class File
+{
+public:
+    File() = default;
+    File(const std::string& filename_, int flags, mode_t mode = 0644) { open(filename_, flags, mode); }
+    ~File();
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+    File(File&& other) noexcept;
+    File& operator=(File&& other) noexcept;
+
+    /// Open file (see open(2)).
+    void open(const std::string& filename_, int flags, mode_t mode = 0644);
+
+    /// Open the file again with flags, as a new open file description (so file status flags like O_DIRECT are not shared with this
+    /// file), even if the file was renamed (on Linux). Direct I/O is enabled iff it is enabled for this file.
+    File reopen(int flags) const;
+
+    /// Close file.
+    /// Errors of close() are reported, unlike in the destructor.
+    void close();
+
+    /// Return true iff the file is open.
+    bool isOpen() const noexcept { return fd >= 0; }
+
+    /// Get file descriptor.
+    int getFd() const noexcept { return fd; }
+
+    /// Get filename (for error messages).
+    const std::string& getFilename() const noexcept { return filename; }
+
+    /// Enable or disable direct I/O (O_DIRECT) for pread() and pwrite().
+    /// Return false (and leave direct I/O disabled) if direct I/O is not supported for this file (e.g. tmpfs).
+    /// In direct mode the parts of a request which are aligned to BufferPool::alignment (buffer, offset and size) bypass the page cache.
+    /// Unaligned parts (usually just the tail of the file) are transferred through the page cache.
+    /// Should the filesystem reject a direct transfer, direct I/O is disabled for the file and the transfer is repeated through the page cache.
+    bool setDirectIo(bool enable);
+
+    /// Return true iff direct I/O is enabled.
+    bool isDirectIo() const noexcept { return direct; }
+
+    /// Read up to size bytes from the current file position.
+    /// Short reads are retried, so this only returns less than size bytes at the end of the file.
+    size_t read(void* buf, size_t size);
+
+    /// Read up to size bytes from offset.
+    /// Short reads are retried, so this only returns less than size bytes at the end of the file.
+    size_t pread(void* buf, size_t size, uint64_t offset);
+
+    /// Write size bytes to the current file position.
+    void write(const void* buf, size_t size);
+
+    /// Write size bytes to offset.
+    void pwrite(const void* buf, size_t size, uint64_t offset);
+
+    /// Truncate or extend file to size bytes.
+    void truncate(uint64_t size);
+
+    /// Get file size.
+    uint64_t getSize() const;
+
+    /// Start reading size bytes at offset into the page cache in the background (readahead hint).
+    void readahead(uint64_t offset, uint64_t size) const;
+
+    /// Drop size bytes at offset (size == 0: up to the end of the file) from the page cache if ioConfig.noCachePollution is set.
+    /// Written data is first written back to the device (written == true), since dirty pages cannot be dropped.
+    /// This is just a hint and does not report errors.
+    void dropCache(uint64_t offset, uint64_t size, bool written = false) const;
+
+    /// Flush file data and metadata to the device.
+    void fsync();
+
+    /// Return true iff the file has holes (fewer blocks allocated than its size needs).
+    bool isSparse() const;
+
+    /// Get the device the file is stored on.
+    dev_t getDev() const;
+
+    /// Get all extents of the file (FIEMAP). With sync dirty data is flushed first (so the mapping matches the content).
+    /// Return false if not supported.
+    bool getExtents(std::vector<Extent>& extents, bool sync = true) const;
+
+    /// Get the first extent of the file (FIEMAP), without flushing dirty data. This is cheap and meant for I/O scheduling.
+    /// Return false if not supported or if the file has no extents.
+    bool getFirstExtent(Extent& extent) const;
+
+    /// Get the fraction (0..1) of the file data which is in the page cache.
+    /// This uses cachestat() for the whole file if the kernel supports it, else mincore() on a mapping of the first probeSize bytes.
+    /// Return 1 for empty files and 0 if residency cannot be determined.
+    double getCachedFraction(uint64_t probeSize = defaultBlockSize) const;
+
+    /// Get the end of the data region or hole containing offset (SEEK_DATA/SEEK_HOLE).
+    /// isHole is set to true iff offset is in a hole. The end is limited to limit.
+    /// Offsets at or beyond the end of the file and filesystems without SEEK_DATA support are reported as data up to limit.
+    uint64_t getRegionEnd(uint64_t offset, uint64_t limit, bool& isHole) const;
+
+private:
+    [[noreturn]] void throwError(const std::string& function) const;
+
+    /// Set or clear O_DIRECT. Return false on errors.
+    bool setODirect(bool enable);
+
+    /// Return the number of bytes at the start of a transfer of size bytes which can be done with direct I/O.
+    size_t getDirectSize(const void* buf, size_t size, uint64_t offset) const;
+
+    int fd{-1};
+    bool direct{};
+    std::string filename;
+};
+
+/// Block comparator: Compare size bytes starting at offset of two files.
+/// Ranges which are holes in both files are skipped without reading them (holes and zeros compare equal).
+/// The files are read in chunks of chunkSize bytes (at most the buffer size of bufferPool) and each chunk is compared in blocks of blockSize bytes (aligned to blockSize relative to offset).
+/// onDiff(offset, size, aData) is called for each run of adjacent differing blocks within a chunk, with aData pointing to the data of file a.
+/// Comparing stops when onDiff returns false or at the end of either file (which is reported as a difference of the remaining data which could be read from a).
+/// Large ranges are read concurrently from both files, with the next chunk being read while onDiff() runs, so onDiff() must not read from a or b.
+/// Return true iff no difference was found.
+bool compareBlocks(File& a, File& b, uint64_t offset, uint64_t size, size_t blockSize, size_t chunkSize, const std::function<bool(uint64_t, size_t, const char*)>& onDiff);
+
+/// Compare size bytes starting at offset of two files block by block.
+/// Return true iff the data is identical. Reading stops at the first differing block.
+/// Reading past the end of a file results in a difference.
+bool compareFileData(File& a, File& b, uint64_t offset, uint64_t size, size_t blockSize = defaultBlockSize);
+
+/// Compare size bytes starting at offset of two files using numThreads threads, each comparing ranges of rangeSize bytes.
+/// Each thread reads through its own reopened files (see File::reopen()), so a and b are not modified.
+/// The ranges are processed in order. Once a difference is found, ranges behind it are not started anymore, while ranges
+/// before it are still compared, so the lowest differing offset is found.
+/// Return true iff the data is identical. Otherwise firstDifference (if not nullptr) is set to the offset of the first differing 4k block (blocks are aligned relative to offset).
+bool compareFileDataParallel(File& a, File& b, uint64_t offset, uint64_t size, unsigned numThreads, uint64_t rangeSize = splitRangeSize, uint64_t* firstDifference = nullptr);
+
+/// Get the ranges (offset, size) which both files store in the same physical extents (reflinked data), sorted by offset.
+/// These ranges have identical content in both files. Extents with unknown or unstable physical location are never reported as shared.
+/// The extents are first probed without flushing dirty data. Only if both files have extents flagged as shared (which never happens
+/// on filesystems without reflinks) the files are flushed and the extents are read again, so comparing does not force writeback.
+/// Two descriptors of the same file share the whole file.
+std::vector<std::pair<uint64_t, uint64_t>> getSharedRanges(const File& a, const File& b);
+
+/// Return true iff both files have the same size and content.
+/// Ranges which both files share physically on disk (reflinks, see getSharedRanges()) are not read.
+/// Large files are compared by several threads (see IoConfig::splitThreshold).
+bool compareFiles(const std::string& filenameA, const std::string& filenameB);
+
+/// Overwrite all blocks of dst which differ from src with the data of src, using pwrite().
+/// Both files must have the same size. Blocks are aligned to blockSize. Adjacent differing blocks are written at once.
+/// Return the number of rewritten blocks.
+uint64_t rewriteDifferingBlocks(File& src, File& dst, size_t blockSize = 4096, size_t chunkSize = defaultBlockSize);
+
+/// Copy size bytes from src at srcOffset to dst at dstOffset.
+/// Return the number of bytes copied, which is less than size if src is shorter than srcOffset + size.
+uint64_t copyFileData(File& src, File& dst, uint64_t srcOffset, uint64_t dstOffset, uint64_t size, size_t blockSize = defaultBlockSize);
+
+/// Method used by copyFile().
+enum CopyMethod { CM_CLONE, CM_SPARSE, CM_COPY_FILE_RANGE, CM_SENDFILE, CM_DIRECT, CM_READ_WRITE };
+
+/// Get copy method name.
+std::string getCopyMethodStr(CopyMethod copyMethod);
+
+/// Copy the content and the permissions of regular file srcFilename to dstFilename (created or truncated).
+/// The first method which works for this pair of files is used:
+/// - CM_CLONE: Share the data extents (FICLONE, btrfs/XFS, same filesystem only).
+/// - CM_SPARSE: For sparse files: Copy just the data regions (SEEK_DATA/SEEK_HOLE), preserving the holes.
+/// - CM_COPY_FILE_RANGE: In-kernel copy (copy_file_range(), server side copy on NFS 4.2).
+/// - CM_SENDFILE: In-kernel copy (sendfile()).
+/// - CM_DIRECT: For ioConfig.directIo (instead of the in-kernel copies): pread()/pwrite() loop with O_DIRECT.
+/// - CM_READ_WRITE: read()/write() loop with a large buffer.
+/// Return the method used.
+CopyMethod copyFile(const std::string& srcFilename, const std::string& dstFilename);
+
+/// Return true iff the content of file prefix is a prefix of the content of file.
+/// To give up early on files which were not just appended to the last block of prefix is compared first.
+bool isPrefixOf(File& prefix, File& file, size_t blockSize = defaultBlockSize);
+
+} // namespace ut1
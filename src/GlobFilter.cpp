@@ -0,0 +1,456 @@
+// Path filter with glob patterns.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include "GlobFilter.hpp"
+#include "MiscUtils.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+namespace
+{
+
+/// Decode the UTF-8 character at s[i] and advance i behind it. Invalid bytes are returned as they are.
+uint32_t decodeChar(std::string_view s, size_t& i)
+{
+    uint8_t b = uint8_t(s[i++]);
+    size_t n = (b >= 0xf0) ? 3 : (b >= 0xe0) ? 2 : (b >= 0xc0) ? 1 : 0;
+    if (i + n > s.size())
+    {
+        return b;
+    }
+    uint32_t c = b & (0x3f >> n);
+    for (size_t j = 0; j < n; j++)
+    {
+        if ((uint8_t(s[i + j]) & 0xc0) != 0x80)
+        {
+            return b;
+        }
+        c = (c << 6) | (uint8_t(s[i + j]) & 0x3f);
+    }
+    i += n;
+    return c;
+}
+
+} // namespace
+
+
+void GlobFilter::add(const std::string& pattern, bool include)
+{
+    Pattern p;
+    p.include = include;
+    std::string_view s = pattern;
+    while ((!s.empty()) && (s.back() == '/'))
+    {
+        p.dirOnly = true;
+        s.remove_suffix(1);
+    }
+    bool isAnchored = false;
+    while ((!s.empty()) && (s.front() == '/'))
+    {
+        isAnchored = true;
+        s.remove_prefix(1);
+    }
+    for (const std::string& component: splitString(std::string(s), '/'))
+    {
+        if (component.empty())
+        {
+            continue;
+        }
+        Component c = compileComponent(component);
+        if (c.anyDepth && (!p.components.empty()) && p.components.back().anyDepth)
+        {
+            continue;
+        }
+        p.components.push_back(std::move(c));
+    }
+    if (p.components.empty())
+    {
+        return;
+    }
+    isAnchored = isAnchored || (p.components.size() > 1);
+    if ((p.components.size() == 2) && p.components[0].anyDepth && !p.components[1].anyDepth)
+    {
+        // "**/name" is the same as "name".
+        p.components.erase(p.components.begin());
+        isAnchored = false;
+    }
+    if (p.components[0].anyDepth)
+    {
+        isAnchored = true;
+    }
+
+    uint32_t index = uint32_t(patterns.size());
+    const std::vector<Token>& tokens = p.components[0].tokens;
+    if (isAnchored)
+    {
+        anchored.push_back(index);
+    }
+    else if ((tokens.size() == 1) && (tokens[0].type == Token::LITERAL))
+    {
+        byName[tokens[0].literal].push_back(index);
+    }
+    else if ((tokens.size() == 2) && (tokens[0].type == Token::STAR) && (tokens[1].type == Token::LITERAL) && (tokens[1].literal.rfind('.') == 0))
+    {
+        byExtension[tokens[1].literal].push_back(index);
+    }
+    else
+    {
+        other.push_back(index);
+    }
+    patterns.push_back(std::move(p));
+}
+
+
+GlobFilter::Component GlobFilter::compileComponent(std::string_view s)
+{
+    Component c;
+    if (s == "**")
+    {
+        c.anyDepth = true;
+        return c;
+    }
+    auto addLiteral = [&](std::string_view literal)
+    {
+        if (c.tokens.empty() || (c.tokens.back().type != Token::LITERAL))
+        {
+            c.tokens.push_back(Token{Token::LITERAL, std::string(), {}, false});
+        }
+        c.tokens.back().literal += literal;
+    };
+    for (size_t i = 0; i < s.size();)
+    {
+        char ch = s[i];
+        if ((ch == '\\') && (i + 1 < s.size()))
+        {
+            addLiteral(s.substr(i + 1, 1));
+            i += 2;
+        }
+        else if (ch == '*')
+        {
+            if (c.tokens.empty() || (c.tokens.back().type != Token::STAR))
+            {
+                c.tokens.push_back(Token{Token::STAR, std::string(), {}, false});
+            }
+            i++;
+        }
+        else if (ch == '?')
+        {
+            c.tokens.push_back(Token{Token::ANY_CHAR, std::string(), {}, false});
+            i++;
+        }
+        else if (ch == '[')
+        {
+            // Character class. A ']' directly after '[' or '[!' is part of the set. Without closing ']' the '[' is a literal.
+            Token token{Token::CLASS, std::string(), {}, false};
+            size_t j = i + 1;
+            if ((j < s.size()) && ((s[j] == '!') || (s[j] == '^')))
+            {
+                token.negated = true;
+                j++;
+            }
+            size_t first = j;
+            while ((j < s.size()) && ((s[j] != ']') || (j == first)))
+            {
+                if ((s[j] == '\\') && (j + 1 < s.size()))
+                {
+                    j++;
+                }
+                uint32_t lo = decodeChar(s, j);
+                uint32_t hi = lo;
+                if ((j + 1 < s.size()) && (s[j] == '-') && (s[j + 1] != ']'))
+                {
+                    j++;
+                    hi = decodeChar(s, j);
+                }
+                token.ranges.emplace_back(lo, hi);
+            }
+            if (j >= s.size())
+            {
+                addLiteral("[");
+                i++;
+                continue;
+            }
+            c.tokens.push_back(std::move(token));
+            i = j + 1;
+        }
+        else
+        {
+            addLiteral(s.substr(i, 1));
+            i++;
+        }
+    }
+    return c;
+}
+
+
+bool GlobFilter::matchComponent(const Component& component, std::string_view name)
+{
+    // Wildcard matching, backtracking to the last '*' on mismatches.
+    const std::vector<Token>& tokens = component.tokens;
+    size_t t = 0;
+    size_t n = 0;
+    size_t starToken = std::string::npos;
+    size_t starName = 0;
+    while (n < name.size())
+    {
+        if (t < tokens.size())
+        {
+            const Token& token = tokens[t];
+            if (token.type == Token::STAR)
+            {
+                starToken = t++;
+                starName = n;
+                continue;
+            }
+            if (token.type == Token::LITERAL)
+            {
+                if (name.compare(n, token.literal.size(), token.literal) == 0)
+                {
+                    n += token.literal.size();
+                    t++;
+                    continue;
+                }
+            }
+            else
+            {
+                size_t next = n;
+                uint32_t c = decodeChar(name, next);
+                bool inClass = std::any_of(token.ranges.begin(), token.ranges.end(), [c](const auto& range) { return (c >= range.first) && (c <= range.second); });
+                if ((token.type == Token::ANY_CHAR) || (inClass != token.negated))
+                {
+                    n = next;
+                    t++;
+                    continue;
+                }
+            }
+        }
+        if (starToken == std::string::npos)
+        {
+            return false;
+        }
+        // Let the last '*' match one more character.
+        decodeChar(name, starName);
+        n = starName;
+        t = starToken + 1;
+    }
+    while ((t < tokens.size()) && (tokens[t].type == Token::STAR))
+    {
+        t++;
+    }
+    return t == tokens.size();
+}
+
+
+void GlobFilter::addPosition(std::vector<std::pair<uint32_t, uint32_t>>& positions, uint32_t pattern, uint32_t component) const
+{
+    const std::vector<Component>& components = patterns[pattern].components;
+    for (; component < components.size(); component++)
+    {
+        positions.emplace_back(pattern, component);
+        if (!components[component].anyDepth)
+        {
+            break;
+        }
+    }
+}
+
+
+GlobFilter::State GlobFilter::getRootState() const
+{
+    State state;
+    for (uint32_t i: anchored)
+    {
+        addPosition(state.positions, i, 0);
+    }
+    return state;
+}
+
+
+int64_t GlobFilter::matchAnyDepth(std::string_view name, bool isDir) const
+{
+    int64_t best = -1;
+    auto matchLast = [&](const std::vector<uint32_t>& indices)
+    {
+        for (auto it = indices.rbegin(); (it != indices.rend()) && (int64_t(*it) > best); ++it)
+        {
+            if (isDir || !patterns[*it].dirOnly)
+            {
+                best = *it;
+                break;
+            }
+        }
+    };
+    auto it = byName.find(name);
+    if (it != byName.end())
+    {
+        matchLast(it->second);
+    }
+    size_t dot = name.rfind('.');
+    if (dot != std::string_view::npos)
+    {
+        auto itExt = byExtension.find(name.substr(dot));
+        if (itExt != byExtension.end())
+        {
+            matchLast(itExt->second);
+        }
+    }
+    for (auto itOther = other.rbegin(); (itOther != other.rend()) && (int64_t(*itOther) > best); ++itOther)
+    {
+        const Pattern& p = patterns[*itOther];
+        if ((isDir || !p.dirOnly) && matchComponent(p.components[0], name))
+        {
+            best = *itOther;
+            break;
+        }
+    }
+    return best;
+}
+
+
+GlobFilter::Result GlobFilter::match(const State& state, std::string_view name, bool isDir) const
+{
+    int64_t best = matchAnyDepth(name, isDir);
+    for (const auto& [i, k]: state.positions)
+    {
+        const Pattern& p = patterns[i];
+        if ((int64_t(i) > best) && (k + 1 == p.components.size()) && (isDir || !p.dirOnly) && (p.components[k].anyDepth || matchComponent(p.components[k], name)))
+        {
+            best = i;
+        }
+    }
+    if (best < 0)
+    {
+        return NO_MATCH;
+    }
+    return patterns[size_t(best)].include ? INCLUDE : EXCLUDE;
+}
+
+
+GlobFilter::State GlobFilter::getChildState(const State& state, std::string_view name) const
+{
+    State r;
+    for (const auto& [i, k]: state.positions)
+    {
+        const Component& c = patterns[i].components[k];
+        if (c.anyDepth)
+        {
+            addPosition(r.positions, i, k);
+        }
+        else if ((k + 1 < patterns[i].components.size()) && matchComponent(c, name))
+        {
+            addPosition(r.positions, i, k + 1);
+        }
+    }
+    std::sort(r.positions.begin(), r.positions.end());
+    r.positions.erase(std::unique(r.positions.begin(), r.positions.end()), r.positions.end());
+    return r;
+}
+
+
+GlobFilter::State GlobFilter::getPathState(std::string_view path) const
+{
+    State state = getRootState();
+    for (const std::string& component: splitString(std::string(path), '/'))
+    {
+        if (!component.empty())
+        {
+            state = getChildState(state, component);
+        }
+    }
+    return state;
+}
+
+
+UNIT_TEST(GlobFilter)
+{
+    // Match path like a tree walk: Entries below excluded dirs are excluded.
+    auto matchPath = [](const GlobFilter& filter, const std::string& path, bool isDir)
+    {
+        std::vector<std::string> components = splitString(path, '/');
+        GlobFilter::State state = filter.getRootState();
+        for (size_t i = 0; i + 1 < components.size(); i++)
+        {
+            if (filter.match(state, components[i], true) == GlobFilter::EXCLUDE)
+            {
+                return GlobFilter::EXCLUDE;
+            }
+            state = filter.getChildState(state, components[i]);
+        }
+        return filter.match(state, components.back(), isDir);
+    };
+    (void)matchPath;
+
+    GlobFilter filter;
+    ASSERT_EQ(filter.empty(), true);
+    filter.add("*.tmp", false);
+    filter.add("build/", false);
+    filter.add("/top", false);
+    filter.add("a/**/b", false);
+    filter.add("**/.cache/", false);
+    filter.add("doc/*.txt", false);
+    filter.add("[a-c]?.dat", false);
+    filter.add("\\*star", false);
+    filter.add("*.log", false);
+    filter.add("keep.log", true);
+    filter.add("x/**", false);
+    filter.add("caf?", false);
+    ASSERT_EQ(filter.empty(), false);
+
+    ASSERT_EQ(matchPath(filter, "a.tmp", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "d/e/a.tmp", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "a.tmpx", false), GlobFilter::NO_MATCH);
+    ASSERT_EQ(matchPath(filter, ".tmp", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "src/build", true), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "src/build", false), GlobFilter::NO_MATCH);
+    ASSERT_EQ(matchPath(filter, "src/build/x.o", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "top", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "d/top", false), GlobFilter::NO_MATCH);
+    ASSERT_EQ(matchPath(filter, "a/b", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "a/x/y/b", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "a/x/y/c", false), GlobFilter::NO_MATCH);
+    ASSERT_EQ(matchPath(filter, "d/a/b", false), GlobFilter::NO_MATCH);
+    ASSERT_EQ(matchPath(filter, "home/.cache", true), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "doc/a.txt", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "doc/d/a.txt", false), GlobFilter::NO_MATCH);
+    ASSERT_EQ(matchPath(filter, "d/doc/a.txt", false), GlobFilter::NO_MATCH);
+    ASSERT_EQ(matchPath(filter, "b1.dat", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "d1.dat", false), GlobFilter::NO_MATCH);
+    ASSERT_EQ(matchPath(filter, "*star", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "xstar", false), GlobFilter::NO_MATCH);
+    ASSERT_EQ(matchPath(filter, "d/a.log", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "d/keep.log", false), GlobFilter::INCLUDE);
+    ASSERT_EQ(matchPath(filter, "build/keep.log", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "x", true), GlobFilter::NO_MATCH);
+    ASSERT_EQ(matchPath(filter, "x/y/z", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "caf\xc3\xa9", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(filter, "README", false), GlobFilter::NO_MATCH);
+    ASSERT_EQ(filter.getPathState("a/x").positions.empty(), false);
+    ASSERT_EQ(filter.getPathState("d").positions.empty(), true);
+
+    // Wildcards.
+    GlobFilter wild;
+    wild.add("a*b*c", false);
+    wild.add("[!0-9]x[]]", false);
+    ASSERT_EQ(matchPath(wild, "abc", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(wild, "aXbbYbc", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(wild, "abcx", false), GlobFilter::NO_MATCH);
+    ASSERT_EQ(matchPath(wild, "ax]", false), GlobFilter::EXCLUDE);
+    ASSERT_EQ(matchPath(wild, "1x]", false), GlobFilter::NO_MATCH);
+}
+
+
+} // namespace ut1
@@ -0,0 +1,111 @@
+// Path filter with glob patterns.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <utility>
+#include <cstdint>
+
+namespace ut1
+{
+
+/// Filter for the entries of a directory tree by glob patterns, with the syntax of .gitignore:
+/// - '*' matches anything but '/', '?' one character but '/', '[a-z]' and '[!a-z]' a character (not) in the set and '\' quotes the next character.
+/// - "**" as a whole path component matches any number of components (including none).
+/// - A pattern with a trailing '/' only matches dirs.
+/// - A pattern with a '/' at the start or in the middle is relative to the root of the tree. Other patterns match entries at any depth.
+/// Later patterns take precedence over earlier ones.
+///
+/// The patterns are compiled into an automaton over path components: The state of a dir is the set of positions in the patterns which
+/// can still match below the dir. Patterns matching at any depth are not part of the state, they are looked up by name (literal names)
+/// and extension ("*.ext") in maps instead. Matching an entry costs one step per active position plus two lookups, so it does not grow
+/// linearly with the number of such patterns.
+///
+/// Entries below an excluded dir are never matched, so excluded dirs do not have to be read at all.
+class GlobFilter
+{
+public:
+    enum Result { NO_MATCH, EXCLUDE, INCLUDE };
+
+    /// State of the matcher for the entries of a dir.
+    struct State
+    {
+        /// Positions (pattern index, component index) in the anchored patterns.
+        std::vector<std::pair<uint32_t, uint32_t>> positions;
+    };
+
+    /// Add pattern. Entries matching an include pattern are included even if they match earlier exclude patterns.
+    void add(const std::string& pattern, bool include);
+
+    /// Return true iff there are no patterns.
+    bool empty() const { return patterns.empty(); }
+
+    /// Get the state of the root dir.
+    State getRootState() const;
+
+    /// Match entry name of a dir with state.
+    Result match(const State& state, std::string_view name, bool isDir) const;
+
+    /// Get the state of the subdir name of a dir with state.
+    State getChildState(const State& state, std::string_view name) const;
+
+    /// Get the state of the dir path (relative to the root, components separated by '/').
+    State getPathState(std::string_view path) const;
+
+private:
+    struct Token
+    {
+        enum Type { LITERAL, ANY_CHAR, STAR, CLASS };
+        Type type;
+        std::string literal;
+        /// Codepoint ranges of a CLASS.
+        std::vector<std::pair<uint32_t, uint32_t>> ranges;
+        bool negated{};
+    };
+
+    struct Component
+    {
+        /// "**".
+        bool anyDepth{};
+        std::vector<Token> tokens;
+    };
+
+    struct Pattern
+    {
+        std::vector<Component> components;
+        bool include{};
+        bool dirOnly{};
+    };
+
+    /// Compile a path component.
+    static Component compileComponent(std::string_view s);
+
+    /// Return true iff component matches name.
+    static bool matchComponent(const Component& component, std::string_view name);
+
+    /// Add position (pattern, component) to positions, plus the position behind it if the component is "**".
+    void addPosition(std::vector<std::pair<uint32_t, uint32_t>>& positions, uint32_t pattern, uint32_t component) const;
+
+    /// Get the index of the last pattern matching name (isDir) at any depth or -1.
+    int64_t matchAnyDepth(std::string_view name, bool isDir) const;
+
+    std::vector<Pattern> patterns;
+
+    /// Indices of the anchored patterns.
+    std::vector<uint32_t> anchored;
+
+    /// Indices of the patterns matching at any depth: Literal names, "*.ext" by extension and all others.
+    std::map<std::string, std::vector<uint32_t>, std::less<>> byName;
+    std::map<std::string, std::vector<uint32_t>, std::less<>> byExtension;
+    std::vector<uint32_t> other;
+};
+
+} // namespace ut1
@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #endif
 #include "MiscUtils.hpp"
+#include "DirFd.hpp"
 #ifdef ENABLE_UNIT_TEST
 #include "UnitTest.hpp"
 #else
@@ -18,6 +19,10 @@
 #endif
 #include <iostream>
 #include <chrono>
+#include <ctime>
+#include <cmath>
+#include <cstdio>
+#include <map>
 
 
 namespace ut1
@@ -508,6 +513,141 @@ UNIT_TEST(splitLines)
 }
 
 
+uint64_t parseSize(const std::string& s)
+{
+    const char* end = nullptr;
+    uint64_t r = std::strtoull(s.c_str(), const_cast<char**>(&end), 10);
+    if ((end == s.c_str()) || (s[0] == '-'))
+    {
+        throw std::runtime_error("Invalid size '" + s + "'.");
+    }
+    std::string unit = tolower(end);
+    if (hasSuffix(unit, "ib"))
+    {
+        unit.resize(unit.length() - 2);
+    }
+    else if (hasSuffix(unit, "b"))
+    {
+        unit.resize(unit.length() - 1);
+    }
+    static const std::string units = "kmgtp";
+    if (unit.empty())
+    {
+        return r;
+    }
+    size_t exponent = units.find(unit[0]);
+    if ((unit.length() != 1) || (exponent == std::string::npos))
+    {
+        throw std::runtime_error("Invalid size '" + s + "'.");
+    }
+    return r << (10 * (exponent + 1));
+}
+
+
+UNIT_TEST(parseSize)
+{
+    ASSERT_EQ(parseSize("0"), 0u);
+    ASSERT_EQ(parseSize("123"), 123u);
+    ASSERT_EQ(parseSize("123b"), 123u);
+    ASSERT_EQ(parseSize("4k"), 4096u);
+    ASSERT_EQ(parseSize("4KiB"), 4096u);
+    ASSERT_EQ(parseSize("64M"), 64u * 1024 * 1024);
+    ASSERT_EQ(parseSize("2G"), 2ULL * 1024 * 1024 * 1024);
+    ASSERT_EQ(parseSize("1T"), 1ULL << 40);
+}
+
+
+int64_t parseTime(const std::string& s, int64_t now)
+{
+    int year = 0;
+    int month = 0;
+    int day = 0;
+    int hour = 0;
+    int minute = 0;
+    int second = 0;
+    int length = 0;
+    if ((std::sscanf(s.c_str(), "%4d-%2d-%2d%n", &year, &month, &day, &length) == 3) && (length == 10))
+    {
+        // Absolute local time.
+        const char* rest = s.c_str() + length;
+        if ((*rest != 0) && (((*rest != ' ') && (*rest != 'T')) ||
+            (std::sscanf(rest + 1, "%2d:%2d%n:%2d%n", &hour, &minute, &length, &second, &length) < 2) || (rest[1 + length] != 0)))
+        {
+            throw std::runtime_error("Invalid time '" + s + "'.");
+        }
+
+        // mktime() would silently normalize out of range fields (e.g. month 13).
+        static const int daysPerMonth[12] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+        bool leapYear = ((year % 4) == 0) && (((year % 100) != 0) || ((year % 400) == 0));
+        if ((month < 1) || (month > 12) || (day < 1) || (day > daysPerMonth[month - 1]) || ((month == 2) && (day == 29) && !leapYear) ||
+            (hour < 0) || (hour > 23) || (minute < 0) || (minute > 59) || (second < 0) || (second > 59))
+        {
+            throw std::runtime_error("Invalid time '" + s + "'.");
+        }
+        struct tm t{};
+        t.tm_year = year - 1900;
+        t.tm_mon = month - 1;
+        t.tm_mday = day;
+        t.tm_hour = hour;
+        t.tm_min = minute;
+        t.tm_sec = second;
+        t.tm_isdst = -1;
+        return int64_t(std::mktime(&t));
+    }
+
+    // Age.
+    char* end = nullptr;
+    double age = std::strtod(s.c_str(), &end);
+    if ((end == s.c_str()) || (s[0] == '-'))
+    {
+        throw std::runtime_error("Invalid time '" + s + "'.");
+    }
+    static const std::map<std::string, double> units = {{"", 1}, {"s", 1}, {"m", 60}, {"h", 3600}, {"d", 86400}, {"w", 7 * 86400}};
+    auto it = units.find(end);
+    if (it == units.end())
+    {
+        throw std::runtime_error("Invalid time '" + s + "'.");
+    }
+    // Reject inf, nan and ages which do not fit into int64_t (with some margin for now).
+    double seconds = age * it->second;
+    if (!std::isfinite(seconds) || (seconds > 4e18))
+    {
+        throw std::runtime_error("Invalid time '" + s + "'.");
+    }
+    return now - int64_t(seconds);
+}
+
+
+UNIT_TEST(parseTime)
+{
+    ASSERT_EQ(parseTime("0", 1000), 1000);
+    ASSERT_EQ(parseTime("10s", 1000), 990);
+    ASSERT_EQ(parseTime("2m", 1000), 880);
+    ASSERT_EQ(parseTime("1.5h", 100000), 100000 - 5400);
+    ASSERT_EQ(parseTime("7d", 1000000), 1000000 - 7 * 86400);
+    ASSERT_EQ(parseTime("1w", 1000000), 1000000 - 7 * 86400);
+    ASSERT_EQ(parseTime("2024-01-02", 0) - parseTime("2024-01-01", 0), 86400);
+    ASSERT_EQ(parseTime("2024-01-01 01:02", 0) - parseTime("2024-01-01", 0), 3720);
+    ASSERT_EQ(parseTime("2024-01-01T01:02:03", 0) - parseTime("2024-01-01", 0), 3723);
+    ASSERT_EQ(parseTime("2024-02-29", 0) - parseTime("2024-02-28", 0), 86400);
+    for (const char* invalid: {"inf", "nan", "1e30", "1e17w", "-1d", "1x", "", "2024-13-01", "2024-12-32", "2023-02-29", "2024-04-31", "2024-00-10",
+                               "2024-01-01 24:00", "2024-01-01 12:60", "2024-01-01 12:00:60"})
+    {
+        bool thrown = false;
+        try
+        {
+            parseTime(invalid, 0);
+        }
+        catch (const std::runtime_error&)
+        {
+            thrown = true;
+        }
+        ASSERT_EQ(thrown, true);
+        (void)thrown;
+    }
+}
+
+
 std::string joinStrings(const std::vector<std::string>& stringList, const std::string& sep)
 {
     std::stringstream r;
@@ -714,39 +854,6 @@ UNIT_TEST(quouteRegexChars)
 }
 
 
-std::string toNfd(const std::string& s)
-{
-    // This only works for german umlauts so far.
-    std::string r;
-    for (size_t i = 0; i < s.length(); i++)
-    {
-        if ((s[i] == '\xc3') && (i < s.length() - 1))
-        {
-            switch (s[i + 1])
-            {
-            case '\x84': r += "A\xcc\x88"; i++; continue;
-            case '\x96': r += "O\xcc\x88"; i++; continue;
-            case '\x9c': r += "U\xcc\x88"; i++; continue;
-            case '\xa4': r += "a\xcc\x88"; i++; continue;
-            case '\xb6': r += "o\xcc\x88"; i++; continue;
-            case '\xbc': r += "u\xcc\x88"; i++; continue;
-            }
-        }
-        r += s[i];
-    }
-    return r;
-}
-
-
-UNIT_TEST(toNfd)
-{
-    ASSERT_EQ(ut1::toNfd(""), "");
-    ASSERT_EQ(ut1::toNfd("\xcc\x88"), "\xcc\x88");
-    ASSERT_EQ(ut1::toNfd("A\xcc\x88"), "A\xcc\x88");
-    ASSERT_EQ(ut1::toNfd("\xc3\x84"), "A\xcc\x88");
-}
-
-
 std::ostream& operator<<(std::ostream& s, const std::vector<std::string>& v)
 {
     s << "{";
@@ -870,44 +977,23 @@ FileType getFileType(const std::filesystem::directory_entry& entry, bool followS
 
 FileType getFileType(const std::filesystem::path& entry, bool followSymlinks)
 {
-    // First check for symlink.
-    // is_symlink() never follows symlinks, while all other is_*() functions follow symlinks.
-    if (std::filesystem::is_symlink(entry))
-    {
-        // Report broken symlinks as symlink, even when following symlinks.
-        if ((!followSymlinks) || (!std::filesystem::exists(entry)))
-        {
-            return FT_SYMLINK;
-        }
-    }
-    if (std::filesystem::is_regular_file(entry))
-    {
-        return FT_REGULAR;
-    }
-    else if (std::filesystem::is_directory(entry))
-    {
-        return FT_DIR;
-    }
-    else if (std::filesystem::is_fifo(entry))
-    {
-        return FT_FIFO;
-    }
-    else if (std::filesystem::is_block_file(entry))
-    {
-        return FT_BLOCK;
-    }
-    else if (std::filesystem::is_character_file(entry))
-    {
-        return FT_CHAR;
-    }
-    else if (std::filesystem::is_socket(entry))
-    {
-        return FT_SOCKET;
-    }
-    else
+    // Resolved relative to the cached descriptor of the parent dir, so this works for paths longer than PATH_MAX.
+    return getFileTypeAt(entry, followSymlinks);
+}
+
+FileType getFileTypeFromMode(mode_t mode)
+{
+    switch (mode & S_IFMT)
     {
-        return FT_NON_EXISTING;
+    case S_IFREG: return FT_REGULAR;
+    case S_IFDIR: return FT_DIR;
+    case S_IFLNK: return FT_SYMLINK;
+    case S_IFIFO: return FT_FIFO;
+    case S_IFBLK: return FT_BLOCK;
+    case S_IFCHR: return FT_CHAR;
+    case S_IFSOCK: return FT_SOCKET;
     }
+    return FT_NON_EXISTING;
 }
 
 std::string getFileTypeStr(const std::filesystem::directory_entry& entry, bool followSymlinks)
@@ -938,7 +1024,7 @@ std::string getFileTypeStr(FileType fileType)
 
 bool fsExists(const std::filesystem::path& entry)
 {
-    return std::filesystem::exists(entry) || std::filesystem::is_symlink(entry);
+    return getFileTypeAt(entry, /*followSymlinks=*/false) != FT_NON_EXISTING;
 }
 
 bool fsIsDirectory(const std::filesystem::path& entry, bool followSymlinks)
@@ -88,9 +88,6 @@ void addTrailingLfIfMissing(std::string& s);
 /// regex special chars.
 std::string quoteRegexChars(const std::string& s);
 
-/// Convert UTF-8 to NFD (canonical decomposed form).
-std::string toNfd(const std::string& s);
-
 // --- String utilities: Misc. ---
 
 /// Split string at separator char.
@@ -106,6 +103,17 @@ std::vector<std::string> splitString(const std::string& s, const std::string& se
 /// The input "a\n" and "a" both result in ["a"].
 std::vector<std::string> splitLines(const std::string& s, size_t wrapCol = 0);
 
+/// Parse size with optional binary unit suffix (k, M, G, T, P, case insensitive, optionally followed by 'B' or 'iB').
+/// Example: "64M" results in 64 * 1024 * 1024.
+/// Throw std::runtime_error on parse errors.
+uint64_t parseSize(const std::string& s);
+
+/// Parse time: Either a local time "YYYY-MM-DD[ HH:MM[:SS]]" (or with 'T' instead of ' ') or an age before now with optional unit
+/// suffix (s, m, h, d, w). Example: "7d" results in now - 7 * 86400.
+/// Return the time in seconds since the epoch.
+/// Throw std::runtime_error on parse errors.
+int64_t parseTime(const std::string& s, int64_t now);
+
 /// Join vector of strings.
 std::string joinStrings(const std::vector<std::string>& stringList, const std::string& sep);
 
@@ -229,6 +237,9 @@ enum FileType { FT_REGULAR, FT_DIR, FT_SYMLINK, FT_FIFO, FT_BLOCK, FT_CHAR, FT_S
 FileType getFileType(const std::filesystem::directory_entry& entry, bool followSymlinks = true);
 FileType getFileType(const std::filesystem::path& entry, bool followSymlinks = true);
 
+/// Get file type from st_mode of struct stat.
+FileType getFileTypeFromMode(mode_t mode);
+
 /// Get file type string.
 std::string getFileTypeStr(const std::filesystem::directory_entry& entry, bool followSymlinks = true);
 std::string getFileTypeStr(const std::filesystem::path& entry, bool followSymlinks = true);
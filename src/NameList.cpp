@@ -0,0 +1,206 @@
+// Sortable list of filenames.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <iostream>
+#include "NameList.hpp"
+#include "MiscUtils.hpp"
+#include "Unicode.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+namespace
+{
+
+/// Ranges smaller than this are sorted by insertion sort.
+constexpr size_t insertionSortThreshold = 32;
+
+} // namespace
+
+
+uint32_t NameList::add(std::string_view name, std::string_view key)
+{
+    bool separateKey = key != name;
+    entries.push_back(Entry{arena.size(), uint32_t(name.size()), uint32_t(key.size()), uint32_t(entries.size()), separateKey});
+    arena.append(name);
+    if (separateKey)
+    {
+        arena.append(key);
+    }
+    return entries.back().id;
+}
+
+
+void NameList::sort()
+{
+    // MSD radix sort with an explicit stack of (begin, end, depth) ranges. Bucket 0 holds the keys ending at depth
+    // (sorting first), bucket b + 1 the keys with byte b at depth. Scattering through tmp keeps the sort stable.
+    std::vector<Entry> tmp(entries.size());
+    std::vector<std::tuple<size_t, size_t, size_t>> stack;
+    stack.emplace_back(0, entries.size(), 0);
+    while (!stack.empty())
+    {
+        auto [begin, end, depth] = stack.back();
+        stack.pop_back();
+        if (end - begin < insertionSortThreshold)
+        {
+            insertionSort(begin, end, depth);
+            continue;
+        }
+
+        size_t count[258] = {};
+        for (size_t i = begin; i < end; i++)
+        {
+            count[getKeyByte(entries[i], depth) + 1]++;
+        }
+        if (std::find(count + 1, count + 258, end - begin) != count + 258)
+        {
+            // All keys share this byte (common prefix).
+            if (count[1] == 0)
+            {
+                stack.emplace_back(begin, end, depth + 1);
+            }
+            continue;
+        }
+        for (size_t b = 1; b < 258; b++)
+        {
+            count[b] += count[b - 1];
+        }
+        // count[b] is now the start of bucket b (relative to begin).
+        size_t pos[257];
+        std::copy(count, count + 257, pos);
+        for (size_t i = begin; i < end; i++)
+        {
+            tmp[begin + pos[getKeyByte(entries[i], depth)]++] = entries[i];
+        }
+        std::copy(tmp.begin() + ptrdiff_t(begin), tmp.begin() + ptrdiff_t(end), entries.begin() + ptrdiff_t(begin));
+        for (size_t b = 1; b < 257; b++)
+        {
+            if (count[b + 1] - count[b] > 1)
+            {
+                stack.emplace_back(begin + count[b], begin + count[b + 1], depth + 1);
+            }
+        }
+    }
+}
+
+
+void NameList::insertionSort(size_t begin, size_t end, size_t depth)
+{
+    for (size_t i = begin + 1; i < end; i++)
+    {
+        Entry entry = entries[i];
+        std::string_view key = getKey(i).substr(depth);
+        size_t j = i;
+        while ((j > begin) && (key < getKey(j - 1).substr(depth)))
+        {
+            entries[j] = entries[j - 1];
+            j--;
+        }
+        entries[j] = entry;
+    }
+}
+
+
+void NameList::clear()
+{
+    arena.clear();
+    entries.clear();
+}
+
+
+UNIT_TEST(NameList)
+{
+    NameList list;
+    std::vector<std::pair<std::string, uint32_t>> ref;
+    uint32_t seed = 1;
+    for (uint32_t i = 0; i < 5000; i++)
+    {
+        // Names with long common prefixes, duplicates, prefixes of other names and high bytes.
+        seed = seed * 1103515245 + 12345;
+        std::string name = "IMG_2023" + std::to_string((seed >> 8) % 700) + ((seed & 0x10000) ? std::string(".jpg") : std::string()) + ((seed & 0x20000) ? std::string("\xc3\xa4") : std::string());
+        std::string key = toNfd(name);
+        list.add(name, key);
+        ref.emplace_back(key, i);
+    }
+    list.add("");
+    ref.emplace_back("", 5000);
+    list.sort();
+    std::stable_sort(ref.begin(), ref.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    bool ok = list.size() == ref.size();
+    for (size_t i = 0; ok && (i < ref.size()); i++)
+    {
+        ok = (list.getKey(i) == ref[i].first) && (list.getId(i) == ref[i].second) && (toNfd(std::string(list.getName(i))) == ref[i].first);
+    }
+    ASSERT_EQ(ok, true);
+    (void)ok;
+}
+
+
+#ifdef ENABLE_BENCHMARK
+UNIT_TEST(NameList_benchmark)
+{
+    // 1M names as found in photo, source and object store dirs.
+    std::vector<std::string> names;
+    uint32_t seed = 1;
+    auto rnd = [&](uint32_t n) { seed = seed * 1103515245 + 12345; return (seed >> 8) % n; };
+    const char* words[] = {"report", "Bericht", "Gr\xc3\xb6\xc3\x9f" "e", "caf\xc3\xa9", "index", "node_modules", "final (2)", "README", "\xc3\x84nderung"};
+    const char* exts[] = {".jpg", ".txt", ".cpp", ".hpp", ".pdf", ".json", ""};
+    for (uint32_t i = 0; i < 1000000; i++)
+    {
+        std::string name;
+        switch (rnd(4))
+        {
+        case 0: name = "IMG_2023" + std::to_string(100000 + rnd(900000)) + "_" + std::to_string(rnd(1000000)) + ".jpg"; break;
+        case 1: name = std::string(words[rnd(9)]) + "_" + std::to_string(rnd(100000)) + exts[rnd(7)]; break;
+        case 2: for (int j = 0; j < 40; j++) { name += "0123456789abcdef"[rnd(16)]; } break;
+        default: name = "part-" + std::to_string(i) + "-of-object-store-bucket" + exts[rnd(7)]; break;
+        }
+        names.push_back(name);
+    }
+
+    double t0 = getTimeSec();
+    std::map<std::string, uint32_t> map;
+    for (uint32_t i = 0; i < names.size(); i++)
+    {
+        map[toNfd(names[i])] = i;
+    }
+    double t1 = getTimeSec();
+    std::vector<std::pair<std::string, uint32_t>> vec;
+    for (uint32_t i = 0; i < names.size(); i++)
+    {
+        vec.emplace_back(toNfd(names[i]), i);
+    }
+    std::stable_sort(vec.begin(), vec.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    double t2 = getTimeSec();
+    NameList list;
+    for (const std::string& name: names)
+    {
+        list.add(name, toNfd(name));
+    }
+    double t3 = getTimeSec();
+    list.sort();
+    double t4 = getTimeSec();
+    std::cout << "NameList benchmark (1M names): std::map " << (t1 - t0) * 1000 << " ms, std::stable_sort " << (t2 - t1) * 1000 << " ms, NameList " << (t4 - t2) * 1000 << " ms (sort " << (t4 - t3) * 1000 << " ms)\n";
+    ASSERT_EQ(list.getKey(0), vec[0].first);
+    ASSERT_EQ(list.getKey(list.size() - 1), vec.back().first);
+}
+#endif
+
+
+} // namespace ut1
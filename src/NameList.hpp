@@ -0,0 +1,72 @@
+// Sortable list of filenames.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+namespace ut1
+{
+
+/// List of names with a sort key per name (e.g. the normalized name), stored in one contiguous arena.
+///
+/// Each key is computed once by the caller and stored right behind its name (or not at all if it equals the name),
+/// so there are no allocations per name. sort() orders the names by key with an MSD radix sort, which looks at each key
+/// byte about once instead of comparing common prefixes over and over. The order is the order of std::string::compare().
+class NameList
+{
+public:
+    /// Add name with sort key. Return the id of the name (the index in the order of add(), which is not changed by sort()).
+    uint32_t add(std::string_view name, std::string_view key);
+    uint32_t add(std::string_view name) { return add(name, name); }
+
+    /// Sort by key. Names with equal keys stay in the order in which they were added.
+    void sort();
+
+    /// Get the number of names.
+    size_t size() const { return entries.size(); }
+
+    /// Get name, key and id of the name at index i.
+    std::string_view getName(size_t i) const { return std::string_view(&arena[entries[i].offset], entries[i].nameLength); }
+    std::string_view getKey(size_t i) const { return std::string_view(&arena[getKeyOffset(entries[i])], entries[i].keyLength); }
+    uint32_t getId(size_t i) const { return entries[i].id; }
+
+    /// Get the approximate memory used in bytes.
+    size_t getMemory() const { return arena.capacity() + entries.capacity() * sizeof(Entry); }
+
+    /// Remove all names.
+    void clear();
+
+private:
+    struct Entry
+    {
+        size_t offset;
+        uint32_t nameLength;
+        uint32_t keyLength;
+        uint32_t id;
+        bool separateKey;
+    };
+
+    size_t getKeyOffset(const Entry& entry) const { return entry.offset + (entry.separateKey ? entry.nameLength : 0); }
+
+    /// Get byte depth of the key of entry plus one (0 for the end of the key).
+    unsigned getKeyByte(const Entry& entry, size_t depth) const
+    {
+        return (depth < entry.keyLength) ? unsigned(uint8_t(arena[getKeyOffset(entry) + depth])) + 1 : 0;
+    }
+
+    /// Sort entries [begin, end) whose keys share the first depth bytes by insertion sort.
+    void insertionSort(size_t begin, size_t end, size_t depth);
+
+    std::string arena;
+    std::vector<Entry> entries;
+};
+
+} // namespace ut1
@@ -0,0 +1,187 @@
+// Filter for directory trees with global patterns and per dir ignore files.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <sys/stat.h>
+#include "PathFilter.hpp"
+#include "DirFd.hpp"
+#include "MiscUtils.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+PathFilter::State PathFilter::getRootState(const std::filesystem::path& root) const
+{
+    State state;
+    state.global = global.getRootState();
+    if (std::shared_ptr<const GlobFilter> filter = getIgnoreFile(root))
+    {
+        state.ignoreFiles = std::make_shared<const State::Node>(State::Node{nullptr, filter, filter->getRootState()});
+    }
+    return state;
+}
+
+
+bool PathFilter::isExcluded(const State& state, std::string_view name, bool isDir) const
+{
+    GlobFilter::Result result = global.match(state.global, name, isDir);
+    for (const State::Node* node = state.ignoreFiles.get(); node && (result == GlobFilter::NO_MATCH); node = node->parent.get())
+    {
+        result = node->filter->match(node->state, name, isDir);
+    }
+    return result == GlobFilter::EXCLUDE;
+}
+
+
+PathFilter::State PathFilter::getChildState(const State& state, const std::filesystem::path& dir) const
+{
+    State r;
+    std::string name = dir.filename();
+    r.global = global.getChildState(state.global, name);
+    r.ignoreFiles = getChildNodes(state.ignoreFiles, name);
+    if (std::shared_ptr<const GlobFilter> filter = getIgnoreFile(dir))
+    {
+        r.ignoreFiles = std::make_shared<const State::Node>(State::Node{r.ignoreFiles, filter, filter->getRootState()});
+    }
+    return r;
+}
+
+
+std::shared_ptr<const PathFilter::State::Node> PathFilter::getChildNodes(const std::shared_ptr<const State::Node>& nodes, std::string_view name)
+{
+    if (!nodes)
+    {
+        return nodes;
+    }
+    std::shared_ptr<const State::Node> parent = getChildNodes(nodes->parent, name);
+    GlobFilter::State state = nodes->filter->getChildState(nodes->state, name);
+    if ((parent == nodes->parent) && (state.positions == nodes->state.positions))
+    {
+        // Share the unchanged list.
+        return nodes;
+    }
+    return std::make_shared<const State::Node>(State::Node{parent, nodes->filter, std::move(state)});
+}
+
+
+PathFilter::State PathFilter::getPathState(const std::filesystem::path& root, std::string_view path) const
+{
+    State state = getRootState(root);
+    std::filesystem::path dir = root;
+    for (const std::string& component: splitString(std::string(path), '/'))
+    {
+        if (!component.empty())
+        {
+            dir /= component;
+            state = getChildState(state, dir);
+        }
+    }
+    return state;
+}
+
+
+std::shared_ptr<const GlobFilter> PathFilter::getIgnoreFile(const std::filesystem::path& dir) const
+{
+    if (ignoreFilename.empty())
+    {
+        return nullptr;
+    }
+    std::filesystem::path filename = dir / ignoreFilename;
+    struct stat st;
+    if ((!statAt(filename, st, true)) || (!S_ISREG(st.st_mode)))
+    {
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        auto it = cache->files.find(filename);
+        if (it != cache->files.end())
+        {
+            return it->second;
+        }
+    }
+    auto filter = std::make_shared<GlobFilter>();
+    addIgnoreFile(*filter, readFileAt(filename));
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    return cache->files.emplace(filename, filter).first->second;
+}
+
+
+void PathFilter::addIgnoreFile(GlobFilter& filter, const std::string& content)
+{
+    for (std::string line: splitString(content, '\n'))
+    {
+        if (hasSuffix(line, "\r"))
+        {
+            line.pop_back();
+        }
+        // Trailing spaces are ignored unless quoted with '\'.
+        while (hasSuffix(line, " ") && !hasSuffix(line, "\\ "))
+        {
+            line.pop_back();
+        }
+        if (line.empty() || (line[0] == '#'))
+        {
+            continue;
+        }
+        bool include = line[0] == '!';
+        filter.add(include ? line.substr(1) : line, include);
+    }
+}
+
+
+UNIT_TEST(PathFilter)
+{
+    std::filesystem::create_directories("PathFilterTmp/a/b/c");
+    writeFile("PathFilterTmp/.ignore", "# Comment\n*.tmp\n/top\n\n!keep.tmp\nlogs/\n");
+    writeFile("PathFilterTmp/a/.ignore", "/b/c/x\r\nkeep.tmp\n!*.tmp  \n");
+
+    PathFilter filter;
+    filter.setIgnoreFilename(".ignore");
+    filter.getGlobal().add("*.o", false);
+    PathFilter::State root = filter.getRootState("PathFilterTmp");
+    ASSERT_EQ(filter.isExcluded(root, "x.tmp", false), true);
+    ASSERT_EQ(filter.isExcluded(root, "keep.tmp", false), false);
+    ASSERT_EQ(filter.isExcluded(root, "top", false), true);
+    ASSERT_EQ(filter.isExcluded(root, "logs", true), true);
+    ASSERT_EQ(filter.isExcluded(root, "x.o", false), true);
+
+    // Deeper ignore files take precedence. Anchored patterns are relative to the dir of the ignore file.
+    PathFilter::State a = filter.getChildState(root, "PathFilterTmp/a");
+    ASSERT_EQ(filter.isExcluded(a, "x.tmp", false), false);
+    ASSERT_EQ(filter.isExcluded(a, "keep.tmp", false), false);
+    ASSERT_EQ(filter.isExcluded(a, "top", false), false);
+    ASSERT_EQ(filter.isExcluded(a, "logs", true), true);
+    PathFilter::State b = filter.getChildState(a, "PathFilterTmp/a/b");
+    PathFilter::State c = filter.getChildState(b, "PathFilterTmp/a/b/c");
+    ASSERT_EQ(filter.isExcluded(c, "x", false), true);
+    ASSERT_EQ(filter.isExcluded(c, "y", false), false);
+    ASSERT_EQ(filter.isExcluded(c, "x.o", false), true);
+    ASSERT_EQ(filter.getPathState("PathFilterTmp", "a/b/c").ignoreFiles->state.positions == c.ignoreFiles->state.positions, true);
+
+    // Dirs without ignore files and without anchored patterns below them share the list of their parent.
+    PathFilter::State d = filter.getChildState(c, "PathFilterTmp/a/b/c/d");
+    PathFilter::State e = filter.getChildState(d, "PathFilterTmp/a/b/c/d/e");
+    ASSERT_EQ(d.ignoreFiles == e.ignoreFiles, true);
+    ASSERT_EQ(d.ignoreFiles->parent == a.ignoreFiles->parent, true);
+
+    // No ignore files.
+    PathFilter none;
+    ASSERT_EQ(none.empty(), true);
+    ASSERT_EQ(none.mayExclude(none.getRootState("PathFilterTmp")), false);
+    std::filesystem::remove_all("PathFilterTmp");
+}
+
+
+} // namespace ut1
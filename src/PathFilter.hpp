@@ -0,0 +1,94 @@
+// Filter for directory trees with global patterns and per dir ignore files.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <filesystem>
+#include "GlobFilter.hpp"
+
+namespace ut1
+{
+
+/// Filter for the entries of a directory tree: Global patterns (e.g. from the command line) plus the patterns of ignore files
+/// (with the syntax and semantics of .gitignore) in the dirs of the tree.
+///
+/// The patterns of an ignore file are relative to its dir and apply to everything below it. Patterns of deeper ignore files take
+/// precedence over the patterns of ignore files further up and the global patterns take precedence over all of them.
+///
+/// The state of a dir refers to the compiled ignore files of the dir and its parents in an immutable list (deepest first), together
+/// with the matcher state of each ignore file. Subdirs share the list of their parent as long as the states do not change, so deep
+/// trees do not copy the list per level. Each ignore file is compiled once (the compiled files are cached by path).
+class PathFilter
+{
+public:
+    /// Filter state of a dir.
+    struct State
+    {
+        struct Node
+        {
+            std::shared_ptr<const Node> parent;
+            std::shared_ptr<const GlobFilter> filter;
+            GlobFilter::State state;
+        };
+
+        GlobFilter::State global;
+        std::shared_ptr<const Node> ignoreFiles;
+    };
+
+    /// Get the global patterns.
+    GlobFilter& getGlobal() { return global; }
+
+    /// Set the name of the ignore files (empty: Do not read ignore files).
+    void setIgnoreFilename(const std::string& filename) { ignoreFilename = filename; }
+
+    /// Return true iff nothing can be excluded.
+    bool empty() const { return global.empty() && ignoreFilename.empty(); }
+
+    /// Return true iff entries of a dir with state may be excluded.
+    bool mayExclude(const State& state) const { return (!global.empty()) || state.ignoreFiles; }
+
+    /// Get the state of the root dir.
+    State getRootState(const std::filesystem::path& root) const;
+
+    /// Return true iff entry name of a dir with state is excluded.
+    bool isExcluded(const State& state, std::string_view name, bool isDir) const;
+
+    /// Get the state of the subdir dir of a dir with state (this reads the ignore file of dir).
+    State getChildState(const State& state, const std::filesystem::path& dir) const;
+
+    /// Get the state of dir root/path (path is relative, with components separated by '/').
+    State getPathState(const std::filesystem::path& root, std::string_view path) const;
+
+    /// Add the patterns of an ignore file with content to filter.
+    static void addIgnoreFile(GlobFilter& filter, const std::string& content);
+
+private:
+    /// Get the compiled ignore file of dir or nullptr if there is none.
+    std::shared_ptr<const GlobFilter> getIgnoreFile(const std::filesystem::path& dir) const;
+
+    /// Get the states of the ignore files of nodes for the subdir name.
+    static std::shared_ptr<const State::Node> getChildNodes(const std::shared_ptr<const State::Node>& nodes, std::string_view name);
+
+    struct Cache
+    {
+        std::mutex mutex;
+        std::map<std::string, std::shared_ptr<const GlobFilter>> files;
+    };
+
+    GlobFilter global;
+    std::string ignoreFilename;
+
+    /// Compiled ignore files (shared by all copies of the filter).
+    std::shared_ptr<Cache> cache = std::make_shared<Cache>();
+};
+
+} // namespace ut1
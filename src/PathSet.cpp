@@ -0,0 +1,148 @@
+// Set of relative paths, organized as a tree.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <stdexcept>
+#include "PathSet.hpp"
+#include "MiscUtils.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+void PathSet::add(std::string_view path)
+{
+    std::vector<std::string_view> components;
+    for (size_t start = 0; start <= path.size();)
+    {
+        size_t end = std::min(path.find('/', start), path.size());
+        std::string_view component = path.substr(start, end - start);
+        start = end + 1;
+        if (component.empty() || (component == "."))
+        {
+            continue;
+        }
+        if (component == "..")
+        {
+            throw std::runtime_error("PathSet::add(" + std::string(path) + "): Path must not contain '..'");
+        }
+        components.push_back(component);
+    }
+    if (components.empty())
+    {
+        all = true;
+        return;
+    }
+
+    uint32_t node = 0;
+    for (size_t i = 0; i < components.size(); i++)
+    {
+        auto it = nodes[node].find(components[i]);
+        if (i + 1 == components.size())
+        {
+            // The whole subtree is selected.
+            if (it == nodes[node].end())
+            {
+                nodes[node].emplace(components[i], ALL);
+            }
+            else
+            {
+                it->second = ALL;
+            }
+        }
+        else if (it == nodes[node].end())
+        {
+            uint32_t child = uint32_t(nodes.size());
+            nodes[node].emplace(components[i], child);
+            nodes.emplace_back();
+            node = child;
+        }
+        else if (it->second == ALL)
+        {
+            // Already selected by a parent path.
+            return;
+        }
+        else
+        {
+            node = it->second;
+        }
+    }
+}
+
+
+void PathSet::addList(const std::string& list)
+{
+    char separator = (list.find('\0') != std::string::npos) ? '\0' : '\n';
+    for (std::string entry: splitString(list, separator))
+    {
+        if ((separator == '\n') && hasSuffix(entry, "\r"))
+        {
+            entry.pop_back();
+        }
+        if (!entry.empty())
+        {
+            add(entry);
+        }
+    }
+}
+
+
+UNIT_TEST(PathSet)
+{
+    PathSet set;
+    ASSERT_EQ(set.empty(), true);
+    ASSERT_EQ(set.getRoot(), PathSet::ALL);
+
+    set.addList("a/b/c\n./a//b/d\r\n/x\n\na/e/f\n");
+    ASSERT_EQ(set.empty(), false);
+    uint32_t root = set.getRoot();
+    ASSERT_EQ(root, 0u);
+    ASSERT_EQ(set.getChildren(root).size(), 2u);
+    ASSERT_EQ(set.getChildren(root).at("x"), PathSet::ALL);
+    uint32_t a = set.getChildren(root).at("a");
+    uint32_t b = set.getChildren(a).at("b");
+    ASSERT_EQ(set.getChildren(a).size(), 2u);
+    ASSERT_EQ(set.getChildren(b).size(), 2u);
+    ASSERT_EQ(set.getChildren(b).at("c"), PathSet::ALL);
+    ASSERT_EQ(set.getChildren(b).at("d"), PathSet::ALL);
+    (void)b;
+
+    // A parent path selects the whole subtree, deeper paths below it do not change anything.
+    set.add("a/e");
+    set.add("a/e/g/h");
+    ASSERT_EQ(set.getChildren(a).at("e"), PathSet::ALL);
+
+    // NUL separated names may contain newlines.
+    PathSet set0;
+    set0.addList(std::string("n\nl\0m", 5));
+    ASSERT_EQ(set0.getChildren(set0.getRoot()).count("n\nl"), 1u);
+    ASSERT_EQ(set0.getChildren(set0.getRoot()).count("m"), 1u);
+
+    // The empty path selects everything.
+    set0.add(".");
+    ASSERT_EQ(set0.getRoot(), PathSet::ALL);
+    bool thrown = false;
+    try
+    {
+        set0.add("a/../b");
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    ASSERT_EQ(thrown, true);
+    (void)thrown;
+}
+
+
+} // namespace ut1
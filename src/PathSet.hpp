@@ -0,0 +1,58 @@
+// Set of relative paths, organized as a tree.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+namespace ut1
+{
+
+/// Set of paths (relative to the root of a directory tree), organized as a tree of nodes: One node per dir on the way to the paths,
+/// holding the names of its selected children. A path selects the whole subtree below it, so it does not get a node of its own.
+///
+/// This allows walking just the selected parts of a tree: For a node which is not ALL only the selected children have to be looked
+/// at, so the dir of a node does not have to be read at all.
+class PathSet
+{
+public:
+    /// Node id: Everything (the whole subtree) is selected.
+    static constexpr uint32_t ALL = UINT32_MAX;
+
+    /// Selected children of a node: Names and nodes.
+    using Children = std::map<std::string, uint32_t, std::less<>>;
+
+    /// Add path. Empty components and "." are ignored, leading '/' are ignored. An empty path selects everything.
+    /// Throw std::runtime_error on "..".
+    void add(std::string_view path);
+
+    /// Add all paths of list, separated by '\0' if list contains any '\0' and by '\n' otherwise ('\r' at the end of a line is ignored).
+    /// Empty entries are ignored.
+    void addList(const std::string& list);
+
+    /// Return true iff no path was added.
+    bool empty() const { return (!all) && nodes[0].empty(); }
+
+    /// Get the root node (ALL if no path was added or if the empty path was added).
+    uint32_t getRoot() const { return (all || nodes[0].empty()) ? ALL : 0; }
+
+    /// Get the names of the selected children of node (not ALL) with their nodes, sorted by name.
+    const Children& getChildren(uint32_t node) const { return nodes[node]; }
+
+private:
+    /// Selected children of each node (index 0: root).
+    std::vector<Children> nodes = std::vector<Children>(1);
+
+    /// The empty path was added.
+    bool all{};
+};
+
+} // namespace ut1
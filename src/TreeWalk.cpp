@@ -0,0 +1,88 @@
+// Depth first tree walk with an explicit stack.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <map>
+#include "TreeWalk.hpp"
+#include "MiscUtils.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+UNIT_TEST(TreeWalk)
+{
+    // Tree: a -> (b -> (d, e), c).
+    std::map<std::string, std::vector<std::string>> tree = {{"a", {"b", "c"}}, {"b", {"d", "e"}}};
+    std::string trace;
+    using Walk = TreeWalk<std::string, int>;
+    Walk walk;
+    walk.enter = [&](Walk::Level& level, Walk::Level* parent)
+    {
+        trace += "+" + *level.node;
+        level.data = parent ? parent->data + 1 : 0;
+        auto it = tree.find(*level.node);
+        if (it != tree.end())
+        {
+            level.children = it->second;
+        }
+    };
+    walk.leave = [&](Walk::Level& level, Walk::Level*)
+    {
+        trace += "-" + *level.node + std::to_string(level.data);
+    };
+    walk.getKey = [](const std::string& node) { return node; };
+    walk.run("a");
+    ASSERT_EQ(trace, "+a+b+d-d2+e-e2-b1+c-c1-a0");
+    ASSERT_EQ(walk.getDepth(), 0u);
+
+    // Checkpoint after each step and resume from there.
+    for (int steps = 1; steps < 9; steps++)
+    {
+        trace.clear();
+        walk.start("a");
+        for (int i = 0; i < steps; i++)
+        {
+            walk.step();
+        }
+        std::vector<std::string> position = walk.getPosition();
+        trace.clear();
+        walk.resume("a", position);
+        while (walk.step())
+        {
+        }
+        // The nodes on the path to the position are entered again, everything before the position is not.
+        std::string ref = std::vector<std::string>{"+a+b+d-d2+e-e2-b1+c-c1-a0", "+a+b+d-d2+e-e2-b1+c-c1-a0", "+a+b+e-e2-b1+c-c1-a0",
+                                                   "+a+b+e-e2-b1+c-c1-a0", "+a+b-b1+c-c1-a0", "+a+c-c1-a0", "+a+c-c1-a0", "+a-a0"}[size_t(steps - 1)];
+        ASSERT_EQ(trace, ref);
+        (void)ref;
+    }
+
+    // Deep trees do not grow the C++ stack.
+    size_t depth = 0;
+    using DeepWalk = TreeWalk<int>;
+    DeepWalk deep;
+    deep.enter = [&](DeepWalk::Level& level, DeepWalk::Level*)
+    {
+        depth = std::max(depth, size_t(*level.node));
+        if (*level.node < 100000)
+        {
+            level.children.push_back(*level.node + 1);
+        }
+    };
+    deep.run(0);
+    ASSERT_EQ(depth, 100000u);
+}
+
+
+} // namespace ut1
@@ -0,0 +1,149 @@
+// Depth first tree walk with an explicit stack.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <variant>
+#include <cstddef>
+
+namespace ut1
+{
+
+/// Depth first walk over a tree, using an explicit stack instead of recursion.
+/// The depth of the tree is only limited by memory, and the walk can run step by step, be suspended and be resumed.
+///
+/// The stack holds one Level per node on the path from the root to the current node: The node (which is owned by the children
+/// of the level below), the children of the node in visiting order, the index of the next child and user data.
+/// - enter(level, parent) is called when a node is visited (pre order). It fills level.children to descend into the node
+///   and may set level.data. parent is the level of the parent node (nullptr for the root).
+/// - leave(level, parent) (optional) is called after all children of the node were visited (post order).
+/// - more(level, parent) (optional) is called before that and may replace level.children with the next batch of children
+///   (resetting level.next to 0). This bounds the memory of levels with very many children.
+///
+/// Checkpoints: getPosition() returns the keys (getKey()) of the last entered child of each level. resume() restarts the walk
+/// at this position, entering the nodes on the path to it again. This requires the children to be sorted by their key (and
+/// to be listed completely by enter()).
+template<typename Node, typename Data = std::monostate>
+class TreeWalk
+{
+public:
+    struct Level
+    {
+        const Node* node{};
+        std::vector<Node> children;
+        size_t next{};
+        Data data{};
+    };
+
+    using Callback = std::function<void(Level& level, Level* parent)>;
+
+    Callback enter;
+    Callback leave;
+    Callback more;
+    std::function<std::string(const Node&)> getKey;
+
+    /// Start the walk at root. This enters root.
+    void start(Node root_)
+    {
+        stack.clear();
+        root = std::move(root_);
+        push(&root);
+    }
+
+    /// Enter the next node or leave the current node.
+    /// Return false when the walk is complete.
+    bool step()
+    {
+        if (stack.empty())
+        {
+            return false;
+        }
+        Level& level = stack.back();
+        if ((level.next >= level.children.size()) && more)
+        {
+            more(level, (stack.size() > 1) ? &stack[stack.size() - 2] : nullptr);
+        }
+        if (level.next < level.children.size())
+        {
+            push(&level.children[level.next++]);
+        }
+        else
+        {
+            if (leave)
+            {
+                leave(level, (stack.size() > 1) ? &stack[stack.size() - 2] : nullptr);
+            }
+            stack.pop_back();
+        }
+        return !stack.empty();
+    }
+
+    /// Walk the whole tree below root.
+    void run(Node root_)
+    {
+        start(std::move(root_));
+        while (step())
+        {
+        }
+    }
+
+    /// Get the current depth (0 when the walk is complete).
+    size_t getDepth() const { return stack.size(); }
+
+    /// Get the position of the walk: The key of the last entered child of each level (empty if no child was entered yet).
+    std::vector<std::string> getPosition() const
+    {
+        std::vector<std::string> position;
+        for (const Level& level: stack)
+        {
+            position.push_back(level.next ? getKey(level.children[level.next - 1]) : std::string());
+        }
+        return position;
+    }
+
+    /// Start the walk at root and skip to position (see getPosition()).
+    /// The last entered child of the top level was visited completely, so the walk continues behind it. The last entered
+    /// children of the other levels are entered again, since their subtrees were in progress. Children which vanished
+    /// since the checkpoint are skipped.
+    void resume(Node root_, const std::vector<std::string>& position)
+    {
+        start(std::move(root_));
+        for (size_t i = 0; (i < position.size()) && (!position[i].empty()) && (stack.size() == i + 1); i++)
+        {
+            Level& level = stack.back();
+            auto it = std::lower_bound(level.children.begin(), level.children.end(), position[i], [&](const Node& node, const std::string& key) { return getKey(node) < key; });
+            level.next = size_t(it - level.children.begin());
+            if ((it == level.children.end()) || (getKey(*it) != position[i]))
+            {
+                break;
+            }
+            if (i + 1 == position.size())
+            {
+                level.next++;
+                break;
+            }
+            step();
+        }
+    }
+
+private:
+    void push(const Node* node)
+    {
+        stack.emplace_back();
+        stack.back().node = node;
+        enter(stack.back(), (stack.size() > 1) ? &stack[stack.size() - 2] : nullptr);
+    }
+
+    Node root{};
+    std::vector<Level> stack;
+};
+
+} // namespace ut1
@@ -0,0 +1,427 @@
+// Unicode normalization and case folding of UTF-8 strings.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "Unicode.hpp"
+#include "MiscUtils.hpp"
+#ifdef ENABLE_UNIT_TEST
+#include "UnitTest.hpp"
+#else
+# define UNIT_TEST(name) class UnitTest_##name { void run(); }; inline void UnitTest_##name::run()
+# define ASSERT_EQ(a, b)
+#endif
+
+
+namespace ut1
+{
+
+
+namespace
+{
+
+#include "UnicodeTables.inc"
+
+/// Invalid UTF-8 bytes b are kept as the pseudo codepoint invalidByte + b, which has no decomposition and combining class 0.
+constexpr uint32_t invalidByte = 0x110000;
+
+// Hangul syllables (algorithmic decomposition and composition).
+constexpr uint32_t sBase = 0xac00;
+constexpr uint32_t lBase = 0x1100;
+constexpr uint32_t vBase = 0x1161;
+constexpr uint32_t tBase = 0x11a7;
+constexpr uint32_t lCount = 19;
+constexpr uint32_t vCount = 21;
+constexpr uint32_t tCount = 28;
+constexpr uint32_t sCount = lCount * vCount * tCount;
+
+/// Get the canonical combining class of c.
+unsigned getCcc(uint32_t c)
+{
+    return (c < invalidByte) ? cccBlocks[cccIndex[c >> blockShift]][c & ((1 << blockShift) - 1)] : 0;
+}
+
+/// Get the full canonical decomposition of c (number of codepoints followed by the codepoints) or nullptr.
+const uint32_t* getDecomposition(uint32_t c)
+{
+    if (c >= invalidByte)
+    {
+        return nullptr;
+    }
+    uint16_t offset = decompBlocks[decompIndex[c >> blockShift]][c & ((1 << blockShift) - 1)];
+    return offset ? &decompData[offset] : nullptr;
+}
+
+/// Get the full case folding of c (number of codepoints followed by the codepoints) or nullptr.
+const uint32_t* getCaseFolding(uint32_t c)
+{
+    if (c >= invalidByte)
+    {
+        return nullptr;
+    }
+    uint16_t offset = foldBlocks[foldIndex[c >> blockShift]][c & ((1 << blockShift) - 1)];
+    return offset ? &foldData[offset] : nullptr;
+}
+
+/// Get the primary composite of a and b or 0.
+uint32_t getComposite(uint32_t a, uint32_t b)
+{
+    if ((a - lBase < lCount) && (b - vBase < vCount))
+    {
+        return sBase + ((a - lBase) * vCount + (b - vBase)) * tCount;
+    }
+    if ((a - sBase < sCount) && ((a - sBase) % tCount == 0) && (b - tBase - 1 < tCount - 1))
+    {
+        return a + (b - tBase);
+    }
+    auto entry = std::lower_bound(std::begin(compositions), std::end(compositions), std::make_pair(a, b), [](const uint32_t (&e)[3], const std::pair<uint32_t, uint32_t>& key) { return (e[0] < key.first) || ((e[0] == key.first) && (e[1] < key.second)); });
+    return ((entry != std::end(compositions)) && ((*entry)[0] == a) && ((*entry)[1] == b)) ? (*entry)[2] : 0;
+}
+
+/// Decode the UTF-8 character at s[i] and advance i behind it.
+uint32_t decodeUtf8(std::string_view s, size_t& i)
+{
+    uint8_t b = uint8_t(s[i++]);
+    if (b < 0x80)
+    {
+        return b;
+    }
+    size_t n = 0;
+    uint32_t c = 0;
+    uint8_t min = 0x80;
+    uint8_t max = 0xbf;
+    if ((b >= 0xc2) && (b <= 0xdf))
+    {
+        n = 1;
+        c = b & 0x1f;
+    }
+    else if ((b >= 0xe0) && (b <= 0xef))
+    {
+        n = 2;
+        c = b & 0x0f;
+        min = (b == 0xe0) ? 0xa0 : 0x80; // No overlong encodings.
+        max = (b == 0xed) ? 0x9f : 0xbf; // No surrogates.
+    }
+    else if ((b >= 0xf0) && (b <= 0xf4))
+    {
+        n = 3;
+        c = b & 0x07;
+        min = (b == 0xf0) ? 0x90 : 0x80; // No overlong encodings.
+        max = (b == 0xf4) ? 0x8f : 0xbf; // Nothing above U+10FFFF.
+    }
+    if ((n == 0) || (i + n > s.size()) || (uint8_t(s[i]) < min) || (uint8_t(s[i]) > max))
+    {
+        return invalidByte + b;
+    }
+    for (size_t j = 0; j < n; j++)
+    {
+        uint8_t cont = uint8_t(s[i + j]);
+        if ((cont & 0xc0) != 0x80)
+        {
+            return invalidByte + b;
+        }
+        c = (c << 6) | (cont & 0x3f);
+    }
+    i += n;
+    return c;
+}
+
+/// Append c as UTF-8 to r.
+void encodeUtf8(uint32_t c, std::string& r)
+{
+    if (c < 0x80)
+    {
+        r += char(c);
+    }
+    else if (c < 0x800)
+    {
+        r += char(0xc0 | (c >> 6));
+        r += char(0x80 | (c & 0x3f));
+    }
+    else if (c < 0x10000)
+    {
+        r += char(0xe0 | (c >> 12));
+        r += char(0x80 | ((c >> 6) & 0x3f));
+        r += char(0x80 | (c & 0x3f));
+    }
+    else if (c < invalidByte)
+    {
+        r += char(0xf0 | (c >> 18));
+        r += char(0x80 | ((c >> 12) & 0x3f));
+        r += char(0x80 | ((c >> 6) & 0x3f));
+        r += char(0x80 | (c & 0x3f));
+    }
+    else
+    {
+        r += char(c - invalidByte);
+    }
+}
+
+/// Decode s into codepoints, fully decomposed and in canonical order.
+void decompose(std::string_view s, std::vector<uint32_t>& units)
+{
+    units.clear();
+    for (size_t i = 0; i < s.size();)
+    {
+        uint32_t c = decodeUtf8(s, i);
+        if (c - sBase < sCount)
+        {
+            uint32_t index = c - sBase;
+            units.push_back(lBase + index / (vCount * tCount));
+            units.push_back(vBase + (index % (vCount * tCount)) / tCount);
+            if (index % tCount)
+            {
+                units.push_back(tBase + index % tCount);
+            }
+        }
+        else if (const uint32_t* d = getDecomposition(c))
+        {
+            units.insert(units.end(), d + 1, d + 1 + d[0]);
+        }
+        else
+        {
+            units.push_back(c);
+        }
+    }
+
+    // Canonical ordering: Stable sort of each sequence of non starters by combining class.
+    for (size_t i = 1; i < units.size(); i++)
+    {
+        uint32_t c = units[i];
+        unsigned ccc = getCcc(c);
+        if (ccc == 0)
+        {
+            continue;
+        }
+        size_t j = i;
+        while ((j > 0) && (getCcc(units[j - 1]) > ccc))
+        {
+            units[j] = units[j - 1];
+            j--;
+        }
+        units[j] = c;
+    }
+}
+
+/// Canonical composition of decomposed units (see the reference algorithm in UAX #15).
+void compose(std::vector<uint32_t>& units)
+{
+    if (units.empty())
+    {
+        return;
+    }
+    size_t starter = 0;
+    unsigned lastCcc = getCcc(units[0]) ? 256 : 0; // Nothing composes with a leading non starter.
+    size_t n = 1;
+    for (size_t i = 1; i < units.size(); i++)
+    {
+        uint32_t c = units[i];
+        unsigned ccc = getCcc(c);
+        uint32_t composite = getComposite(units[starter], c);
+        if (composite && ((lastCcc < ccc) || (lastCcc == 0)))
+        {
+            units[starter] = composite;
+            continue;
+        }
+        if (ccc == 0)
+        {
+            starter = n;
+        }
+        lastCcc = ccc;
+        units[n++] = c;
+    }
+    units.resize(n);
+}
+
+/// Normalize s to NFD or NFC (see toNfd()).
+std::string_view normalize(std::string_view s, std::string& buffer, bool nfc)
+{
+    if (isAscii(s))
+    {
+        return s;
+    }
+    thread_local std::vector<uint32_t> units;
+    decompose(s, units);
+    if (nfc)
+    {
+        compose(units);
+    }
+    buffer.clear();
+    for (uint32_t c: units)
+    {
+        encodeUtf8(c, buffer);
+    }
+    return (buffer == s) ? s : std::string_view(buffer);
+}
+
+} // namespace
+
+
+bool isAscii(std::string_view s) noexcept
+{
+    const char* p = s.data();
+    size_t n = s.size();
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        if (word & 0x8080808080808080ULL)
+        {
+            return false;
+        }
+    }
+    for (; n > 0; p++, n--)
+    {
+        if (*p & 0x80)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+std::string_view toNfd(std::string_view s, std::string& buffer)
+{
+    return normalize(s, buffer, false);
+}
+
+
+std::string_view toNfc(std::string_view s, std::string& buffer)
+{
+    return normalize(s, buffer, true);
+}
+
+
+std::string_view toCaseFold(std::string_view s, std::string& buffer)
+{
+    if (isAscii(s))
+    {
+        auto isUpper = [](char c) { return (c >= 'A') && (c <= 'Z'); };
+        if (std::none_of(s.begin(), s.end(), isUpper))
+        {
+            return s;
+        }
+        buffer.assign(s);
+        for (char& c: buffer)
+        {
+            c = isUpper(c) ? char(c + ('a' - 'A')) : c;
+        }
+        return buffer;
+    }
+    buffer.clear();
+    for (size_t i = 0; i < s.size();)
+    {
+        uint32_t c = decodeUtf8(s, i);
+        if (const uint32_t* f = getCaseFolding(c))
+        {
+            for (uint32_t j = 1; j <= f[0]; j++)
+            {
+                encodeUtf8(f[j], buffer);
+            }
+        }
+        else
+        {
+            encodeUtf8(c, buffer);
+        }
+    }
+    return (buffer == s) ? s : std::string_view(buffer);
+}
+
+
+std::string toNfd(const std::string& s)
+{
+    std::string buffer;
+    return (toNfd(std::string_view(s), buffer).data() == s.data()) ? s : buffer;
+}
+
+
+std::string toNfc(const std::string& s)
+{
+    std::string buffer;
+    return (toNfc(std::string_view(s), buffer).data() == s.data()) ? s : buffer;
+}
+
+
+std::string toCaseFold(const std::string& s)
+{
+    std::string buffer;
+    return (toCaseFold(std::string_view(s), buffer).data() == s.data()) ? s : buffer;
+}
+
+
+UNIT_TEST(isAscii)
+{
+    ASSERT_EQ(isAscii(""), true);
+    ASSERT_EQ(isAscii("IMG_20230101_123456.jpg"), true);
+    ASSERT_EQ(isAscii("IMG_20230101_123456.jp\xc3\xa9"), false);
+    ASSERT_EQ(isAscii("\xc3\xa9IMG_20230101_123456.jpg"), false);
+}
+
+
+UNIT_TEST(toNfd)
+{
+    ASSERT_EQ(toNfd(""), "");
+    ASSERT_EQ(toNfd("\xcc\x88"), "\xcc\x88");
+    ASSERT_EQ(toNfd("A\xcc\x88"), "A\xcc\x88");
+    ASSERT_EQ(toNfd("\xc3\x84"), "A\xcc\x88");
+    ASSERT_EQ(toNfd("caf\xc3\xa9"), "cafe\xcc\x81");                                      // French.
+    ASSERT_EQ(toNfd("\xc3\x85r\xc3\xb8"), "A\xcc\x8ar\xc3\xb8");                          // Nordic (o with stroke does not decompose).
+    ASSERT_EQ(toNfd("\xe1\xba\xa5"), "a\xcc\x82\xcc\x81");                                // Vietnamese (recursive decomposition).
+    ASSERT_EQ(toNfd("\xe2\x84\xab"), "A\xcc\x8a");                                        // Angstrom sign (singleton).
+    ASSERT_EQ(toNfd("\xed\x95\x9c"), "\xe1\x84\x92\xe1\x85\xa1\xe1\x86\xab");             // Hangul syllable.
+    ASSERT_EQ(toNfd("\xe3\x81\x8c"), "\xe3\x81\x8b\xe3\x82\x99");                         // Hiragana ga.
+    ASSERT_EQ(toNfd("a\xcc\x81\xcc\xa3"), "a\xcc\xa3\xcc\x81");                           // Canonical order.
+    ASSERT_EQ(toNfd("\xff" "a\xc3\x28\xed\xa0\x80"), "\xff" "a\xc3\x28\xed\xa0\x80");     // Invalid UTF-8 is kept.
+
+    // ASCII and names which are already normalized are returned without copying.
+    std::string buffer;
+    std::string_view ascii = "IMG_1234.jpg";
+    ASSERT_EQ(toNfd(ascii, buffer).data() == ascii.data(), true);
+    std::string_view nfd = "cafe\xcc\x81";
+    ASSERT_EQ(toNfd(nfd, buffer).data() == nfd.data(), true);
+    ASSERT_EQ(toNfd(std::string_view("caf\xc3\xa9"), buffer), "cafe\xcc\x81");
+    (void)ascii;
+    (void)nfd;
+}
+
+
+UNIT_TEST(toNfc)
+{
+    ASSERT_EQ(toNfc(""), "");
+    ASSERT_EQ(toNfc("\xcc\x88"), "\xcc\x88");
+    ASSERT_EQ(toNfc("A\xcc\x88"), "\xc3\x84");
+    ASSERT_EQ(toNfc("cafe\xcc\x81"), "caf\xc3\xa9");
+    ASSERT_EQ(toNfc("a\xcc\x82\xcc\x81"), "\xe1\xba\xa5");
+    ASSERT_EQ(toNfc("\xe2\x84\xab"), "\xc3\x85");                                         // Singleton.
+    ASSERT_EQ(toNfc("\xe1\x84\x92\xe1\x85\xa1\xe1\x86\xab"), "\xed\x95\x9c");             // Hangul LV + T.
+    ASSERT_EQ(toNfc("a\xcc\x81\xcc\xa3"), "\xe1\xba\xa1\xcc\x81");                        // Canonical order before composition.
+    ASSERT_EQ(toNfc("\xe0\xa5\x98"), "\xe0\xa4\x95\xe0\xa4\xbc");                         // Composition exclusion.
+    ASSERT_EQ(toNfc("\xff" "e\xcc\x81"), "\xff\xc3\xa9");
+}
+
+
+UNIT_TEST(toCaseFold)
+{
+    ASSERT_EQ(toCaseFold(""), "");
+    ASSERT_EQ(toCaseFold("README.TXT"), "readme.txt");
+    ASSERT_EQ(toCaseFold("\xc3\x84nderung"), "\xc3\xa4nderung");
+    ASSERT_EQ(toCaseFold("Stra\xc3\x9f" "e"), "strasse");                                  // Full folding.
+    ASSERT_EQ(toCaseFold("\xce\xa3\xce\xa9\xcf\x82"), "\xcf\x83\xcf\x89\xcf\x83");          // Greek final sigma.
+    ASSERT_EQ(toCaseFold("\xe2\x84\xaa"), "k");                                            // Kelvin sign.
+    ASSERT_EQ(toCaseFold("A\xff"), "a\xff");
+
+    std::string buffer;
+    std::string_view lower = "img_1234.jpg";
+    ASSERT_EQ(toCaseFold(lower, buffer).data() == lower.data(), true);
+    (void)lower;
+}
+
+
+} // namespace ut1
@@ -0,0 +1,42 @@
+// Unicode normalization and case folding of UTF-8 strings.
+//
+// Copyright (c) 2024 Johannes Overmann
+//
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+namespace ut1
+{
+
+/// Return true iff s is pure ASCII (checked a word at a time).
+bool isAscii(std::string_view s) noexcept;
+
+/// Convert UTF-8 to NFD (canonical decomposition).
+/// Return s if it already is in NFD (always true for ASCII), else the normalized string in buffer, so that normalizing many
+/// strings with the same buffer does not allocate. Invalid UTF-8 bytes are kept unchanged.
+std::string_view toNfd(std::string_view s, std::string& buffer);
+
+/// Convert UTF-8 to NFC (canonical decomposition followed by canonical composition).
+/// Return s or buffer like toNfd().
+std::string_view toNfc(std::string_view s, std::string& buffer);
+
+/// Apply full Unicode case folding to UTF-8 (for case insensitive comparisons).
+/// Return s if nothing changes (e.g. lower case ASCII), else the folded string in buffer. Invalid UTF-8 bytes are kept unchanged.
+/// For canonical caseless matching use toNfd(toCaseFold(toNfd(s))).
+std::string_view toCaseFold(std::string_view s, std::string& buffer);
+
+/// Convert UTF-8 to NFD.
+std::string toNfd(const std::string& s);
+
+/// Convert UTF-8 to NFC.
+std::string toNfc(const std::string& s);
+
+/// Apply full Unicode case folding to UTF-8.
+std::string toCaseFold(const std::string& s);
+
+} // namespace ut1
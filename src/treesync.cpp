@@ -10,8 +10,32 @@
 #include <filesystem>
 #include <utility>
 #include <functional>
+#include <atomic>
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <tuple>
+#include <memory>
+#include <ctime>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "CommandLineParser.hpp"
 #include "MiscUtils.hpp"
+#include "DeltaTransfer.hpp"
+#include "FileIo.hpp"
+#include "Executor.hpp"
+#include "BufferPool.hpp"
+#include "DeviceInfo.hpp"
+#include "DirFd.hpp"
+#include "TreeWalk.hpp"
+#include "ExternalSort.hpp"
+#include "NameList.hpp"
+#include "Unicode.hpp"
+#include "PathFilter.hpp"
+#include "PathSet.hpp"
 #include "UnitTest.hpp"
 
 /// Output colors.
@@ -55,9 +79,122 @@ public:
     std::string nor = "\33[00m";
 };
 
+/// Statistics (--stats).
+class Stats
+{
+public:
+    /// Print statistics. The lines of optional features are only printed if the feature is enabled or if any of their values is non-zero.
+    void print(std::ostream& os) const
+    {
+        auto line = [&](const std::string& label, uint64_t value)
+        {
+            os << label << ":" << std::string((label.length() < 32) ? 32 - label.length() : 1, ' ') << value << "\n";
+        };
+        auto group = [&](bool enabled, const std::vector<std::pair<std::string, uint64_t>>& lines)
+        {
+            for (const auto& [label, value]: lines)
+            {
+                enabled = enabled || value;
+            }
+            if (enabled)
+            {
+                for (const auto& [label, value]: lines)
+                {
+                    line(label, value);
+                }
+            }
+        };
+        for (int method = ut1::CM_CLONE; method <= ut1::CM_READ_WRITE; method++)
+        {
+            if (copiedFiles[method])
+            {
+                line("Copied files (" + ut1::getCopyMethodStr(ut1::CopyMethod(method)) + ")", copiedFiles[method]);
+            }
+        }
+        line("Copied bytes", copiedBytes);
+        group(deltaEnabled, {{"Delta updated files", deltaFiles}, {"Delta literal bytes", deltaLiteralBytes}, {"Delta matched bytes", deltaMatchedBytes}});
+        group(appendEnabled, {{"Appended files", appendedFiles}, {"Appended bytes", appendedBytes}});
+        group(inplaceEnabled, {{"In place updated files", inplaceFiles}, {"In place rewritten blocks", inplaceBlocks}});
+        if (ut1::ioStats.splitFiles)
+        {
+            line("Compared files (split)", ut1::ioStats.splitFiles);
+        }
+        group(cachedFirstEnabled, {{"Compared files (cached)", cachedFiles}, {"Compared bytes (cached)", cachedBytes}, {"Compared files (uncached)", uncachedFiles}, {"Compared bytes (uncached)", uncachedBytes}});
+        if (ut1::ioStats.holeBytesSkipped)
+        {
+            line("Skipped bytes in holes", ut1::ioStats.holeBytesSkipped);
+        }
+        if (ut1::ioStats.sharedBytesSkipped)
+        {
+            line("Skipped bytes in shared extents", ut1::ioStats.sharedBytesSkipped);
+        }
+        if (ut1::bufferPool.getPeakBytes())
+        {
+            line("Peak I/O buffer memory", ut1::bufferPool.getPeakBytes());
+        }
+        group(externalSortEnabled, {{"Externally sorted dirs", externalDirs}, {"Externally sorted runs", externalRuns}});
+        if (nameFoldingEnabled || nameCollisions)
+        {
+            line("Name collisions", nameCollisions);
+        }
+        if (excludedEntries)
+        {
+            line("Excluded entries", excludedEntries);
+        }
+        if (fileFilterEnabled || filteredFiles)
+        {
+            line("Filtered files (size/mtime)", filteredFiles);
+        }
+        if (pruneOldDirsEnabled || prunedFiles)
+        {
+            line("Filtered files (old dirs)", prunedFiles);
+        }
+        for (const auto& [name, depth]: queueDepths)
+        {
+            line("I/O queue depth " + name, depth);
+        }
+    }
+
+    /// Optional features whose statistics are printed even if they are all zero.
+    bool deltaEnabled{};
+    bool appendEnabled{};
+    bool inplaceEnabled{};
+    bool cachedFirstEnabled{};
+    bool externalSortEnabled{};
+    bool nameFoldingEnabled{};
+    bool fileFilterEnabled{};
+    bool pruneOldDirsEnabled{};
+
+    std::atomic<uint64_t> copiedFiles[ut1::CM_READ_WRITE + 1]{};
+    std::atomic<uint64_t> copiedBytes{};
+    std::atomic<uint64_t> deltaFiles{};
+    std::atomic<uint64_t> deltaLiteralBytes{};
+    std::atomic<uint64_t> deltaMatchedBytes{};
+    std::atomic<uint64_t> appendedFiles{};
+    std::atomic<uint64_t> appendedBytes{};
+    std::atomic<uint64_t> inplaceFiles{};
+    std::atomic<uint64_t> inplaceBlocks{};
+    std::atomic<uint64_t> cachedFiles{};
+    std::atomic<uint64_t> cachedBytes{};
+    std::atomic<uint64_t> uncachedFiles{};
+    std::atomic<uint64_t> uncachedBytes{};
+    std::atomic<uint64_t> externalDirs{};
+    std::atomic<uint64_t> externalRuns{};
+    std::atomic<uint64_t> nameCollisions{};
+    std::atomic<uint64_t> excludedEntries{};
+    std::atomic<uint64_t> filteredFiles{};
+    std::atomic<uint64_t> prunedFiles{};
+
+    /// Final depth of the I/O queues (name, depth).
+    std::vector<std::pair<std::string, unsigned>> queueDepths;
+};
+
 class TreeDiff
 {
 public:
+    /// Order in which the regular files of a directory are compared.
+    enum Schedule { SCHEDULE_NAME, SCHEDULE_INODE, SCHEDULE_PHYSICAL };
+
     class Params
     {
     public:
@@ -70,39 +207,103 @@ public:
         bool followSymlinks{};
         bool ignoreContent{};
         bool normalizeFilenames{};
+        bool ignoreCase{};
+        Schedule schedule{SCHEDULE_NAME};
+        bool cachedFirst{};
+        bool prefetch{};
+
+        /// Excluded files and dirs (relative to srcdir and dstdir, plus the ignore files in the dirs being listed). Excluded entries are
+        /// skipped on both sides and excluded dirs are not read.
+        ut1::PathFilter filter;
+
+        /// Paths to process (relative to srcdir and dstdir, empty: everything). Only the selected entries of the dirs on the way to these
+        /// paths are looked at. These dirs are not read unless filenames are normalized or case folded.
+        ut1::PathSet paths;
+
+        /// Only process files (everything but dirs) with minSize <= size <= maxSize and newerThan <= mtime < olderThan (mtime in
+        /// seconds since the epoch). The src file is checked (the dst file for files which are only in dstdir). Other files are skipped
+        /// before their content is compared.
+        uint64_t minSize{};
+        uint64_t maxSize{UINT64_MAX};
+        int64_t newerThan{INT64_MIN};
+        int64_t olderThan{INT64_MAX};
+
+        /// Skip all files of dirs with mtime < newerThan (in srcdir and dstdir) without looking at them. Creating, renaming and deleting
+        /// files updates the mtime of their dir, so this only misses files which were modified in place.
+        bool pruneOldDirs{};
+
+        /// Return true iff files are filtered by size or mtime.
+        bool hasFileFilter() const { return minSize || (maxSize != UINT64_MAX) || (newerThan != INT64_MIN) || (olderThan != INT64_MAX); }
+
+        /// Memory limit for the listings of a pair of dirs (0: unlimited). Larger dirs are sorted externally in temporary files.
+        uint64_t listingMemory{};
+
+        /// Statistics (may be nullptr).
+        Stats* stats{};
 
         /// Called for items which are in src only.
-        std::function<void(const std::filesystem::directory_entry &, const std::filesystem::path &, Params&)> srcOnly;
+        std::function<void(const ut1::DirEntry &, const std::filesystem::path &, Params&)> srcOnly;
 
         /// Called for items which are in dst only.
-        std::function<void(const std::filesystem::path &, const std::filesystem::directory_entry &, Params&)> dstOnly;
+        std::function<void(const std::filesystem::path &, const ut1::DirEntry &, Params&)> dstOnly;
 
         /// Called for regular files with the same content, symlink with the same link target, char and block device with the same major/minor and fifos and sockets.
-        std::function<void(const std::filesystem::directory_entry &, const std::filesystem::directory_entry &, Params&)> match;
+        std::function<void(const ut1::DirEntry &, const ut1::DirEntry &, Params&)> match;
 
         /// Called for regular files with different content, symlinks with different link targets, char and block devices with different major/minor.
-        std::function<void(const std::filesystem::directory_entry &, const std::filesystem::directory_entry &, Params&)> mismatch;
+        std::function<void(const ut1::DirEntry &, const ut1::DirEntry &, Params&)> mismatch;
 
         /// Called when src and dst are of different type.
-        std::function<void(const std::filesystem::directory_entry &, const std::filesystem::directory_entry &, Params&)> typeMismatch;
+        std::function<void(const ut1::DirEntry &, const ut1::DirEntry &, Params&)> typeMismatch;
+
+        /// Called instead of typeMismatch when src is a dir on the way to the selected paths (see paths) and dst is not a dir.
+        /// dst is to be replaced by an empty dir. Only the selected entries below src are processed afterwards.
+        /// If not set typeMismatch is called instead and the entries below src are not processed.
+        std::function<void(const ut1::DirEntry &, const ut1::DirEntry &, Params&)> replaceByDir;
 
         /// Called before src and dst are scanned.
-        std::function<void(const std::filesystem::directory_entry &, const std::filesystem::directory_entry &, Params&)> progressDirs;
+        std::function<void(const ut1::DirEntry &, const ut1::DirEntry &, Params&)> progressDirs;
 
         /// Called before src and dst (same name and same type) are compared.
-        std::function<void(const std::filesystem::directory_entry &, const std::filesystem::directory_entry &, Params&)> progressFiles;
+        std::function<void(const ut1::DirEntry &, const ut1::DirEntry &, Params&)> progressFiles;
 
         /// Called for ignored dir (if ignoreDirs).
-        std::function<void(const std::filesystem::directory_entry &, Params&)> ignoredDir;
+        std::function<void(const ut1::DirEntry &, Params&)> ignoredDir;
 
         /// Called for ignored special files (if ignoreSpecial).
-        std::function<void(const std::filesystem::directory_entry &, Params&)> ignoredFile;
+        std::function<void(const ut1::DirEntry &, Params&)> ignoredFile;
+
+        /// Called for an entry which is ignored because its name compares equal to the name of another entry of the same dir
+        /// (see normalizeFilenames and ignoreCase). Of all these names the smallest one (byte order) is used.
+        std::function<void(const ut1::DirEntry &used, const ut1::DirEntry &ignored, Params&)> nameCollision;
     };
 
     TreeDiff(const Params &params_) : params(params_)
     {
     }
 
+    /// Get the key by which the comparison and the copy of file are scheduled: (device, inode) or (device, first physical byte).
+    /// Files without a known physical location (empty files, no FIEMAP support) fall back to the inode number.
+    /// The key is (0, 0) for SCHEDULE_NAME.
+    static std::pair<uint64_t, uint64_t> getScheduleKey(const ut1::DirEntry &file, const TreeDiff::Params& params)
+    {
+        if (params.schedule == SCHEDULE_NAME)
+        {
+            return {0, 0};
+        }
+        ut1::StatInfo stat = ut1::getStatAt(file.path(), params.followSymlinks);
+        if (params.schedule == SCHEDULE_PHYSICAL)
+        {
+            ut1::File f(file.path(), O_RDONLY);
+            ut1::Extent extent;
+            if (f.getFirstExtent(extent))
+            {
+                return {stat.getDev(), extent.physical};
+            }
+        }
+        return {stat.getDev(), stat.getIno()};
+    }
+
     /// Return true iff file/dir should be ignored.
     static bool ignoreSrcFile(const std::string& filename, const TreeDiff::Params& params)
     {
@@ -115,198 +316,716 @@ public:
         return params.ignoreForksDst && ut1::hasPrefix(filename, "._");
     }
 
-    /// Process directory trees recursively.
+    /// Return true iff entry of a dir with filterState is excluded by params.filter.
+    static bool isExcluded(const ut1::DirEntry& entry, const ut1::PathFilter::State& filterState, const TreeDiff::Params& params)
+    {
+        return params.filter.mayExclude(filterState) && params.filter.isExcluded(filterState, entry.path().filename().native(), ut1::getFileType(entry, params.followSymlinks) == ut1::FT_DIR);
+    }
+
+    /// Get the filter state of the dir containing path (which is below params.srcdir or params.dstdir).
+    static ut1::PathFilter::State getParentFilterState(const std::filesystem::path& path, const TreeDiff::Params& params)
+    {
+        auto normal = [](const std::filesystem::path& p) { std::filesystem::path r = p.lexically_normal(); return r.has_filename() ? r : r.parent_path(); };
+        std::filesystem::path dir = normal(path).parent_path();
+        for (const std::string& root: {params.srcdir, params.dstdir})
+        {
+            std::filesystem::path rel = dir.lexically_relative(normal(root));
+            if ((!rel.empty()) && (*rel.begin() != ".."))
+            {
+                return params.filter.getPathState(normal(root), (rel == ".") ? std::string() : rel.generic_string());
+            }
+        }
+        return params.filter.getRootState(dir);
+    }
+
+    /// Process directory trees.
     void process()
     {
-        processDir(std::filesystem::directory_entry(params.srcdir), std::filesystem::directory_entry(params.dstdir));
+        processDir(ut1::DirEntry(params.srcdir), ut1::DirEntry(params.dstdir));
     }
 
 private:
-    // Returns true if no difference is found.
-    bool processDir(const std::filesystem::directory_entry &src, const std::filesystem::directory_entry &dst)
+    /// Return true iff most of the data of both files is in the page cache.
+    static bool isCached(const ut1::DirEntry &src, const ut1::DirEntry &dst)
     {
-        // Report progress.
-        progressDirs(src, dst);
+        return (ut1::File(src.path(), O_RDONLY).getCachedFraction() >= 0.5) && (ut1::File(dst.path(), O_RDONLY).getCachedFraction() >= 0.5);
+    }
 
-        // Read src dir.
-        std::map<std::string, std::filesystem::directory_entry> srcmap;
-        for (const std::filesystem::directory_entry &entry: std::filesystem::directory_iterator(src))
+    /// Entry of the merged listing of a src dir and a dst dir.
+    /// The path of src or dst is empty for entries which are only in one of both dirs.
+    struct Item
+    {
+        std::string name;
+        ut1::DirEntry src;
+        ut1::DirEntry dst;
+    };
+
+    /// Compare the content of all regular files of items which are in both dirs and have the same size.
+    /// With cachedFirst files which are in the page cache are compared first. Then files are compared in the order of getScheduleKey() of the src file.
+    /// With prefetch the start of the next pair is read ahead while a pair is compared.
+    /// Return the names of all files with identical content.
+    std::set<std::string> compareScheduled(const std::vector<Item>& items) const
+    {
+        struct Pending
+        {
+            bool cold;
+            std::pair<uint64_t, uint64_t> key;
+            const Item* item;
+        };
+        std::vector<Pending> pending;
+        for (const Item& item: items)
         {
-            if (ignoreSrcFile(entry.path().filename(), params))
+            if ((!item.src.path().empty()) && (!item.dst.path().empty()) &&
+                (ut1::getFileType(item.src, params.followSymlinks) == ut1::FT_REGULAR) &&
+                (ut1::getFileType(item.dst, params.followSymlinks) == ut1::FT_REGULAR) &&
+                (item.src.getSize() == item.dst.getSize()))
             {
-                continue;
+                pending.push_back(Pending{params.cachedFirst && !isCached(item.src, item.dst), getScheduleKey(item.src, params), &item});
             }
-            std::string fname = entry.path().filename();
+        }
+        std::stable_sort(pending.begin(), pending.end(), [](const Pending& a, const Pending& b) { return std::tie(a.cold, a.key) < std::tie(b.cold, b.key); });
+
+        std::set<std::string> r;
+        for (size_t i = 0; i < pending.size(); i++)
+        {
+            const Pending& p = pending[i];
+            if (params.prefetch && (i + 1 < pending.size()))
+            {
+                ut1::File(pending[i + 1].item->src.path(), O_RDONLY).readahead(0, ut1::defaultBlockSize);
+                ut1::File(pending[i + 1].item->dst.path(), O_RDONLY).readahead(0, ut1::defaultBlockSize);
+            }
+            if (ut1::compareFiles(p.item->src.path(), p.item->dst.path()))
+            {
+                r.insert(p.item->name);
+            }
+            if (params.cachedFirst && params.stats)
+            {
+                (p.cold ? params.stats->uncachedFiles : params.stats->cachedFiles)++;
+                (p.cold ? params.stats->uncachedBytes : params.stats->cachedBytes) += p.item->src.getSize();
+            }
+        }
+        return r;
+    }
+
+    /// Listings of a dir pair which exceed Params::listingMemory, sorted on disk and merged batch by batch.
+    struct ExternalListing
+    {
+        std::unique_ptr<ut1::ExternalSorter> src;
+        std::unique_ptr<ut1::ExternalSorter> dst;
+        bool srcValid{};
+        bool dstValid{};
+        std::string srcKey;
+        std::string srcName;
+        std::string dstKey;
+        std::string dstName;
+    };
+
+    /// State of a pair of dirs being processed.
+    struct DirState
+    {
+        bool scheduled{};
+        std::set<std::string> identical;
+        bool noDifferenceFound{true};
+        std::unique_ptr<ExternalListing> listing;
+        ut1::PathFilter::State filterState;
+
+        /// The dir pair. Dirs on the way to the selected paths (Params::paths) may be missing on one side.
+        ut1::DirEntry src;
+        ut1::DirEntry dst;
+
+        /// Node of the dir pair in Params::paths (ALL: All entries are selected).
+        uint32_t selection{ut1::PathSet::ALL};
+
+        /// Keys of the selected entries with their nodes (unless selection is ALL).
+        std::map<std::string, uint32_t> selected;
+
+        /// All files of the dir pair are older than Params::newerThan (see Params::pruneOldDirs).
+        bool oldFiles{};
+    };
+
+    /// Walk over the items of the dir pairs. Each level holds the merged listing of one dir pair, sorted by name.
+    using Walk = ut1::TreeWalk<Item, DirState>;
+
+    /// Number of items of an externally sorted dir pair held in memory at a time.
+    static constexpr size_t externalBatchSize = 4096;
+
+    /// Listing of a dir: The filenames with their (possibly normalized) keys and the dir entries, indexed by the ids of the names.
+    struct Listing
+    {
+        ut1::NameList names;
+        std::vector<ut1::DirEntry> entries;
+    };
+
+    /// Get the key under which filename name is compared: The name, normalized (normalizeFilenames) and/or case folded (ignoreCase).
+    /// The key may point into buffers.
+    std::string_view getNameKey(std::string_view name, std::string (&buffers)[3]) const
+    {
+        std::string_view key = name;
+        if (params.normalizeFilenames)
+        {
+            key = ut1::toNfd(key, buffers[0]);
+        }
+        if (params.ignoreCase)
+        {
+            // Canonical caseless matching: Case folding may produce unnormalized strings.
+            key = ut1::toCaseFold(key, buffers[1]);
             if (params.normalizeFilenames)
             {
-                fname = ut1::toNfd(fname);
+                key = ut1::toNfd(key, buffers[2]);
+            }
+        }
+        return key;
+    }
+
+    /// Get the key of an externally sorted entry: The sorter sorts by key and then by name (key + '\0' + name).
+    static std::string getSorterKey(std::string_view key, std::string_view name)
+    {
+        std::string r(key);
+        r += '\0';
+        r += name;
+        return r;
+    }
+
+    /// Read dir into listing, skipping ignored files.
+    /// Once the listing needs more than half of params.listingMemory, all entries are moved into sorter and all further
+    /// entries are added to sorter (key: see getSorterKey(), value: filename).
+    void readListing(const ut1::DirEntry &dir, bool src, const ut1::PathFilter::State& filterState, Listing& listing, std::unique_ptr<ut1::ExternalSorter>& sorter) const
+    {
+        uint64_t budget = params.listingMemory / 2;
+        uint64_t memory = 0;
+        std::string buffers[3];
+        ut1::DirReader reader(dir);
+        for (ut1::DirEntry entry; reader.next(entry);)
+        {
+            std::string fname = entry.path().filename();
+            if (src ? ignoreSrcFile(fname, params) : ignoreDstFile(fname, params))
+            {
+                continue;
+            }
+            if (isExcluded(entry, filterState, params))
+            {
+                if (params.stats)
+                {
+                    params.stats->excludedEntries++;
+                }
+                continue;
+            }
+            std::string_view key = getNameKey(fname, buffers);
+            if (sorter)
+            {
+                sorter->add(getSorterKey(key, fname), fname);
+                continue;
+            }
+            listing.names.add(fname, key);
+            listing.entries.push_back(entry);
+
+            // Approximate size of the entry (the names are in listing.names).
+            memory += entry.path().native().size() + sizeof(entry) + 32;
+            if (budget && (memory + listing.names.getMemory() > budget))
+            {
+                sorter = std::make_unique<ut1::ExternalSorter>(budget);
+                addListing(*sorter, listing);
+                listing = Listing();
+            }
+        }
+    }
+
+    /// Add all entries of listing to sorter in the order in which they were read.
+    static void addListing(ut1::ExternalSorter& sorter, const Listing& listing)
+    {
+        std::vector<size_t> index(listing.names.size());
+        for (size_t i = 0; i < listing.names.size(); i++)
+        {
+            index[listing.names.getId(i)] = i;
+        }
+        for (size_t i: index)
+        {
+            sorter.add(getSorterKey(listing.names.getKey(i), listing.names.getName(i)), std::string(listing.names.getName(i)));
+        }
+    }
+
+    /// Return sorter (or a new sorter holding the entries of listing) ready for reading.
+    std::unique_ptr<ut1::ExternalSorter> finishListing(const Listing& listing, std::unique_ptr<ut1::ExternalSorter> sorter) const
+    {
+        if (!sorter)
+        {
+            sorter = std::make_unique<ut1::ExternalSorter>(params.listingMemory / 2);
+            addListing(*sorter, listing);
+        }
+        sorter->finish();
+        return sorter;
+    }
+
+    /// Get the next entry of the externally sorted listing of dir.
+    /// Entries with the key of the previous entry are reported as name collisions and skipped.
+    bool nextListingEntry(ut1::ExternalSorter& sorter, std::string& key, std::string& name, const std::filesystem::path& dir)
+    {
+        std::string lastKey = std::move(key);
+        std::string lastName = std::move(name);
+        while (sorter.next(key, name))
+        {
+            key.resize(key.find('\0'));
+            if (lastName.empty() || (key != lastKey))
+            {
+                return true;
+            }
+            nameCollision(ut1::DirEntry(dir / lastName), ut1::DirEntry(dir / name));
+        }
+        return false;
+    }
+
+    /// Get the indices of the used names of the sorted listing: Of several names with the same key the smallest name is used,
+    /// the others are reported as name collisions.
+    std::vector<size_t> selectNames(const Listing& listing)
+    {
+        const ut1::NameList& names = listing.names;
+        std::vector<size_t> r;
+        std::vector<size_t> group;
+        for (size_t i = 0; i < names.size();)
+        {
+            size_t end = i + 1;
+            while ((end < names.size()) && (names.getKey(end) == names.getKey(i)))
+            {
+                end++;
+            }
+            if (end - i > 1)
+            {
+                group.clear();
+                for (size_t j = i; j < end; j++)
+                {
+                    group.push_back(j);
+                }
+                std::sort(group.begin(), group.end(), [&](size_t a, size_t b) { return names.getName(a) < names.getName(b); });
+                for (size_t j = 1; j < group.size(); j++)
+                {
+                    nameCollision(listing.entries[names.getId(group[0])], listing.entries[names.getId(group[j])]);
+                }
+                i = group[0];
+            }
+            r.push_back(i);
+            i = end;
+        }
+        return r;
+    }
+
+    /// Replace level.children with the next batch of items of the externally sorted listings of the dir pair.
+    void fillChildren(Walk::Level& level)
+    {
+        ExternalListing& l = *level.data.listing;
+        const std::filesystem::path& src = level.data.src.path();
+        const std::filesystem::path& dst = level.data.dst.path();
+        level.children.clear();
+        level.next = 0;
+        while ((level.children.size() < externalBatchSize) && (l.srcValid || l.dstValid))
+        {
+            if (l.srcValid && ((!l.dstValid) || (l.srcKey < l.dstKey)))
+            {
+                level.children.push_back(Item{l.srcKey, ut1::DirEntry(src / l.srcName), ut1::DirEntry()});
+                l.srcValid = nextListingEntry(*l.src, l.srcKey, l.srcName, src);
+            }
+            else if (l.dstValid && ((!l.srcValid) || (l.srcKey > l.dstKey)))
+            {
+                level.children.push_back(Item{l.dstKey, ut1::DirEntry(), ut1::DirEntry(dst / l.dstName)});
+                l.dstValid = nextListingEntry(*l.dst, l.dstKey, l.dstName, dst);
+            }
+            else
+            {
+                level.children.push_back(Item{l.srcKey, ut1::DirEntry(src / l.srcName), ut1::DirEntry(dst / l.dstName)});
+                l.srcValid = nextListingEntry(*l.src, l.srcKey, l.srcName, src);
+                l.dstValid = nextListingEntry(*l.dst, l.dstKey, l.dstName, dst);
+            }
+            if ((!isSelected(level.data, level.children.back())) || isFiltered(level.data, level.children.back()))
+            {
+                level.children.pop_back();
             }
-            srcmap[fname] = entry;
         }
+    }
+
+    /// Return true iff item of dir is selected by Params::paths.
+    static bool isSelected(const DirState& dir, const Item& item)
+    {
+        return (dir.selection == ut1::PathSet::ALL) || (dir.selected.count(item.name) > 0);
+    }
 
-        // Read dst dir.
-        std::map<std::string, std::filesystem::directory_entry> dstmap;
-        if (ut1::fsExists(dst))
+    /// Return true iff item of dir is a file (not a dir) which is skipped because of its size or mtime (see Params::minSize etc).
+    bool isFiltered(const DirState& dir, const Item& item) const
+    {
+        const ut1::DirEntry& entry = item.src.path().empty() ? item.dst : item.src;
+        if (dir.oldFiles)
         {
-            for (const std::filesystem::directory_entry &entry: std::filesystem::directory_iterator(dst))
+            bool old = ut1::getFileType(entry, params.followSymlinks) != ut1::FT_DIR;
+            if (old && params.stats)
             {
-                if (ignoreDstFile(entry.path().filename(), params))
+                params.stats->prunedFiles++;
+            }
+            return old;
+        }
+        if (!params.hasFileFilter())
+        {
+            return false;
+        }
+        struct stat st;
+        if ((!ut1::statAt(entry.path(), st, params.followSymlinks)) && (!ut1::statAt(entry.path(), st, false)))
+        {
+            // Vanished.
+            return false;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            return false;
+        }
+        bool filtered = (uint64_t(st.st_size) < params.minSize) || (uint64_t(st.st_size) > params.maxSize) || (int64_t(st.st_mtime) < params.newerThan) || (int64_t(st.st_mtime) >= params.olderThan);
+        if (filtered && params.stats)
+        {
+            params.stats->filteredFiles++;
+        }
+        return filtered;
+    }
+
+    /// Return true iff dir (which may be missing) has an mtime < Params::newerThan.
+    bool isOldDir(const ut1::DirEntry& dir) const
+    {
+        struct stat st;
+        return (!ut1::statAt(dir.path(), st, params.followSymlinks)) || (int64_t(st.st_mtime) < params.newerThan);
+    }
+
+    /// Return true iff item of dir is a dir on the way to the selected paths. Such dirs are walked even if they are missing on one side.
+    bool isPartiallySelectedDir(const DirState& dir, const Item& item) const
+    {
+        return (dir.selection != ut1::PathSet::ALL) && (dir.selected.at(item.name) != ut1::PathSet::ALL) &&
+            (ut1::getFileType(item.src.path().empty() ? item.dst : item.src, params.followSymlinks) == ut1::FT_DIR);
+    }
+
+    /// Read the selected entries of the dir pair of level into level.children (without reading the dirs).
+    /// This requires the keys of the names to be the names.
+    void readSelected(Walk::Level& level) const
+    {
+        const DirState& dir = level.data;
+        for (const auto& [name, node]: dir.selected)
+        {
+            Item item{name, ut1::DirEntry(), ut1::DirEntry()};
+            for (bool src: {true, false})
+            {
+                std::filesystem::path path = (src ? dir.src : dir.dst).path() / name;
+                if ((src ? ignoreSrcFile(name, params) : ignoreDstFile(name, params)) || (!ut1::fsExists(path)))
                 {
                     continue;
                 }
-                std::string fname = entry.path().filename();
-                if (params.normalizeFilenames)
+                ut1::DirEntry entry(path);
+                if (isExcluded(entry, dir.filterState, params))
                 {
-                    fname = ut1::toNfd(fname);
+                    if (params.stats)
+                    {
+                        params.stats->excludedEntries++;
+                    }
+                    continue;
                 }
-                dstmap[fname] = entry;
+                (src ? item.src : item.dst) = entry;
+            }
+            if ((!item.src.path().empty()) || (!item.dst.path().empty()))
+            {
+                level.children.push_back(std::move(item));
             }
         }
+    }
 
-        // Compare dirs by iterating over both lists simultaneously.
-        auto itsrc = srcmap.begin();
-        auto itdst = dstmap.begin();
-        bool noDifferenceFound = true;
-        for (;;)
+    /// Read the src and dst dir of level into level.children (or into level.data.listing for huge dirs), keeping only the selected entries.
+    void readListings(Walk::Level& level)
+    {
+        const ut1::DirEntry& src = level.data.src;
+        const ut1::DirEntry& dst = level.data.dst;
+
+        // Read both dirs.
+        Listing srcListing;
+        Listing dstListing;
+        std::unique_ptr<ut1::ExternalSorter> srcSorter;
+        std::unique_ptr<ut1::ExternalSorter> dstSorter;
+        if (ut1::fsExists(src))
+        {
+            readListing(src, true, level.data.filterState, srcListing, srcSorter);
+        }
+        // The dst of a dir on the way to the selected paths may be a non-dir (see Params::replaceByDir).
+        if (ut1::fsExists(dst) && ((level.data.selection == ut1::PathSet::ALL) || ut1::fsIsDirectory(dst.path(), params.followSymlinks)))
+        {
+            readListing(dst, false, level.data.filterState, dstListing, dstSorter);
+        }
+
+        // Huge dirs: Merge the externally sorted listings batch by batch (results are reported in name order, just like below).
+        if (srcSorter || dstSorter)
         {
-            if ((itsrc == srcmap.end()) && (itdst == dstmap.end()))
+            level.data.listing = std::make_unique<ExternalListing>();
+            ExternalListing& listing = *level.data.listing;
+            listing.src = finishListing(srcListing, std::move(srcSorter));
+            listing.dst = finishListing(dstListing, std::move(dstSorter));
+            listing.srcValid = nextListingEntry(*listing.src, listing.srcKey, listing.srcName, src.path());
+            listing.dstValid = nextListingEntry(*listing.dst, listing.dstKey, listing.dstName, dst.path());
+            if (params.stats)
             {
-                break;
+                params.stats->externalDirs++;
+                params.stats->externalRuns += listing.src->getNumRuns() + listing.dst->getNumRuns();
             }
+            fillChildren(level);
+            return;
+        }
 
-            // Check for deletion.
-            if ((itsrc != srcmap.end()) && ((itdst == dstmap.end()) || (itsrc->first < itdst->first)))
+        // Merge both lists.
+        const ut1::NameList& srcNames = srcListing.names;
+        const ut1::NameList& dstNames = dstListing.names;
+        srcListing.names.sort();
+        dstListing.names.sort();
+        std::vector<size_t> srcUsed = selectNames(srcListing);
+        std::vector<size_t> dstUsed = selectNames(dstListing);
+        auto itsrc = srcUsed.begin();
+        auto itdst = dstUsed.begin();
+        while ((itsrc != srcUsed.end()) || (itdst != dstUsed.end()))
+        {
+            if ((itsrc != srcUsed.end()) && ((itdst == dstUsed.end()) || (srcNames.getKey(*itsrc) < dstNames.getKey(*itdst))))
             {
-                // Src only.
-                srcOnly(itsrc->second, dst.path());
-                noDifferenceFound = false;
+                level.children.push_back(Item{std::string(srcNames.getKey(*itsrc)), srcListing.entries[srcNames.getId(*itsrc)], ut1::DirEntry()});
                 itsrc++;
             }
-            else if ((itdst != dstmap.end()) && ((itsrc == srcmap.end()) || (itsrc->first > itdst->first)))
+            else if ((itdst != dstUsed.end()) && ((itsrc == srcUsed.end()) || (srcNames.getKey(*itsrc) > dstNames.getKey(*itdst))))
             {
-                // Dst only.
-                dstOnly(src.path(), itdst->second);
-                noDifferenceFound = false;
+                level.children.push_back(Item{std::string(dstNames.getKey(*itdst)), ut1::DirEntry(), dstListing.entries[dstNames.getId(*itdst)]});
                 itdst++;
             }
             else
             {
-                // Names are matching. Compare type.
-                assert(itsrc != srcmap.end());
-                assert(itdst != dstmap.end());
-                assert(itsrc->first == itdst->first);
+                level.children.push_back(Item{std::string(srcNames.getKey(*itsrc)), srcListing.entries[srcNames.getId(*itsrc)], dstListing.entries[dstNames.getId(*itdst)]});
+                itsrc++;
+                itdst++;
+            }
+        }
+        if (level.data.selection != ut1::PathSet::ALL)
+        {
+            level.children.erase(std::remove_if(level.children.begin(), level.children.end(), [&](const Item& item) { return !isSelected(level.data, item); }), level.children.end());
+        }
+    }
+
+    /// Read the src and dst dir of level.node (or just their entries selected by Params::paths) into level.children. parent is the
+    /// level of the parent dir (nullptr for the root).
+    /// The content of regular files is compared here already if the comparison is scheduled.
+    void readDir(Walk::Level& level, const Walk::Level* parent)
+    {
+        const Item& item = *level.node;
+        DirState& dir = level.data;
+        dir.src = item.src.path().empty() ? ut1::DirEntry(parent->data.src.path() / item.dst.path().filename()) : item.src;
+        dir.dst = item.dst.path().empty() ? ut1::DirEntry(parent->data.dst.path() / item.src.path().filename()) : item.dst;
+        if (!params.filter.empty())
+        {
+            dir.filterState = parent ? params.filter.getChildState(parent->data.filterState, dir.src.path()) : params.filter.getRootState(dir.src.path());
+        }
+        dir.selection = parent ? ((parent->data.selection == ut1::PathSet::ALL) ? ut1::PathSet::ALL : parent->data.selected.at(item.name)) : params.paths.getRoot();
+        if (dir.selection != ut1::PathSet::ALL)
+        {
+            std::string buffers[3];
+            for (const auto& [name, node]: params.paths.getChildren(dir.selection))
+            {
+                dir.selected.emplace(getNameKey(name, buffers), node);
+            }
+        }
+
+        dir.oldFiles = params.pruneOldDirs && (params.newerThan != INT64_MIN) && isOldDir(dir.src) && isOldDir(dir.dst);
+
+        // Report progress.
+        progressDirs(dir.src, dir.dst);
+
+        if ((dir.selection != ut1::PathSet::ALL) && (!params.normalizeFilenames) && (!params.ignoreCase))
+        {
+            // Selected entries only: Just look them up.
+            readSelected(level);
+        }
+        else
+        {
+            readListings(level);
+            if (dir.listing)
+            {
+                // Huge dirs are compared batch by batch.
+                return;
+            }
+        }
+        if (params.hasFileFilter() || dir.oldFiles)
+        {
+            level.children.erase(std::remove_if(level.children.begin(), level.children.end(), [&](const Item& child) { return isFiltered(dir, child); }), level.children.end());
+        }
+
+        // Compare file contents in disk order (results are still reported in name order).
+        dir.scheduled = ((params.schedule != SCHEDULE_NAME) || params.cachedFirst || params.prefetch) && (!params.ignoreContent);
+        if (dir.scheduled)
+        {
+            dir.identical = compareScheduled(level.children);
+        }
+    }
+
+    /// Compare the item level.node of the dir pair parent.
+    /// Dirs which are in both dirs (and dirs on the way to the selected paths) are read into level.children.
+    void processItem(Walk::Level& level, Walk::Level& parent)
+    {
+        const Item& item = *level.node;
+        DirState& dir = parent.data;
+        if ((item.src.path().empty() || item.dst.path().empty()) && isPartiallySelectedDir(dir, item))
+        {
+            // Dir on the way to selected paths: Only process these.
+            readDir(level, &parent);
+            return;
+        }
+        if (item.dst.path().empty())
+        {
+            // Src only.
+            srcOnly(item.src, dir.dst.path());
+            dir.noDifferenceFound = false;
+            return;
+        }
+        if (item.src.path().empty())
+        {
+            // Dst only.
+            dstOnly(dir.src.path(), item.dst);
+            dir.noDifferenceFound = false;
+            return;
+        }
 
-                ut1::FileType srctype = ut1::getFileType(itsrc->second, params.followSymlinks);
-                ut1::FileType dsttype = ut1::getFileType(itdst->second, params.followSymlinks);
-                if (srctype != dsttype)
+        // Names are matching. Compare type.
+        ut1::FileType srctype = ut1::getFileType(item.src, params.followSymlinks);
+        ut1::FileType dsttype = ut1::getFileType(item.dst, params.followSymlinks);
+        if ((srctype != dsttype) && (srctype == ut1::FT_DIR) && params.replaceByDir && isPartiallySelectedDir(dir, item))
+        {
+            // Dir on the way to selected paths, but dst is not a dir: Replace dst by a dir and only process the selected paths.
+            replaceByDir(item.src, item.dst);
+            dir.noDifferenceFound = false;
+            readDir(level, &parent);
+        }
+        else if (srctype != dsttype)
+        {
+            // File type does not match. Generate a type mismatch.
+            typeMismatch(item.src, item.dst);
+            dir.noDifferenceFound = false;
+        }
+        else
+        {
+            // Names and file types match. Compare content.
+            ut1::FileType type = ut1::getFileType(item.src, params.followSymlinks);
+            if (type != ut1::FT_DIR)
+            {
+                progressFiles(item.src, item.dst);
+            }
+            switch (type)
+            {
+            case ut1::FT_REGULAR:
+                if ((item.src.getSize() == item.dst.getSize()) &&
+                    (params.ignoreContent || (dir.scheduled ? (dir.identical.count(item.name) > 0) : ut1::compareFiles(item.src.path(), item.dst.path()))))
                 {
-                    // File type does not match. Generate a type mismatch.
-                    typeMismatch(itsrc->second, itdst->second);
-                    noDifferenceFound = false;
+                    match(item.src, item.dst);
                 }
                 else
                 {
-                    // Names and file types match. Compare content.
-                    ut1::FileType type = ut1::getFileType(itsrc->second, params.followSymlinks);
-                    if (type != ut1::FT_DIR)
-                    {
-                        progressFiles(itsrc->second, itdst->second);
-                    }
-                    switch (type)
-                    {
-                    case ut1::FT_REGULAR:
-                        if ((itsrc->second.file_size() == itdst->second.file_size()) &&
-                            (params.ignoreContent || (ut1::readFile(itsrc->second.path()) == ut1::readFile(itdst->second.path()))))
-                        {
-                            match(itsrc->second, itdst->second);
-                        }
-                        else
-                        {
-                            mismatch(itsrc->second, itdst->second);
-                            noDifferenceFound = false;
-                        }
-                        break;
+                    mismatch(item.src, item.dst);
+                    dir.noDifferenceFound = false;
+                }
+                break;
 
-                    case ut1::FT_DIR:
-                        if (!params.ignoreDirs)
-                        {
-                            if (!processDir(itsrc->second, itdst->second))
-                            {
-                                noDifferenceFound = false;
-                            }
-                        }
-                        else
-                        {
-                            ignoredDir(itsrc->second);
-                            ignoredDir(itdst->second);
-                        }
-                        break;
+            case ut1::FT_DIR:
+                if (!params.ignoreDirs)
+                {
+                    readDir(level, &parent);
+                }
+                else
+                {
+                    ignoredDir(item.src);
+                    ignoredDir(item.dst);
+                }
+                break;
 
-                    case ut1::FT_SYMLINK:
-                        if (std::filesystem::read_symlink(itsrc->second) == std::filesystem::read_symlink(itdst->second))
-                        {
-                            match(itsrc->second, itdst->second);
-                        }
-                        else
-                        {
-                            mismatch(itsrc->second, itdst->second);
-                            noDifferenceFound = false;
-                        }
-                        break;
+            case ut1::FT_SYMLINK:
+                if (std::filesystem::path(ut1::readlinkAt(item.src.path())) == std::filesystem::path(ut1::readlinkAt(item.dst.path())))
+                {
+                    match(item.src, item.dst);
+                }
+                else
+                {
+                    mismatch(item.src, item.dst);
+                    dir.noDifferenceFound = false;
+                }
+                break;
 
-                    case ut1::FT_FIFO:
-                    case ut1::FT_SOCKET:
-                        if (!params.ignoreSpecial)
-                        {
-                            // Fifos and sockets have no content and always match.
-                            match(itsrc->second, itdst->second);
-                        }
-                        else
-                        {
-                            ignoredFile(itsrc->second);
-                            ignoredFile(itdst->second);
-                        }
-                        break;
+            case ut1::FT_FIFO:
+            case ut1::FT_SOCKET:
+                if (!params.ignoreSpecial)
+                {
+                    // Fifos and sockets have no content and always match.
+                    match(item.src, item.dst);
+                }
+                else
+                {
+                    ignoredFile(item.src);
+                    ignoredFile(item.dst);
+                }
+                break;
 
-                    case ut1::FT_BLOCK:
-                    case ut1::FT_CHAR:
-                        if (!params.ignoreSpecial)
-                        {
-                            if (ut1::getStat(itsrc->second).getRDev() == ut1::getStat(itdst->second).getRDev())
-                            {
-                                match(itsrc->second, itdst->second);
-                            }
-                            else
-                            {
-                                mismatch(itsrc->second, itdst->second);
-                                noDifferenceFound = false;
-                            }
-                        }
-                        else
-                        {
-                            ignoredFile(itsrc->second);
-                            ignoredFile(itdst->second);
-                        }
-                        break;
-
-                    case ut1::FT_NON_EXISTING:
-                        // Will never occur unless files vanish after directory scanning.
-                        // Broken symbolic links are reported through FT_BROKEN_SYMLINK.
-                        ignoredFile(itsrc->second);
-                        ignoredFile(itdst->second);
-                        break;
+            case ut1::FT_BLOCK:
+            case ut1::FT_CHAR:
+                if (!params.ignoreSpecial)
+                {
+                    if (ut1::getStatAt(item.src.path()).getRDev() == ut1::getStatAt(item.dst.path()).getRDev())
+                    {
+                        match(item.src, item.dst);
+                    }
+                    else
+                    {
+                        mismatch(item.src, item.dst);
+                        dir.noDifferenceFound = false;
                     }
                 }
+                else
+                {
+                    ignoredFile(item.src);
+                    ignoredFile(item.dst);
+                }
+                break;
 
-                itsrc++;
-                itdst++;
+            case ut1::FT_NON_EXISTING:
+                // Will never occur unless files vanish after directory scanning.
+                // Broken symbolic links are reported through FT_BROKEN_SYMLINK.
+                ignoredFile(item.src);
+                ignoredFile(item.dst);
+                break;
             }
         }
+    }
 
+    /// Compare the dirs src and dst and everything below them.
+    /// Returns true if no difference is found.
+    bool processDir(const ut1::DirEntry &src, const ut1::DirEntry &dst)
+    {
+        bool noDifferenceFound = true;
+        Walk walk;
+        walk.enter = [&](Walk::Level& level, Walk::Level* parent)
+        {
+            if (parent)
+            {
+                processItem(level, *parent);
+            }
+            else
+            {
+                readDir(level, nullptr);
+            }
+        };
+        walk.more = [&](Walk::Level& level, Walk::Level*)
+        {
+            if (level.data.listing)
+            {
+                fillChildren(level);
+            }
+        };
+        walk.leave = [&](Walk::Level& level, Walk::Level* parent)
+        {
+            bool& result = parent ? parent->data.noDifferenceFound : noDifferenceFound;
+            result = result && level.data.noDifferenceFound;
+        };
+        walk.run(Item{std::string(), src, dst});
         return noDifferenceFound;
     }
 
-    void srcOnly(const std::filesystem::directory_entry &src, const std::filesystem::path &dstdir)
+    void srcOnly(const ut1::DirEntry &src, const std::filesystem::path &dstdir)
     {
         if (params.srcOnly)
         {
@@ -314,7 +1033,7 @@ private:
         }
     }
 
-    void dstOnly(const std::filesystem::path &srcdir, const std::filesystem::directory_entry &dst)
+    void dstOnly(const std::filesystem::path &srcdir, const ut1::DirEntry &dst)
     {
         if (params.dstOnly)
         {
@@ -322,7 +1041,7 @@ private:
         }
     }
 
-    void match(const std::filesystem::directory_entry &src, const std::filesystem::directory_entry &dst)
+    void match(const ut1::DirEntry &src, const ut1::DirEntry &dst)
     {
         if (params.match)
         {
@@ -330,7 +1049,7 @@ private:
         }
     }
 
-    void mismatch(const std::filesystem::directory_entry &src, const std::filesystem::directory_entry &dst)
+    void mismatch(const ut1::DirEntry &src, const ut1::DirEntry &dst)
     {
         if (params.mismatch)
         {
@@ -338,7 +1057,7 @@ private:
         }
     }
 
-    void typeMismatch(const std::filesystem::directory_entry &src, const std::filesystem::directory_entry &dst)
+    void typeMismatch(const ut1::DirEntry &src, const ut1::DirEntry &dst)
     {
         if (params.typeMismatch)
         {
@@ -346,7 +1065,15 @@ private:
         }
     }
 
-    void progressDirs(const std::filesystem::directory_entry &src, const std::filesystem::directory_entry &dst)
+    void replaceByDir(const ut1::DirEntry &src, const ut1::DirEntry &dst)
+    {
+        if (params.replaceByDir)
+        {
+            params.replaceByDir(src, dst, params);
+        }
+    }
+
+    void progressDirs(const ut1::DirEntry &src, const ut1::DirEntry &dst)
     {
         if (params.progressDirs)
         {
@@ -354,7 +1081,7 @@ private:
         }
     }
 
-    void progressFiles(const std::filesystem::directory_entry &src, const std::filesystem::directory_entry &dst)
+    void progressFiles(const ut1::DirEntry &src, const ut1::DirEntry &dst)
     {
         if (params.progressFiles)
         {
@@ -362,7 +1089,7 @@ private:
         }
     }
 
-    void ignoredDir(const std::filesystem::directory_entry &entry)
+    void ignoredDir(const ut1::DirEntry &entry)
     {
         if (params.ignoredDir)
         {
@@ -370,7 +1097,7 @@ private:
         }
     }
 
-    void ignoredFile(const std::filesystem::directory_entry &entry)
+    void ignoredFile(const ut1::DirEntry &entry)
     {
         if (params.ignoredFile)
         {
@@ -378,80 +1105,140 @@ private:
         }
     }
 
+    void nameCollision(const ut1::DirEntry &used, const ut1::DirEntry &ignored)
+    {
+        if (params.stats)
+        {
+            params.stats->nameCollisions++;
+        }
+        if (params.nameCollision)
+        {
+            params.nameCollision(used, ignored, params);
+        }
+    }
+
     Params params;
 };
 
 
 /// Print directory entry.
-void printDirectoryEntry(const std::filesystem::directory_entry &entry, const std::string &prefix, const std::string &suffix, const TreeDiff::Params& params, bool recursive, bool src)
+void printDirectoryEntry(const ut1::DirEntry &entry, const std::string &prefix, const std::string &suffix, const TreeDiff::Params& params, bool recursive, bool src, std::ostream& os)
 {
-    if (src ? TreeDiff::ignoreSrcFile(entry.path().filename(), params) : TreeDiff::ignoreDstFile(entry.path().filename(), params))
+    // Level data: Filter state of the node.
+    using Walk = ut1::TreeWalk<ut1::DirEntry, ut1::PathFilter::State>;
+    Walk walk;
+    walk.enter = [&](Walk::Level& level, Walk::Level* parent)
     {
-        return;
-    }
+        const ut1::DirEntry& entry_ = *level.node;
+        if (src ? TreeDiff::ignoreSrcFile(entry_.path().filename(), params) : TreeDiff::ignoreDstFile(entry_.path().filename(), params))
+        {
+            return;
+        }
+        if (parent && TreeDiff::isExcluded(entry_, parent->data, params))
+        {
+            return;
+        }
 
-    std::cout << prefix << ut1::getFileTypeStr(entry, params.followSymlinks) << " " << entry.path() << suffix << "\n";
-    if (!recursive || !entry.is_directory())
-    {
-        return;
-    }
-    for (const std::filesystem::directory_entry &entry_: std::filesystem::directory_iterator(entry))
-    {
-        printDirectoryEntry(entry_, prefix, suffix, params, recursive, src);
-    }
+        os << prefix << ut1::getFileTypeStr(entry_, params.followSymlinks) << " " << entry_.path() << suffix << "\n";
+        if (!recursive || (ut1::getFileType(entry_, params.followSymlinks) != ut1::FT_DIR))
+        {
+            return;
+        }
+        if (!params.filter.empty())
+        {
+            level.data = params.filter.getChildState(parent ? parent->data : TreeDiff::getParentFilterState(entry_.path(), params), entry_.path());
+        }
+        ut1::DirReader reader(entry_);
+        for (ut1::DirEntry child; reader.next(child);)
+        {
+            level.children.push_back(child);
+        }
+    };
+    walk.run(entry);
 }
 
 
 /// Create directories if necessary.
 /// This functions prints verbose messages and honours dummy mode.
-void mkDirs(const std::filesystem::path &dir, bool verbose, const std::string& verbosePrefix, bool dummyMode)
+void mkDirs(const std::filesystem::path &dir, bool verbose, const std::string& verbosePrefix, bool dummyMode, std::ostream& os)
 {
-    if ((!ut1::fsExists(dir)) || dummyMode)
+    struct stat st;
+    bool exists = ut1::statAt(dir, st, false);
+    if ((!exists) || dummyMode)
     {
         if (verbose)
         {
-            std::cout << verbosePrefix << " " << dir << "\n";
+            os << verbosePrefix << " " << dir << "\n";
         }
         if (!dummyMode)
         {
-            std::filesystem::create_directories(dir);
+            // Create the missing parents top down, each relative to the descriptor of its parent.
+            std::vector<std::filesystem::path> missing;
+            for (std::filesystem::path p = dir; (!p.empty()) && (!ut1::statAt(p, st)); p = p.parent_path())
+            {
+                missing.push_back(p);
+            }
+            for (auto it = missing.rbegin(); it != missing.rend(); ++it)
+            {
+                ut1::mkdirAt(*it);
+            }
         }
     }
     else
     {
-        if (!ut1::fsIsDirectory(dir, false))
+        if (!S_ISDIR(st.st_mode))
         {
-            std::stringstream os;
-            os << "Cannot create dir " << dir << " on existing non-dir " << dir;
-            throw std::runtime_error(os.str());
+            std::stringstream msg;
+            msg << "Cannot create dir " << dir << " on existing non-dir " << dir;
+            throw std::runtime_error(msg.str());
         }
     }
 }
 
 
+/// Get number of bytes to be copied for src (for the in-flight limit of the executor).
+/// The size of dirs is not known in advance and counts as 0.
+uint64_t getCopySize(const ut1::DirEntry &src, bool followSymlinks)
+{
+    return ut1::fsIsRegular(src, followSymlinks) ? src.getSize() : 0;
+}
+
+
 /// Remove file or directory recursively.
 /// This is similar to std::filesystem::remove_all().
 /// This functions prints verbose messages and honours dummy mode.
-void removeRecursive(const std::filesystem::path &dst, bool verbose, const std::string& verbosePrefix, bool followSymlinks, bool dummyMode)
+void removeRecursive(const std::filesystem::path &dst, bool verbose, const std::string& verbosePrefix, bool followSymlinks, bool dummyMode, std::ostream& os)
 {
-    // First remove directory contents, recursively.
-    if (ut1::fsIsDirectory(dst, false))
+    // Level data: True for dirs.
+    using Walk = ut1::TreeWalk<std::filesystem::path, bool>;
+    Walk walk;
+    walk.enter = [&](Walk::Level& level, Walk::Level*)
     {
-        for (const std::filesystem::directory_entry &dst_: std::filesystem::directory_iterator(dst))
+        // First remove directory contents.
+        struct stat st;
+        level.data = ut1::statAt(*level.node, st, false) && S_ISDIR(st.st_mode);
+        if (level.data)
         {
-           removeRecursive(dst_, verbose, verbosePrefix, followSymlinks, dummyMode);
+            ut1::DirReader reader(*level.node);
+            for (ut1::DirEntry dst_; reader.next(dst_);)
+            {
+                level.children.push_back(dst_.path());
+            }
         }
-    }
-
-    // Remove file or dir.
-    if (verbose)
-    {
-        std::cout << verbosePrefix << " " << ut1::getFileTypeStr(dst, followSymlinks) << " " << dst << "\n";
-    }
-    if (!dummyMode)
+    };
+    walk.leave = [&](Walk::Level& level, Walk::Level*)
     {
-        std::filesystem::remove(dst);
-    }
+        // Remove file or dir.
+        if (verbose)
+        {
+            os << verbosePrefix << " " << ut1::getFileTypeStr(*level.node, followSymlinks) << " " << *level.node << "\n";
+        }
+        if (!dummyMode)
+        {
+            ut1::unlinkAt(*level.node, level.data);
+        }
+    };
+    walk.run(dst);
 }
 
 
@@ -462,50 +1249,276 @@ void removeRecursive(const std::filesystem::path &dst, bool verbose, const std::
 /// - Honour dummy mode.
 /// - Overwrite symlinks and dirs on overwrite_existing.
 /// - Always recursive.
-void copyRecursive(const std::filesystem::directory_entry &src, const std::filesystem::path &dstdir, std::filesystem::copy_options copy_options, bool verbose, const std::string& verbosePrefix, const TreeDiff::Params& params, bool dummyMode)
+/// - Copy regular files using ut1::copyFile() (reflink/in-kernel copy if possible).
+void copyRecursive(const ut1::DirEntry &src, const std::filesystem::path &dstdir, std::filesystem::copy_options copy_options, bool verbose, const std::string& verbosePrefix, const TreeDiff::Params& params, bool dummyMode, Stats& stats, std::ostream& os)
 {
-    if (TreeDiff::ignoreSrcFile(src.path().filename(), params))
+    // Level data: Destination and filter state of the node.
+    struct Data
     {
-        return;
-    }
+        std::filesystem::path dst;
+        ut1::PathFilter::State filterState;
+    };
+    using Walk = ut1::TreeWalk<ut1::DirEntry, Data>;
+    Walk walk;
+    walk.enter = [&](Walk::Level& level, Walk::Level* parent)
+    {
+        const ut1::DirEntry& src_ = *level.node;
+        if (TreeDiff::ignoreSrcFile(src_.path().filename(), params))
+        {
+            return;
+        }
+        if (parent && TreeDiff::isExcluded(src_, parent->data.filterState, params))
+        {
+            return;
+        }
+
+        level.data.dst = (parent ? parent->data.dst : dstdir) / src_.path().filename();
+        const std::filesystem::path& dst = level.data.dst;
+
+        // overwrite_existing does not replace symlinks or directories etc, so delete the destination first if it exists, unless both are regular files.
+        if (bool(copy_options & std::filesystem::copy_options::overwrite_existing) && ut1::fsExists(dst) && ((!ut1::fsIsRegular(src_, params.followSymlinks)) || (!ut1::fsIsRegular(dst, /*followSymlinks=*/false))))
+        {
+            removeRecursive(dst, verbose, verbosePrefix  + ": Deleting", params.followSymlinks, dummyMode, os);
+        }
+
+        if (ut1::getFileType(src_, params.followSymlinks) == ut1::FT_DIR)
+        {
+            mkDirs(dst, verbose, verbosePrefix + ": Creating dir", dummyMode, os);
+            if (!params.filter.empty())
+            {
+                level.data.filterState = params.filter.getChildState(parent ? parent->data.filterState : TreeDiff::getParentFilterState(src_.path(), params), src_.path());
+            }
+
+            // Read dir.
+            ut1::DirReader reader(src_);
+            for (ut1::DirEntry child; reader.next(child);)
+            {
+                level.children.push_back(child);
+            }
+
+            // Sort entries and copy in sorted order so listing in unsorted order (simple devices) looks nice.
+            std::sort(level.children.begin(), level.children.end());
+        }
+        else
+        {
+            if (verbose)
+            {
+                os << verbosePrefix << " " << ut1::getFileTypeStr(src_, params.followSymlinks) << " " << src_.path() << " -> " << dst << "\n";
+            }
+            if (!dummyMode)
+            {
+                if (ut1::fsIsRegular(src_, params.followSymlinks) && (bool(copy_options & std::filesystem::copy_options::overwrite_existing) || !ut1::fsExists(dst)))
+                {
+                    ut1::CopyMethod method = ut1::copyFile(src_.path(), dst);
+                    stats.copiedFiles[method]++;
+                    stats.copiedBytes += src_.getSize();
+                }
+                else if (ut1::getFileType(src_, params.followSymlinks) == ut1::FT_SYMLINK)
+                {
+                    ut1::symlinkAt(ut1::readlinkAt(src_), dst);
+                }
+                else
+                {
+                    std::filesystem::copy(src_.path(), dst, copy_options);
+                }
+            }
+        }
+    };
+    walk.run(src);
+}
 
-    std::filesystem::path dst = dstdir / src.path().filename();
 
-    // overwrite_existing does not replace symlinks or directories etc, so delete the destination first if it exists, unless both are regular files.
-    if (bool(copy_options & std::filesystem::copy_options::overwrite_existing) && ut1::fsExists(dst) && ((!ut1::fsIsRegular(src, params.followSymlinks)) || (!ut1::fsIsRegular(dst, /*followSymlinks=*/false))))
+/// Update existing regular file dst with the content of src by only transferring the differing blocks (rsync algorithm).
+/// This functions prints verbose messages and honours dummy mode.
+void deltaUpdateFile(const ut1::DirEntry &src, const std::filesystem::path &dst, bool inplace, bool verbose, const std::string& verbosePrefix, bool dummyMode, Stats& stats, std::ostream& os)
+{
+    if (verbose)
     {
-        removeRecursive(dst, verbose, verbosePrefix  + ": Deleting", params.followSymlinks, dummyMode);
+        os << verbosePrefix << " file " << src.path() << " -> " << dst;
     }
-
-    if (src.is_directory())
+    if (!dummyMode)
+    {
+        ut1::DeltaResult r = ut1::deltaUpdateFile(src.path(), dst, inplace);
+        stats.deltaFiles++;
+        stats.deltaLiteralBytes += r.literalBytes;
+        stats.deltaMatchedBytes += r.matchedBytes;
+        if (verbose)
+        {
+            os << " (" << r.literalBytes << " literal bytes, " << r.matchedBytes << " matched bytes)";
+        }
+    }
+    if (verbose)
     {
-        mkDirs(dst, verbose, verbosePrefix + ": Creating dir", dummyMode);
+        os << "\n";
+    }
+}
 
-	// Read dir.
-	std::vector<std::filesystem::directory_entry> entries;
-        for (const std::filesystem::directory_entry &src_: std::filesystem::directory_iterator(src))
-	{
-	    entries.push_back(src_);
-	}
 
-	// Sort entries and copy in sorted order so listing in unsorted order (simple devices) looks nice.
-	std::sort(entries.begin(), entries.end());
-	for (const std::filesystem::directory_entry &src_: entries)
+/// Append the tail of src to dst if dst is a prefix of src (i.e. src is dst plus appended data).
+/// Return false (without modifying dst) if dst is not a prefix of src.
+/// This functions prints verbose messages and honours dummy mode.
+bool appendUpdateFile(const ut1::DirEntry &src, const std::filesystem::path &dst, bool verbose, const std::string& verbosePrefix, bool fsync, bool dummyMode, Stats& stats, std::ostream& os)
+{
+    ut1::File srcFile(src.path(), O_RDONLY);
+    ut1::File dstFile(dst, dummyMode ? O_RDONLY : O_RDWR);
+    if (!ut1::isPrefixOf(dstFile, srcFile))
+    {
+        return false;
+    }
+    uint64_t dstSize = dstFile.getSize();
+    uint64_t tailSize = srcFile.getSize() - dstSize;
+    if (verbose)
+    {
+        os << verbosePrefix << " file " << src.path() << " -> " << dst << " (" << tailSize << " bytes)\n";
+    }
+    if (!dummyMode)
+    {
+        stats.appendedFiles++;
+        stats.appendedBytes += ut1::copyFileData(srcFile, dstFile, dstSize, dstSize, tailSize);
+        if (fsync)
         {
-            copyRecursive(src_, dst, copy_options, verbose, verbosePrefix, params, dummyMode);
+            dstFile.fsync();
         }
+        dstFile.close();
     }
-    else
+    return true;
+}
+
+
+/// Update existing regular file dst of the same size as src in place by just overwriting the differing blocks.
+/// This functions prints verbose messages and honours dummy mode.
+void inplaceUpdateFile(const ut1::DirEntry &src, const std::filesystem::path &dst, bool verbose, const std::string& verbosePrefix, bool fsync, bool dummyMode, Stats& stats, std::ostream& os)
+{
+    if (verbose)
     {
-        if (verbose)
+        os << verbosePrefix << " file " << src.path() << " -> " << dst;
+    }
+    if (!dummyMode)
+    {
+        ut1::File srcFile(src.path(), O_RDONLY);
+        ut1::File dstFile(dst, O_RDWR);
+        uint64_t numBlocks = ut1::rewriteDifferingBlocks(srcFile, dstFile);
+        if (fsync)
         {
-            std::cout << verbosePrefix << " " << ut1::getFileTypeStr(src, params.followSymlinks) << " " << src.path() << " -> " << dst << "\n";
+            dstFile.fsync();
         }
-        if (!dummyMode)
+        dstFile.close();
+        stats.inplaceFiles++;
+        stats.inplaceBlocks += numBlocks;
+        if (verbose)
         {
-            std::filesystem::copy(src, dst, copy_options);
+            os << " (" << numBlocks << " blocks rewritten)";
         }
     }
+    if (verbose)
+    {
+        os << "\n";
+    }
+}
+
+
+UNIT_TEST(TreeDiff_filesFromTypeMismatch)
+{
+    using ut1::toStr;
+
+    // A dir on the way to a selected path which is a file in dst: Only the selected path is processed below it.
+    std::filesystem::create_directories("TreeDiffTmp/src/a/b");
+    std::filesystem::create_directories("TreeDiffTmp/dst");
+    ut1::writeFile("TreeDiffTmp/src/a/b/f", "f");
+    ut1::writeFile("TreeDiffTmp/src/a/b/g", "g");
+    ut1::writeFile("TreeDiffTmp/dst/a", "a");
+
+    std::vector<std::string> calls;
+    TreeDiff::Params params;
+    params.srcdir = "TreeDiffTmp/src";
+    params.dstdir = "TreeDiffTmp/dst";
+    params.paths.add("a/b/f");
+    params.srcOnly = [&](const ut1::DirEntry &src, const std::filesystem::path &dstdir, TreeDiff::Params&) { calls.push_back("srcOnly " + src.path().generic_string() + " " + dstdir.generic_string()); };
+    params.typeMismatch = [&](const ut1::DirEntry &src, const ut1::DirEntry &, TreeDiff::Params&) { calls.push_back("typeMismatch " + src.path().generic_string()); };
+    params.replaceByDir = [&](const ut1::DirEntry &src, const ut1::DirEntry &dst, TreeDiff::Params&) { calls.push_back("replaceByDir " + src.path().generic_string() + " " + dst.path().generic_string()); };
+    TreeDiff(params).process();
+    ASSERT_EQ(ut1::joinStrings(calls, ", "), "replaceByDir TreeDiffTmp/src/a TreeDiffTmp/dst/a, srcOnly TreeDiffTmp/src/a/b/f TreeDiffTmp/dst/a/b");
+
+    // The dir b is on the way to f as well.
+    calls.clear();
+    params.paths = ut1::PathSet();
+    params.paths.add("a/b/f");
+    std::filesystem::remove("TreeDiffTmp/dst/a");
+    std::filesystem::create_directories("TreeDiffTmp/dst/a");
+    ut1::writeFile("TreeDiffTmp/dst/a/b", "b");
+    TreeDiff(params).process();
+    ASSERT_EQ(ut1::joinStrings(calls, ", "), "replaceByDir TreeDiffTmp/src/a/b TreeDiffTmp/dst/a/b, srcOnly TreeDiffTmp/src/a/b/f TreeDiffTmp/dst/a/b");
+
+    // Without replaceByDir (--new only) dst stays a file: Plain type mismatch, nothing below it is processed.
+    calls.clear();
+    params.paths = ut1::PathSet();
+    params.paths.add("a/b/f");
+    params.replaceByDir = nullptr;
+    TreeDiff(params).process();
+    ASSERT_EQ(ut1::joinStrings(calls, ", "), "typeMismatch TreeDiffTmp/src/a/b");
+    std::filesystem::remove_all("TreeDiffTmp");
+}
+
+
+UNIT_TEST(TreeDiff_deepTree)
+{
+    using ut1::toStr;
+
+    // Tree deeper than PATH_MAX: Listed, compared, printed, copied and removed relative to dir descriptors only.
+    std::filesystem::create_directories("TreeDiffTmp/src");
+    std::filesystem::create_directories("TreeDiffTmp/dst");
+    std::filesystem::path deep = "TreeDiffTmp/src";
+    for (int i = 0; i < 45; i++)
+    {
+        deep /= std::string(100, 'a' + char(i % 26));
+        ut1::mkdirAt(deep);
+    }
+    int fd = ut1::openAt(deep / "f", O_WRONLY | O_CREAT | O_TRUNC);
+    ASSERT_EQ(::write(fd, "data", 4), 4);
+    ::close(fd);
+    ut1::symlinkAt("f", deep / "l");
+    ASSERT_EQ(deep.native().size() > 4096, true);
+
+    std::vector<std::string> calls;
+    Stats stats;
+    std::ostringstream os;
+    TreeDiff::Params params;
+    params.srcdir = "TreeDiffTmp/src";
+    params.dstdir = "TreeDiffTmp/dst";
+    params.srcOnly = [&](const ut1::DirEntry &src, const std::filesystem::path &dstdir, TreeDiff::Params& params_)
+    {
+        calls.push_back("srcOnly " + src.path().filename().string().substr(0, 1));
+        printDirectoryEntry(src, "+ ", "", params_, /*recursive=*/true, /*src=*/true, os);
+        copyRecursive(src, dstdir, std::filesystem::copy_options::copy_symlinks, false, "", params_, false, stats, os);
+    };
+    params.dstOnly = [&](const std::filesystem::path &, const ut1::DirEntry &dst, TreeDiff::Params&) { calls.push_back("dstOnly " + dst.path().filename().string()); };
+    params.mismatch = [&](const ut1::DirEntry &src, const ut1::DirEntry &, TreeDiff::Params&) { calls.push_back("mismatch " + src.path().filename().string()); };
+    params.typeMismatch = [&](const ut1::DirEntry &src, const ut1::DirEntry &, TreeDiff::Params&) { calls.push_back("typeMismatch " + src.path().filename().string()); };
+    TreeDiff(params).process();
+    ASSERT_EQ(ut1::joinStrings(calls, ", "), "srcOnly a");
+    ASSERT_EQ(ut1::hasSuffix(os.str(), "/f\"\n+ symlink \"" + (deep / "l").string() + "\"\n"), true);
+    ASSERT_EQ(stats.copiedBytes, 4u);
+
+    // The copy is complete.
+    calls.clear();
+    std::filesystem::path deepDst = "TreeDiffTmp/dst" / deep.lexically_relative("TreeDiffTmp/src");
+    ASSERT_EQ(ut1::readFileAt(deepDst / "f"), "data");
+    ASSERT_EQ(ut1::readlinkAt(deepDst / "l"), "f");
+    TreeDiff(params).process();
+    ASSERT_EQ(ut1::joinStrings(calls, ", "), "");
+
+    // Differences deep down are found.
+    fd = ut1::openAt(deepDst / "f", O_WRONLY | O_TRUNC);
+    ASSERT_EQ(::write(fd, "diff", 4), 4);
+    ::close(fd);
+    fd = ut1::openAt(deepDst / "g", O_WRONLY | O_CREAT | O_TRUNC);
+    ::close(fd);
+    TreeDiff(params).process();
+    ASSERT_EQ(ut1::joinStrings(calls, ", "), "mismatch f, dstOnly g");
+
+    removeRecursive("TreeDiffTmp", false, "", false, false, os);
+    ASSERT_EQ(ut1::fsExists("TreeDiffTmp"), false);
+    (void)fd;
 }
 
 
@@ -538,21 +1551,51 @@ int main(int argc, char* argv[])
         cl.addOption(' ', "ignore-dirs", "Just process the two specified directories. Ignore subdirectories.");
         cl.addOption(' ', "ignore-special", "Just process regular files, dirs and symbolic links. Ignore block/char devices, pipes and sockets.");
         cl.addOption('F', "ignore-forks", "Ignore all files and dirs in SRCDIR starting with '._' (Apple resource forks).");
+        cl.addOption(' ', "exclude", "Exclude files and dirs matching the glob PATTERN (syntax of .gitignore, e.g. '*.tmp', 'build/', '/cache' or 'doc/**/*.bak'). Patterns without '/' match at any depth, other patterns are relative to SRCDIR/DSTDIR. Excluded entries are ignored in both SRCDIR and DSTDIR (neither reported nor copied nor deleted) and excluded dirs are not read at all. These patterns take precedence over .treesyncignore files. May be specified multiple times.", "PATTERN").listOption();
+        cl.addOption(' ', "include", "Do not exclude files and dirs matching the glob PATTERN, even if they match an --exclude pattern. Entries in excluded dirs cannot be included. May be specified multiple times.", "PATTERN").listOption();
+        cl.addOption(' ', "no-ignore-files", "Do not read .treesyncignore files. By default the patterns in a .treesyncignore file (syntax of .gitignore, '!' includes) exclude files and dirs below its dir, like --exclude/--include. Deeper files take precedence. The files are read from the listed dirs (SRCDIR when comparing, DSTDIR entries are excluded the same way) and are synced like any other file.");
+        cl.addOption(' ', "files-from", "Only process the paths listed in FILE (relative to SRCDIR/DSTDIR, separated by newlines or, if FILE contains any NUL characters, by NULs). Listed dirs are processed recursively. Only the listed entries of their parent dirs are compared and synced (missing parent dirs are created in DSTDIR). These parent dirs are not read at all unless --normalize-filenames or --ignore-case is specified.", "FILE");
+        cl.addOption(' ', "newer-than", "Only process files (everything but dirs) with an mtime at or after TIME: Either an age (e.g. '7d', units s, m, h, d, w) or a local time 'YYYY-MM-DD[ HH:MM[:SS]]'. Like for --min-size etc the SRCDIR file is checked (the DSTDIR file for files only in DSTDIR). Other files are ignored (neither compared nor copied nor deleted) and are counted in --stats.", "TIME");
+        cl.addOption(' ', "older-than", "Only process files with an mtime before TIME (see --newer-than).", "TIME");
+        cl.addOption(' ', "min-size", "Only process files (everything but dirs) with a size of at least SIZE (see --newer-than).", "SIZE");
+        cl.addOption(' ', "max-size", "Only process files (everything but dirs) with a size of at most SIZE (see --newer-than).", "SIZE");
+        cl.addOption(' ', "prune-old-dirs", "With --newer-than: Ignore all files of dirs which are older than TIME in SRCDIR and DSTDIR without looking at them (subdirs are still processed). Creating, renaming or deleting a file updates the mtime of its dir, so this is safe unless files are modified in place (or get older mtimes).");
         cl.addOption(' ', "ignore-forks-dst", "Ignore all files and dirs in DSTDIR starting with '._' (Apple resource forks). Specify this if -D should not remove forks in DSTDIR.");
         cl.addOption(' ', "follow-symlinks", "Follow symlinks. Without this (default) symlinks are compared as distinct filesystem objects.");
         cl.addOption('c', "create-missing-dst", "Create DSTDIR if it does not exist for --new/--update.");
         cl.addOption(' ', "copy-ins", "Copy insertions to DIR during --diff. DSTDIR is not modified.", "DIR");
         cl.addOption(' ', "copy-del", "Copy deletions to DIR during --diff. DSTDIR is not modified.", "DIR");
+        cl.addOption(' ', "delta", "For --update of existing files only transfer the differing parts of the files (rsync algorithm). Blocks of the old DSTDIR file which are found anywhere in the SRCDIR file are reused.");
+        cl.addOption(' ', "append", "For --update of existing files which grew just append the new data to the DSTDIR file if the DSTDIR file is a prefix of the SRCDIR file (verified by comparing the data). Otherwise the whole file is copied.");
+        cl.addOption(' ', "inplace-blocks", "For --update of existing files of the same size just overwrite the differing 4k blocks of the DSTDIR file in place.");
+        cl.addOption(' ', "fsync", "Flush files modified in place (--append, --inplace-blocks) to the device.");
+        cl.addOption(' ', "inplace", "Write --delta updates directly into the DSTDIR file instead of into a temp file which then replaces the DSTDIR file. This only reuses blocks at the same offset.");
+        cl.addOption('j', "jobs", "Run copy/delete operations in N parallel threads. Operations on the same path and on dirs and their contents still run in order and the output is identical to --jobs=1. 0 chooses N based on the devices of SRCDIR and DSTDIR.", "N", "1");
+        cl.addOption(' ', "max-inflight-bytes", "Limit the size of files being copied at the same time for --jobs (suffixes k, M, G and T are supported).", "SIZE", "256M");
+        cl.addOption(' ', "max-inflight-files", "Limit the number of operations running at the same time for --jobs.", "N", "64");
+        cl.addOption(' ', "src-queue-depth", "Limit the number of operations running at the same time on the device of SRCDIR for --jobs. 0 (default) chooses the limit based on the device type (rotational 1, SSD 4, NVMe/network filesystem 32) and adapts it at run time to the observed throughput.", "N", "0");
+        cl.addOption(' ', "dst-queue-depth", "Like --src-queue-depth for the device of DSTDIR. If SRCDIR and DSTDIR are on the same device the smaller of both depths is used.", "N", "0");
+        cl.addOption(' ', "split-threshold", "Compare files of at least SIZE bytes with several threads, each comparing ranges of 64M (suffixes k, M, G and T are supported, 0 disables this).", "SIZE", "1G");
+        cl.addOption(' ', "split-threads", "Number of threads comparing a large file (--split-threshold). 0 chooses the number based on the devices of SRCDIR and DSTDIR (1 for rotational disks, at most 8).", "N", "0");
+        cl.addOption(' ', "schedule", "Order in which the files of each dir are compared and in which pending copies are started (--jobs > 1): name, inode (sort by inode number) or physical (sort by the location of the first block on disk, FIEMAP). inode and physical reduce seeking on rotating disks. Results are always reported in name order.", "MODE", "name");
+        cl.addOption(' ', "cached-first", "Compare the files of each dir which are (mostly) in the page cache first (probed with cachestat()/mincore()), before reading files from the disk. --stats shows the cached/uncached split.");
+        cl.addOption(' ', "no-cache-pollution", "Do not fill the page cache with the data of the compared and copied files: Drop all data from the page cache once it has been compared or written back (posix_fadvise()). The start of the next file is read ahead while a file is compared.");
+        cl.addOption(' ', "direct-io", "Bypass the page cache (O_DIRECT) when comparing and copying files. This falls back to normal I/O per file if O_DIRECT is not supported (e.g. tmpfs, some FUSE filesystems).");
+        cl.addOption(' ', "io-memory", "Limit the total size of the I/O buffers used for comparing, copying and delta transfers, regardless of the file sizes and --jobs (suffixes k, M, G and T are supported). Each operation uses two buffers of 1M.", "SIZE", "64M");
+        cl.addOption(' ', "io-huge-pages", "Back I/O buffers by transparent huge pages. This rounds the buffer size up to 2M.");
+        cl.addOption(' ', "listing-memory", "Limit the memory used for the listings of a pair of dirs (suffixes k, M, G and T are supported, at least 1M, 0 means unlimited). Larger dirs are sorted in temporary files in $TMPDIR (external merge sort) and the files of such dirs are compared in name order (see --schedule).", "SIZE", "0");
 //        cl.addOption('p', "preserve", "Copy mtime for --new and --update."); // todo
 
         cl.addHeader("\nMatching options:\n");
         cl.addOption('C', "ignore-content", "Ignore file content when comparing files. Just compare their size and assume files with the same size are identical.");
         cl.addOption('T', "ignore-mtime", "Ignore mtime for --update and always assume the SRC to be newer than DST if they are different, e.g. always overwrite DST with SRC if SRC and DST are different.");
         cl.addOption('Z', "normalize-filenames", "Apply unicode canonical normalization (NFD) before comparing filenames. Specify this if you want different filenames which only differ in the NFC/NFD encoding to compare as equal.");
+        cl.addOption('I', "ignore-case", "Compare filenames case insensitively (full unicode case folding, combined with --normalize-filenames if specified). Specify this for case insensitive destinations like FAT, exFAT or SMB shares. Names in the same dir which only differ in case are reported and only the smallest one (byte order) is compared.");
 
         cl.addHeader("\nVerbose / common options:\n");
         cl.addOption(' ', "show-matches", "Show matching files for --diff instead of only showing differences (default).");
         cl.addOption(' ', "show-subtree", "For new/deleted dirs show all files/dirs in these trees (default is to just show the new/deleted dir itself).");
+        cl.addOption(' ', "stats", "Print statistics at the end.");
         cl.addOption('v', "verbose", "Increase verbosity. Specify multiple times to be more verbose.");
         cl.addOption('n', "no-color", "Do not color output.");
         cl.addOption('d', "dummy-mode", "Do not write/change/delete anything.");
@@ -601,6 +1644,19 @@ int main(int argc, char* argv[])
         bool noColor = cl("no-color");
         bool createMissingDst = cl("create-missing-dst");
         bool preserve = false; // cl("preserve"); // todo
+        bool delta = cl("delta");
+        bool inplace = cl("inplace");
+        bool append = cl("append");
+        bool inplaceBlocks = cl("inplace-blocks");
+        bool fsync = cl("fsync");
+        bool printStats = cl("stats");
+        unsigned jobs = unsigned(cl.getUInt("jobs"));
+        unsigned srcQueueDepth = unsigned(cl.getUInt("src-queue-depth"));
+        unsigned dstQueueDepth = unsigned(cl.getUInt("dst-queue-depth"));
+        unsigned splitThreads = unsigned(cl.getUInt("split-threads"));
+        ut1::ioConfig.splitThreshold = ut1::parseSize(cl.getStr("split-threshold"));
+        uint64_t maxInflightBytes = ut1::parseSize(cl.getStr("max-inflight-bytes"));
+        size_t maxInflightFiles = cl.getUInt("max-inflight-files");
         std::string copyIns = cl.getStr("copy-ins");
         std::string copyDel = cl.getStr("copy-del");
 
@@ -616,6 +1672,7 @@ int main(int argc, char* argv[])
         }
 
         TerminalColors col(noColor);
+        Stats stats;
 
         TreeDiff::Params params;
         params.srcdir = cl.getArgs()[0];
@@ -624,75 +1681,230 @@ int main(int argc, char* argv[])
         params.ignoreSpecial = cl("ignore-special");
         params.ignoreForksSrc = cl("ignore-forks");
         params.ignoreForksDst = cl("ignore-forks-dst");
+        for (const std::string& pattern: cl.getList("exclude"))
+        {
+            params.filter.getGlobal().add(pattern, /*include=*/false);
+        }
+        for (const std::string& pattern: cl.getList("include"))
+        {
+            params.filter.getGlobal().add(pattern, /*include=*/true);
+        }
+        int64_t now = int64_t(std::time(nullptr));
+        if (cl("newer-than"))
+        {
+            params.newerThan = ut1::parseTime(cl.getStr("newer-than"), now);
+        }
+        if (cl("older-than"))
+        {
+            params.olderThan = ut1::parseTime(cl.getStr("older-than"), now);
+        }
+        if (cl("min-size"))
+        {
+            params.minSize = ut1::parseSize(cl.getStr("min-size"));
+        }
+        if (cl("max-size"))
+        {
+            params.maxSize = ut1::parseSize(cl.getStr("max-size"));
+        }
+        params.pruneOldDirs = cl("prune-old-dirs");
+        if (params.pruneOldDirs && !cl("newer-than"))
+        {
+            cl.error("--prune-old-dirs requires --newer-than.\n");
+        }
+        if (cl("files-from"))
+        {
+            params.paths.addList(ut1::readFile(cl.getStr("files-from")));
+        }
+        if (!cl("no-ignore-files"))
+        {
+            params.filter.setIgnoreFilename(".treesyncignore");
+        }
         params.followSymlinks = cl("follow-symlinks");
         params.ignoreContent = cl("ignore-content");
         params.normalizeFilenames = cl("normalize-filenames");
+        params.ignoreCase = cl("ignore-case");
+        params.cachedFirst = cl("cached-first");
+        params.prefetch = cl("no-cache-pollution");
+        ut1::ioConfig.noCachePollution = cl("no-cache-pollution");
+        ut1::ioConfig.directIo = cl("direct-io");
+        ut1::bufferPool.configure(ut1::defaultBlockSize, ut1::parseSize(cl.getStr("io-memory")), cl("io-huge-pages"));
+        params.stats = &stats;
+        params.listingMemory = ut1::parseSize(cl.getStr("listing-memory"));
+        if ((params.listingMemory > 0) && (params.listingMemory < 1024 * 1024))
+        {
+            cl.error("--listing-memory must be 0 or at least 1M.\n");
+        }
+        std::string schedule = cl.getStr("schedule");
+        if (schedule == "inode")
+        {
+            params.schedule = TreeDiff::SCHEDULE_INODE;
+        }
+        else if (schedule == "physical")
+        {
+            params.schedule = TreeDiff::SCHEDULE_PHYSICAL;
+        }
+        else if (schedule != "name")
+        {
+            cl.error("Unknown --schedule mode '" + schedule + "'. Expected name, inode or physical.\n");
+        }
         std::filesystem::copy_options copy_options_base = params.followSymlinks ? std::filesystem::copy_options::none : std::filesystem::copy_options::copy_symlinks;
 
-        params.srcOnly = ([&](const std::filesystem::directory_entry &src, const std::filesystem::path &dstdir, TreeDiff::Params &params_)
+        // Detect devices.
+        ut1::DeviceInfo srcDevice = ut1::getDeviceInfo(params.srcdir);
+        ut1::DeviceInfo dstDevice = ut1::getDeviceInfo(params.dstdir);
+        if (srcDevice.dev == dstDevice.dev)
+        {
+            // SRCDIR and DSTDIR share one queue: The smaller explicit depth wins.
+            srcQueueDepth = dstQueueDepth = (srcQueueDepth && dstQueueDepth) ? std::min(srcQueueDepth, dstQueueDepth) : std::max(srcQueueDepth, dstQueueDepth);
+        }
+        if (splitThreads == 0)
+        {
+            // Parallel reads of one file only pay off if both devices handle concurrent requests well.
+            splitThreads = std::min({srcDevice.getQueueDepth(), dstDevice.getQueueDepth(), 8u});
+        }
+        ut1::ioConfig.splitThreads = splitThreads;
+        if (jobs == 0)
+        {
+            // Leave room for the queues to grow.
+            jobs = std::min(4 * std::max(srcQueueDepth ? srcQueueDepth : srcDevice.getQueueDepth(), dstQueueDepth ? dstQueueDepth : dstDevice.getQueueDepth()), 64u);
+        }
+
+        // All copy/delete operations run on the executor (in parallel for --jobs > 1) and all output is sequenced through it.
+        // Operations may still run after TreeDiff is done (or destroyed on errors), so they use params rather than params_.
+        ut1::Executor executor(jobs, maxInflightBytes, maxInflightFiles);
+
+        // One I/O queue per device. Operations use the queues of all devices they read from or write to.
+        std::map<dev_t, size_t> deviceQueues;
+        std::vector<std::string> queueNames;
+        auto getQueueMask = [&](const ut1::DeviceInfo& device, unsigned depth, const std::string& name)
+        {
+            auto it = deviceQueues.find(device.dev);
+            if (it == deviceQueues.end())
+            {
+                it = deviceQueues.emplace(device.dev, executor.addQueue(depth ? depth : device.getQueueDepth(), depth == 0)).first;
+                queueNames.push_back(name + " (" + ut1::getDeviceTypeStr(device.type) + (device.name.empty() ? "" : " " + device.name) + ")");
+                if (verbose && executor.isParallel())
+                {
+                    std::cout << "I/O queue for " << queueNames.back() << ": Depth " << executor.getQueueDepth(it->second) << (depth ? "" : " (adaptive)") << "\n";
+                }
+            }
+            return ut1::Executor::getQueueMask(it->second);
+        };
+        uint32_t srcQueue = getQueueMask(srcDevice, srcQueueDepth, "SRCDIR");
+        uint32_t dstQueue = getQueueMask(dstDevice, dstQueueDepth, "DSTDIR");
+        uint32_t copyInsQueue = copyIns.empty() ? 0 : getQueueMask(ut1::getDeviceInfo(copyIns), 0, "--copy-ins");
+        uint32_t copyDelQueue = copyDel.empty() ? 0 : getQueueMask(ut1::getDeviceInfo(copyDel), 0, "--copy-del");
+
+        // Pending copies of regular files are started in --schedule order.
+        auto getCopyScheduleKey = [&](const ut1::DirEntry &src, const TreeDiff::Params &params_) -> uint64_t
+        {
+            return (executor.isParallel() && ut1::fsIsRegular(src, params_.followSymlinks)) ? TreeDiff::getScheduleKey(src, params_).second : 0;
+        };
+
+        std::filesystem::path createdParentDir;
+        params.srcOnly = ([&](const ut1::DirEntry &src, const std::filesystem::path &dstdir, TreeDiff::Params &params_)
         {
             if (diff)
             {
-                printDirectoryEntry(src, col.ins + "+ ", col.nor, params_, showSubtree, /*src=*/true);
+                executor.output([&](std::ostream& os)
+                {
+                    printDirectoryEntry(src, col.ins + "+ ", col.nor, params_, showSubtree, /*src=*/true, os);
+                });
                 if (!copyIns.empty())
                 {
-                    mkDirs(copyIns, verbose, "Creating --copy-ins destination dir", dummyMode);
-                    copyRecursive(src, copyIns, std::filesystem::copy_options::overwrite_existing | copy_options_base, verbose, "Copying (--copy-ins)", params_, dummyMode);
+                    executor.submit(copyIns, 0, [&](std::ostream& os)
+                    {
+                        mkDirs(copyIns, verbose, "Creating --copy-ins destination dir", dummyMode, os);
+                    }, copyInsQueue);
+                    executor.submit(std::filesystem::path(copyIns) / src.path().filename(), getCopySize(src, params_.followSymlinks), [&, src](std::ostream& os)
+                    {
+                        copyRecursive(src, copyIns, std::filesystem::copy_options::overwrite_existing | copy_options_base, verbose, "Copying (--copy-ins)", params, dummyMode, stats, os);
+                    }, srcQueue | copyInsQueue);
                 }
             }
             if (new_)
             {
-                copyRecursive(src, dstdir, copy_options_base, verbose, "Copying (new)", params_, dummyMode);
+                if ((!params_.paths.empty()) && (dstdir != createdParentDir) && (!ut1::fsIsDirectory(dstdir, /*followSymlinks=*/false)))
+                {
+                    // Parent dir of selected paths (--files-from), created once for all its entries.
+                    createdParentDir = dstdir;
+                    executor.submit(dstdir, 0, [&, dstdir](std::ostream& os)
+                    {
+                        mkDirs(dstdir, verbose, "Creating dir", dummyMode, os);
+                    }, dstQueue);
+                }
+                executor.submit(dstdir / src.path().filename(), getCopySize(src, params_.followSymlinks), [&, src, dstdir](std::ostream& os)
+                {
+                    copyRecursive(src, dstdir, copy_options_base, verbose, "Copying (new)", params, dummyMode, stats, os);
+                }, srcQueue | dstQueue, getCopyScheduleKey(src, params_));
             }
         });
 
-        params.dstOnly = ([&](const std::filesystem::path &srcdir, const std::filesystem::directory_entry &dst, TreeDiff::Params &params_)
+        params.dstOnly = ([&](const std::filesystem::path &srcdir, const ut1::DirEntry &dst, TreeDiff::Params &params_)
         {
             (void)srcdir;
             if (diff)
             {
-                printDirectoryEntry(dst, col.del + "- ", col.nor, params_, showSubtree, /*src=*/false);
+                executor.output([&](std::ostream& os)
+                {
+                    printDirectoryEntry(dst, col.del + "- ", col.nor, params_, showSubtree, /*src=*/false, os);
+                });
                 if (!copyDel.empty())
                 {
-                    mkDirs(copyDel, verbose, "Creating --copy-del destination dir", dummyMode);
-                    copyRecursive(dst, copyDel, std::filesystem::copy_options::overwrite_existing | copy_options_base, verbose, "Copying (--copy-del)", params_, dummyMode);
+                    executor.submit(copyDel, 0, [&](std::ostream& os)
+                    {
+                        mkDirs(copyDel, verbose, "Creating --copy-del destination dir", dummyMode, os);
+                    }, copyDelQueue);
+                    executor.submit(std::filesystem::path(copyDel) / dst.path().filename(), getCopySize(dst, params_.followSymlinks), [&, dst](std::ostream& os)
+                    {
+                        copyRecursive(dst, copyDel, std::filesystem::copy_options::overwrite_existing | copy_options_base, verbose, "Copying (--copy-del)", params, dummyMode, stats, os);
+                    }, dstQueue | copyDelQueue);
                 }
             }
             if (delete_)
             {
-                removeRecursive(dst, verbose, "Deleting", params_.followSymlinks, dummyMode);
+                executor.submit(dst.path(), 0, [&, dst](std::ostream& os)
+                {
+                    removeRecursive(dst, verbose, "Deleting", params.followSymlinks, dummyMode, os);
+                }, dstQueue);
             }
         });
 
-        params.match = ([&](const std::filesystem::directory_entry &src, const std::filesystem::directory_entry &dst, TreeDiff::Params &params_)
+        params.match = ([&](const ut1::DirEntry &src, const ut1::DirEntry &dst, TreeDiff::Params &params_)
         {
             if (diff && showMatches)
             {
-                std::cout << "= " << ut1::getFileTypeStr(src, params_.followSymlinks) << " " << src.path() << " and " << ut1::getFileTypeStr(dst, params_.followSymlinks) << " " << dst.path() << "\n";
+                executor.output([&](std::ostream& os)
+                {
+                    os << "= " << ut1::getFileTypeStr(src, params_.followSymlinks) << " " << src.path() << " and " << ut1::getFileTypeStr(dst, params_.followSymlinks) << " " << dst.path() << "\n";
+                });
             }
             if (update)
             {
-                if ((!ignoreMtime) && (ut1::getLastWriteTime(src, params_.followSymlinks) > ut1::getLastWriteTime(dst, params_.followSymlinks)))
+                if ((!ignoreMtime) && (ut1::getStatAt(src.path(), params_.followSymlinks).getMTime() > ut1::getStatAt(dst.path(), params_.followSymlinks).getMTime()))
                 {
                     if (!dummyMode)
                     {
                         if (preserve)
                         {
-                            if (verbose)
+                            executor.submit(dst.path(), 0, [&, src, dst](std::ostream& os)
                             {
-                                std::cout << "Updating mtime " << ut1::getFileTypeStr(src, params_.followSymlinks) << " " << src.path() << " -> " << dst.path() << "\n";
-                            }
-                            if (!dummyMode)
-                            {
-                                ut1::setLastWriteTime(dst, ut1::getLastWriteTime(src, params_.followSymlinks), params_.followSymlinks);
-                            }
+                                if (verbose)
+                                {
+                                    os << "Updating mtime " << ut1::getFileTypeStr(src, params.followSymlinks) << " " << src.path() << " -> " << dst.path() << "\n";
+                                }
+                                if (!dummyMode)
+                                {
+                                    ut1::setMTimeAt(dst.path(), ut1::getStatAt(src.path(), params.followSymlinks).getMTimeSpec(), params.followSymlinks);
+                                }
+                            }, dstQueue);
                         }
                     }
                 }
             }
         });
 
-        params.mismatch = ([&](const std::filesystem::directory_entry &src, const std::filesystem::directory_entry &dst, TreeDiff::Params &params_)
+        params.mismatch = ([&](const ut1::DirEntry &src, const ut1::DirEntry &dst, TreeDiff::Params &params_)
         {
             if (diff)
             {
@@ -700,14 +1912,14 @@ int main(int argc, char* argv[])
                 std::string dstInfo;
                 if (ut1::getFileType(src, params_.followSymlinks) == ut1::FT_SYMLINK)
                 {
-                    srcInfo = " -> \"" + std::filesystem::read_symlink(src).string() + "\"";
-                    dstInfo = " -> \"" + std::filesystem::read_symlink(dst).string() + "\"";
+                    srcInfo = " -> \"" + ut1::readlinkAt(src.path()) + "\"";
+                    dstInfo = " -> \"" + ut1::readlinkAt(dst.path()) + "\"";
                 }
                 else
                 {
-                    if (src.file_size() != dst.file_size())
+                    if (src.getSize() != dst.getSize())
                     {
-                        dstInfo = " (size " + std::to_string(src.file_size()) + " != " + std::to_string(dst.file_size()) + ")";
+                        dstInfo = " (size " + std::to_string(src.getSize()) + " != " + std::to_string(dst.getSize()) + ")";
                     }
                     else
                     {
@@ -715,68 +1927,141 @@ int main(int argc, char* argv[])
                     }
 
                 }
-                std::cout << "Diff: " << ut1::getFileTypeStr(src, params_.followSymlinks) << " " << src.path() << srcInfo << " and " << ut1::getFileTypeStr(dst, params_.followSymlinks) << " " << dst.path() << dstInfo << "\n";
+                executor.output([&](std::ostream& os)
+                {
+                    os << "Diff: " << ut1::getFileTypeStr(src, params_.followSymlinks) << " " << src.path() << srcInfo << " and " << ut1::getFileTypeStr(dst, params_.followSymlinks) << " " << dst.path() << dstInfo << "\n";
+                });
             }
             if (update)
             {
-                if (ignoreMtime || (ut1::getLastWriteTime(src, params_.followSymlinks) > ut1::getLastWriteTime(dst, params_.followSymlinks)))
+                if (ignoreMtime || (ut1::getStatAt(src.path(), params_.followSymlinks).getMTime() > ut1::getStatAt(dst.path(), params_.followSymlinks).getMTime()))
                 {
-                    copyRecursive(src, dst.path().parent_path(), std::filesystem::copy_options::overwrite_existing | copy_options_base, verbose, "Copying (update)", params_, dummyMode);
+                    executor.submit(dst.path(), getCopySize(src, params_.followSymlinks), [&, src, dst](std::ostream& os)
+                    {
+                        bool regular = ut1::fsIsRegular(src, params.followSymlinks) && ut1::fsIsRegular(dst, /*followSymlinks=*/false);
+                        if (append && regular && (src.getSize() > dst.getSize()) && appendUpdateFile(src, dst.path(), verbose, "Appending to", fsync, dummyMode, stats, os))
+                        {
+                            // Just the new data was appended.
+                        }
+                        else if (inplaceBlocks && regular && (src.getSize() == dst.getSize()))
+                        {
+                            inplaceUpdateFile(src, dst.path(), verbose, "Updating blocks of", fsync, dummyMode, stats, os);
+                        }
+                        else if (delta && regular)
+                        {
+                            deltaUpdateFile(src, dst.path(), inplace, verbose, "Delta updating", dummyMode, stats, os);
+                        }
+                        else
+                        {
+                            copyRecursive(src, dst.path().parent_path(), std::filesystem::copy_options::overwrite_existing | copy_options_base, verbose, "Copying (update)", params, dummyMode, stats, os);
+                        }
+                    }, srcQueue | dstQueue, getCopyScheduleKey(src, params_));
                 }
             }
         });
 
-        params.typeMismatch = ([&](const std::filesystem::directory_entry &src, const std::filesystem::directory_entry &dst, TreeDiff::Params &params_)
+        params.typeMismatch = ([&](const ut1::DirEntry &src, const ut1::DirEntry &dst, TreeDiff::Params &params_)
         {
             if (diff)
             {
-                std::cout << "Type mismatch: " << ut1::getFileTypeStr(src, params_.followSymlinks) << " " << src.path() << " and " << ut1::getFileTypeStr(dst, params_.followSymlinks) << " " << dst.path() << "\n";
+                executor.output([&](std::ostream& os)
+                {
+                    os << "Type mismatch: " << ut1::getFileTypeStr(src, params_.followSymlinks) << " " << src.path() << " and " << ut1::getFileTypeStr(dst, params_.followSymlinks) << " " << dst.path() << "\n";
+                });
             }
             if (update)
             {
-                copyRecursive(src, dst.path().parent_path(), std::filesystem::copy_options::overwrite_existing | copy_options_base, verbose, "Copying (type mismatch)", params_, dummyMode);
+                executor.submit(dst.path(), getCopySize(src, params_.followSymlinks), [&, src, dst](std::ostream& os)
+                {
+                    copyRecursive(src, dst.path().parent_path(), std::filesystem::copy_options::overwrite_existing | copy_options_base, verbose, "Copying (type mismatch)", params, dummyMode, stats, os);
+                }, srcQueue | dstQueue, getCopyScheduleKey(src, params_));
             }
         });
 
-        params.progressDirs = ([&](const std::filesystem::directory_entry &src, const std::filesystem::directory_entry &dst, TreeDiff::Params &params_)
+        if (update)
+        {
+            // Without --update the dst non-dir stays, so the walk must not descend into src (plain typeMismatch).
+            params.replaceByDir = ([&](const ut1::DirEntry &src, const ut1::DirEntry &dst, TreeDiff::Params &params_)
+            {
+                if (diff)
+                {
+                    executor.output([&](std::ostream& os)
+                    {
+                        os << "Type mismatch: " << ut1::getFileTypeStr(src, params_.followSymlinks) << " " << src.path() << " and " << ut1::getFileTypeStr(dst, params_.followSymlinks) << " " << dst.path() << "\n";
+                    });
+                }
+                // Only the selected entries below src are copied into the new dir (--files-from).
+                createdParentDir = dst.path();
+                executor.submit(dst.path(), 0, [&, dst](std::ostream& os)
+                {
+                    removeRecursive(dst, verbose, "Deleting (type mismatch)", params.followSymlinks, dummyMode, os);
+                    mkDirs(dst.path(), verbose, "Creating dir", dummyMode, os);
+                }, dstQueue);
+            });
+        }
+
+        params.progressDirs = ([&](const ut1::DirEntry &src, const ut1::DirEntry &dst, TreeDiff::Params &params_)
         {
             (void)params_;
             if (verbose >= 2)
             {
-                std::cout << "Processing dirs " << src.path() << " and " << dst.path() << "\n";
+                executor.output([&](std::ostream& os)
+                {
+                    os << "Processing dirs " << src.path() << " and " << dst.path() << "\n";
+                });
             }
         });
 
-        params.progressFiles = ([&](const std::filesystem::directory_entry &src, const std::filesystem::directory_entry &dst, TreeDiff::Params &params_)
+        params.progressFiles = ([&](const ut1::DirEntry &src, const ut1::DirEntry &dst, TreeDiff::Params &params_)
         {
             (void)params_;
             if (verbose >= 3)
             {
-                std::cout << "Processing " << ut1::getFileTypeStr(src, params_.followSymlinks) << " " << src.path() << " and " << ut1::getFileTypeStr(dst, params_.followSymlinks) << " " << dst.path() << "\n";
+                executor.output([&](std::ostream& os)
+                {
+                    os << "Processing " << ut1::getFileTypeStr(src, params_.followSymlinks) << " " << src.path() << " and " << ut1::getFileTypeStr(dst, params_.followSymlinks) << " " << dst.path() << "\n";
+                });
             }
         });
 
-        params.ignoredDir = ([&](const std::filesystem::directory_entry &entry, TreeDiff::Params &params_)
+        params.ignoredDir = ([&](const ut1::DirEntry &entry, TreeDiff::Params &params_)
         {
             (void)params_;
             if (diff || verbose)
             {
-                std::cout << "Ignoring dir " << entry.path() << "\n";
+                executor.output([&](std::ostream& os)
+                {
+                    os << "Ignoring dir " << entry.path() << "\n";
+                });
+            }
+        });
+
+        params.ignoredFile = ([&](const ut1::DirEntry &entry, TreeDiff::Params &params_)
+        {
+            if (diff || verbose)
+            {
+                executor.output([&](std::ostream& os)
+                {
+                    os << "Ignoring " << ut1::getFileTypeStr(entry, params_.followSymlinks) << " " << entry.path() << "\n";
+                });
             }
         });
 
-        params.ignoredFile = ([&](const std::filesystem::directory_entry &entry, TreeDiff::Params &params_)
+        params.nameCollision = ([&](const ut1::DirEntry &used, const ut1::DirEntry &ignored, TreeDiff::Params &params_)
         {
             if (diff || verbose)
             {
-                std::cout << "Ignoring " << ut1::getFileTypeStr(entry, params_.followSymlinks) << " " << entry.path() << "\n";
+                executor.output([&](std::ostream& os)
+                {
+                    os << "Ignoring " << ut1::getFileTypeStr(ignored, params_.followSymlinks) << " " << ignored.path() << " (same name as " << used.path() << ")\n";
+                });
             }
         });
 
         // Create missing dest dir (--create-missing-dst)?
         if (new_ && (!ut1::fsExists(params.dstdir)) && createMissingDst)
         {
-            mkDirs(params.dstdir, verbose, "Creating destination dir", dummyMode);
+            mkDirs(params.dstdir, verbose, "Creating destination dir", dummyMode, std::cout);
         }
 
         // Check for src/dst directory existence.
@@ -801,6 +2086,27 @@ int main(int argc, char* argv[])
         // Diff/process dirs, recursively.
         TreeDiff treediff(params);
         treediff.process();
+        executor.wait();
+
+        if (printStats)
+        {
+            if (executor.isParallel())
+            {
+                for (const auto& [dev, queue]: deviceQueues)
+                {
+                    stats.queueDepths.emplace_back(queueNames[queue], executor.getQueueDepth(queue));
+                }
+            }
+            stats.deltaEnabled = delta;
+            stats.appendEnabled = append;
+            stats.inplaceEnabled = inplaceBlocks;
+            stats.cachedFirstEnabled = params.cachedFirst;
+            stats.externalSortEnabled = params.listingMemory > 0;
+            stats.nameFoldingEnabled = params.normalizeFilenames || params.ignoreCase;
+            stats.fileFilterEnabled = params.hasFileFilter();
+            stats.pruneOldDirsEnabled = params.pruneOldDirs;
+            stats.print(std::cout);
+        }
     }
     catch (const std::exception &e)
     {
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+#
+# Generate src/UnicodeTables.inc (canonical decomposition, combining classes, compositions and case folding) for src/Unicode.cpp
+# from the Unicode Character Database of the Python unicodedata module.
+#
+# Copyright (c) 2024 Johannes Overmann
+#
+# Distributed under the Boost Software License, Version 1.0.
+# (See accompanying file LICENSE or copy at https://www.boost.org/LICENSE_1_0.txt)
+#
+# Usage: tools/genUnicodeTables.py > src/UnicodeTables.inc
+
+import sys
+import unicodedata
+
+MAX_CODEPOINT = 0x110000
+BLOCK_SHIFT = 7
+BLOCK_SIZE = 1 << BLOCK_SHIFT
+HANGUL_FIRST = 0xAC00
+HANGUL_LAST = 0xD7A3
+
+
+def is_hangul_syllable(cp):
+    return HANGUL_FIRST <= cp <= HANGUL_LAST
+
+
+def canonical_decomposition(cp):
+    """Return the single step canonical decomposition of cp (list of codepoints) or None."""
+    d = unicodedata.decomposition(chr(cp))
+    if not d or d.startswith('<'):
+        return None
+    return [int(x, 16) for x in d.split()]
+
+
+def full_decomposition(cp):
+    """Return the full (recursive) canonical decomposition of cp or None."""
+    d = canonical_decomposition(cp)
+    if d is None:
+        return None
+    r = []
+    for c in d:
+        r += full_decomposition(c) or [c]
+    return r
+
+
+def two_stage(values, value_type, name):
+    """Emit a two stage table: name_index maps the block of a codepoint to a block of name_blocks."""
+    blocks = []
+    block_ids = {}
+    index = []
+    for start in range(0, MAX_CODEPOINT, BLOCK_SIZE):
+        block = tuple(values[start:start + BLOCK_SIZE])
+        if block not in block_ids:
+            block_ids[block] = len(blocks)
+            blocks.append(block)
+        index.append(block_ids[block])
+    assert len(blocks) < 256
+    out = []
+    out.append('const uint8_t %sIndex[%d] = {' % (name, len(index)))
+    out += wrap(index)
+    out.append('};')
+    out.append('const %s %sBlocks[%d][%d] = {' % (value_type, name, len(blocks), BLOCK_SIZE))
+    for block in blocks:
+        out.append('    {')
+        out += wrap(block, '        ')
+        out.append('    },')
+    out.append('};')
+    return out
+
+
+def wrap(values, indent='    ', per_line=16):
+    return [indent + ', '.join(str(v) for v in values[i:i + per_line]) + ',' for i in range(0, len(values), per_line)]
+
+
+def main():
+    ccc = [0] * MAX_CODEPOINT
+    decomp_offset = [0] * MAX_CODEPOINT
+    decomp_data = [0]
+    fold_offset = [0] * MAX_CODEPOINT
+    fold_data = [0]
+    compositions = []
+    for cp in range(MAX_CODEPOINT):
+        if 0xD800 <= cp <= 0xDFFF:
+            continue
+        c = chr(cp)
+        ccc[cp] = unicodedata.combining(c)
+        # Full case folding (status C and F of CaseFolding.txt).
+        folded = c.casefold()
+        if folded != c:
+            fold_offset[cp] = len(fold_data)
+            fold_data += [len(folded)] + [ord(x) for x in folded]
+        if is_hangul_syllable(cp):
+            continue
+        d = full_decomposition(cp)
+        if d is not None:
+            decomp_offset[cp] = len(decomp_data)
+            decomp_data += [len(d)] + d
+            # Primary composites: Canonical pairs which are recomposed by NFC (no singletons, no exclusions).
+            pair = canonical_decomposition(cp)
+            if len(pair) == 2 and unicodedata.normalize('NFC', c) == c:
+                compositions.append((pair[0], pair[1], cp))
+    assert len(decomp_data) < 65536
+    assert len(fold_data) < 65536
+    compositions.sort()
+
+    out = []
+    out.append('// Unicode tables for Unicode.cpp.')
+    out.append('//')
+    out.append('// Generated by tools/genUnicodeTables.py from the Unicode Character Database %s. Do not edit.' % unicodedata.unidata_version)
+    out.append('')
+    out.append('constexpr unsigned blockShift = %d;' % BLOCK_SHIFT)
+    out.append('')
+    out.append('/// Canonical combining class.')
+    out += two_stage(ccc, 'uint8_t', 'ccc')
+    out.append('')
+    out.append('/// Offset of the full canonical decomposition in decompData (0 = none, Hangul syllables are decomposed algorithmically).')
+    out += two_stage(decomp_offset, 'uint16_t', 'decomp')
+    out.append('')
+    out.append('/// Decompositions: Number of codepoints followed by the codepoints.')
+    out.append('const uint32_t decompData[%d] = {' % len(decomp_data))
+    out += wrap(decomp_data)
+    out.append('};')
+    out.append('')
+    out.append('/// Offset of the full case folding in foldData (0 = none).')
+    out += two_stage(fold_offset, 'uint16_t', 'fold')
+    out.append('')
+    out.append('/// Case foldings: Number of codepoints followed by the codepoints.')
+    out.append('const uint32_t foldData[%d] = {' % len(fold_data))
+    out += wrap(fold_data)
+    out.append('};')
+    out.append('')
+    out.append('/// Primary composites {first, second, composite}, sorted by first and second.')
+    out.append('const uint32_t compositions[%d][3] = {' % len(compositions))
+    out += wrap(['{%d, %d, %d}' % t for t in compositions], per_line=6)
+    out.append('};')
+    sys.stdout.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()